@@ -0,0 +1,381 @@
+// This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+// Copyright (c) 2025 Ian Thomas
+
+#include "storylet_framework/storylets.h"
+#include "storylet_framework/json_loader.h"
+#include "expression_parser/expression_cache.h"
+#include "catch_amalgamated.hpp"
+#include <random>
+#include <sstream>
+#include <string>
+
+using namespace StoryletFramework;
+
+namespace {
+
+// Storylets with a spread of conditions and priorities, roughly like the sample decks.
+void FillDeck(Deck& deck, int size) {
+    const char* conditions[] = { "", "street_wealth>=0", "street_wealth<=0", "street_tag('shops')",
+                                 "street_id=='castlestreet' and noble_storyline>0" };
+    for (int i = 0; i < size; i++) {
+        auto storylet = std::make_shared<Storylet>("storylet_" + std::to_string(i));
+        storylet->SetCondition(conditions[i % 5]);
+        if (i % 7 == 0)
+            storylet->SetPriority(std::string("street_wealth + 1"));
+        else
+            storylet->SetPriority(i % 4);
+        deck.AddStorylet(storylet);
+    }
+}
+
+void MakeStreetContext(Context& context) {
+    context["street_id"] = std::string("market");
+    context["street_wealth"] = 0;
+    context["noble_storyline"] = 1.0;
+    context["street_tag"] = ExpressionParser::make_function_wrapper([](const std::string& tag) { return tag == "shops"; });
+}
+
+// The draw as it was before it was rewritten, kept for comparison.
+std::vector<std::shared_ptr<Storylet>> LegacyDraw(Deck& deck, const std::vector<std::shared_ptr<Storylet>>& all, int count) {
+    std::unordered_map<int, std::vector<std::shared_ptr<Storylet>>> priorityMap;
+    std::vector<std::shared_ptr<Storylet>> toProcess = all;
+    while (toProcess.size() > 0) {
+        std::shared_ptr<Storylet> storylet = toProcess.front();
+        toProcess.erase(toProcess.begin());
+        if (!storylet->CanDraw(0) || !storylet->CheckCondition(*deck.context))
+            continue;
+        priorityMap[storylet->CalcCurrentPriority(*deck.context, deck.useSpecificity)].push_back(storylet);
+    }
+    std::vector<int> sortedPriorities;
+    for (const auto& [priority, _] : priorityMap)
+        sortedPriorities.push_back(priority);
+    std::sort(sortedPriorities.begin(), sortedPriorities.end(), std::greater<int>());
+    std::vector<std::shared_ptr<Storylet>> drawPile;
+    for (int priority : sortedPriorities) {
+        auto& bucket = priorityMap[priority];
+        std::random_device rd;
+        std::mt19937 generator(rd());
+        for (size_t i = bucket.size() - 1; i > 0; --i) {
+            std::uniform_int_distribution<size_t> distribution(0, i);
+            std::swap(bucket[i], bucket[distribution(generator)]);
+        }
+        for (std::shared_ptr<Storylet> storylet : bucket) {
+            drawPile.push_back(storylet);
+            if (count > -1 && drawPile.size() >= static_cast<size_t>(count))
+                break;
+        }
+    }
+    return drawPile;
+}
+
+}
+
+TEST_CASE("Draw latency", "[benchmark]") {
+
+    for (int size : { 100, 1000, 10000, 100000, 1000000 }) {
+        Context context;
+        MakeStreetContext(context);
+        Deck deck(context);
+        FillDeck(deck, size);
+        std::string suffix = " from " + std::to_string(size);
+
+        BENCHMARK("Draw 1" + suffix) {
+            return deck.Draw(1);
+        };
+        BENCHMARK("Draw 10" + suffix) {
+            return deck.Draw(10);
+        };
+        BENCHMARK("Draw all" + suffix) {
+            return deck.Draw();
+        };
+
+        // The old draw is quadratic, so only compare it on the smaller decks.
+        if (size <= 10000) {
+            std::vector<std::shared_ptr<Storylet>> all;
+            for (int i = 0; i < size; i++)
+                all.push_back(deck.GetStorylet("storylet_" + std::to_string(i)));
+            BENCHMARK("Legacy draw 1" + suffix) {
+                return LegacyDraw(deck, all, 1);
+            };
+        }
+    }
+}
+
+TEST_CASE("Draw with cooldowns", "[benchmark]") {
+
+    // Most storylets in a long-running deck have been played and are retired or cooling down.
+    for (int size : { 10000, 100000, 1000000 }) {
+        Context context;
+        MakeStreetContext(context);
+        Deck deck(context);
+        FillDeck(deck, size);
+        for (int i = 0; i < size; i++) {
+            if (i % 10 == 0)
+                continue;
+            auto storylet = deck.GetStorylet("storylet_" + std::to_string(i));
+            storylet->SetRedraw((i % 2 == 0) ? REDRAW_NEVER : 1000000);
+            storylet->Play();
+        }
+        std::string suffix = " from " + std::to_string(size) + ", 90% played";
+
+        BENCHMARK("Draw 1" + suffix) {
+            return deck.Draw(1);
+        };
+        BENCHMARK("Draw all" + suffix) {
+            return deck.Draw();
+        };
+    }
+}
+
+TEST_CASE("Draw after a small change", "[benchmark]") {
+
+    // Ambient dialogue: many storylets, each keyed on one of many variables, where
+    // each play only changes one of them.
+    const int variables = 100;
+    Context context;
+    context["mood"] = std::string("calm");
+    for (int i = 0; i < variables; i++)
+        context["ambient_" + std::to_string(i)] = 0;
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("ambient_line_" + std::to_string(i));
+        storylet->SetCondition("ambient_" + std::to_string(i % variables) + " >= " + std::to_string(i % 3) + " and mood == 'calm'");
+        deck.AddStorylet(storylet);
+    }
+    deck.Draw();
+
+    int change = 0;
+    BENCHMARK("Draw 1 from 30000 after changing 1 of 100 variables") {
+        context["ambient_" + std::to_string(change % variables)] = change % 4;
+        change++;
+        return deck.Draw(1);
+    };
+    BENCHMARK("Draw 1 from 30000 after changing the shared variable") {
+        context["mood"] = std::string((change++ % 2) ? "calm" : "wary");
+        return deck.Draw(1);
+    };
+}
+
+TEST_CASE("Draw with range conditions", "[benchmark]") {
+
+    // Storylets gated on thresholds of one variable, which changes every draw.
+    Context context;
+    context["wealth"] = 0;
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("range_" + std::to_string(i));
+        std::string threshold = std::to_string(i % 1000);
+        storylet->SetCondition((i % 2) ? "wealth >= " + threshold : "wealth < " + threshold);
+        deck.AddStorylet(storylet);
+    }
+
+    int change = 0;
+    BENCHMARK("Draw 1 from 30000 range conditions") {
+        context["wealth"] = (change++ * 37) % 1000;
+        return deck.Draw(1);
+    };
+}
+
+TEST_CASE("Draw with equality conditions", "[benchmark]") {
+
+    // A location deck: storylets for each of 500 locations, and the player moves every draw.
+    const int locations = 500;
+    Context context;
+    context["street_id"] = std::string("street_0");
+    context["mood"] = std::string("calm");
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("location_" + std::to_string(i));
+        std::string street = "'street_" + std::to_string(i % locations) + "'";
+        storylet->SetCondition((i % 3) ? "street_id == " + street : "street_id == " + street + " and mood == 'calm'");
+        deck.AddStorylet(storylet);
+    }
+
+    int move = 0;
+    BENCHMARK("Draw 1 from 30000 equality conditions, 500 values") {
+        context["street_id"] = "street_" + std::to_string((move++ * 37) % locations);
+        return deck.Draw(1);
+    };
+}
+
+TEST_CASE("Draw with shared subconditions", "[benchmark]") {
+
+    // Conditions that differ only in their last term, over a variable that changes every draw.
+    Context context;
+    MakeStreetContext(context);
+    context["street_tag"] = ExpressionParser::make_function_wrapper([](const std::string& tag) { return tag == "shops"; }, ExpressionParser::Purity::Pure);
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("shared_" + std::to_string(i));
+        storylet->SetCondition("street_wealth * 2 + 1 >= 0 and street_tag('shops') and street_id != 'castle' and noble_storyline + " + std::to_string(i % 1000) + " > street_wealth");
+        deck.AddStorylet(storylet);
+    }
+
+    int change = 0;
+    BENCHMARK("Draw 1 from 30000, separate conditions") {
+        deck.useConditionGraph = false;
+        context["street_wealth"] = (change++ % 5) - 2;
+        return deck.Draw(1);
+    };
+    BENCHMARK("Draw 1 from 30000, condition graph") {
+        deck.useConditionGraph = true;
+        context["street_wealth"] = (change++ % 5) - 2;
+        return deck.Draw(1);
+    };
+}
+
+TEST_CASE("Draw with stable host functions", "[benchmark]") {
+
+    // A host function standing in for a world query, called by every condition with a handful of arguments.
+    auto query = [](const std::string& tag) {
+        size_t hash = 0;
+        for (int i = 0; i < 200; i++)
+            hash = hash * 31 + tag[i % tag.size()];
+        return hash % 3 != 0;
+    };
+    const char* tags[] = { "shops", "threat", "noble", "market" };
+    Context context;
+    context["mood"] = 0;
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("query_" + std::to_string(i));
+        storylet->SetCondition(std::string("encounter_tag('") + tags[i % 4] + "') or mood > 0");
+        deck.AddStorylet(storylet);
+    }
+
+    BENCHMARK("Draw 1 from 30000, volatile function") {
+        context["encounter_tag"] = ExpressionParser::make_function_wrapper(query);
+        return deck.Draw(1);
+    };
+    BENCHMARK("Draw 1 from 30000, stable function") {
+        context["encounter_tag"] = ExpressionParser::make_function_wrapper(query, ExpressionParser::Purity::Stable);
+        return deck.Draw(1);
+    };
+}
+
+TEST_CASE("Draw lazily from a tiered deck", "[benchmark]") {
+
+    // A few high-priority beats over a mass of low-priority barks.
+    Context context;
+    context["mood"] = 0;
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("tiered_" + std::to_string(i));
+        storylet->SetPriority(i < 10 ? 10 : 0);
+        storylet->SetCondition("mood + 1 >= " + std::to_string(i % 7 - 3));
+        deck.AddStorylet(storylet);
+    }
+
+    int change = 0;
+    BENCHMARK("Draw 1 from 30000") {
+        context["mood"] = change++ % 2;
+        return deck.Draw(1);
+    };
+    BENCHMARK("First of DrawLazy from 30000") {
+        context["mood"] = change++ % 2;
+        for (auto& storylet : deck.DrawLazy())
+            return storylet;
+        return std::shared_ptr<Storylet>();
+    };
+}
+
+TEST_CASE("Draw single from beats and barks", "[benchmark]") {
+
+    // A few story beats above a mass of barks, with one beat whose priority depends on the context.
+    Context context;
+    MakeStreetContext(context);
+    Deck deck(context);
+    for (int i = 0; i < 30000; i++) {
+        auto storylet = std::make_shared<Storylet>("bark_" + std::to_string(i));
+        if (i < 5) {
+            storylet->SetPriority(10);
+        } else if (i == 5) {
+            storylet->SetPriority("street_wealth + 9");
+        }
+        storylet->SetCondition("street_wealth + " + std::to_string(i % 7) + " > noble_storyline");
+        deck.AddStorylet(storylet);
+    }
+
+    int change = 0;
+    BENCHMARK("DrawSingle from 30000, every condition") {
+        deck.useTieredDraw = false;
+        context["street_wealth"] = (change++ % 5) - 2;
+        return deck.DrawSingle();
+    };
+    BENCHMARK("DrawSingle from 30000, tiered") {
+        deck.useTieredDraw = true;
+        context["street_wealth"] = (change++ % 5) - 2;
+        return deck.DrawSingle();
+    };
+}
+
+TEST_CASE("Draw in parallel", "[benchmark]") {
+
+    // A large procedurally generated deck whose conditions the index can't answer.
+    Context context;
+    MakeStreetContext(context);
+    Deck deck(context);
+    for (int i = 0; i < 200000; i++) {
+        auto storylet = std::make_shared<Storylet>("generated_" + std::to_string(i));
+        storylet->SetCondition("street_wealth * " + std::to_string(i % 13) + " + noble_storyline > " + std::to_string(i % 7) + " and street_tag('shops')");
+        deck.AddStorylet(storylet);
+    }
+    auto pool = std::make_shared<StoryletFramework::ThreadPool>();
+
+    int change = 0;
+    BENCHMARK("Draw all from 200000, one thread") {
+        deck.SetExecutor(nullptr);
+        context["street_wealth"] = (change++ % 5) - 2;
+        return deck.Draw();
+    };
+    BENCHMARK("Draw all from 200000, thread pool") {
+        deck.SetExecutor(pool);
+        context["street_wealth"] = (change++ % 5) - 2;
+        return deck.Draw();
+    };
+}
+
+TEST_CASE("Load packets", "[benchmark]") {
+
+    // Many packet files' worth of generated storylets, each with its own conditions and outcomes.
+    std::vector<std::string> texts;
+    for (int p = 0; p < 100; p++) {
+        std::string text = "{ \"defaults\": { \"priority\": 1 }, \"storylets\": [\n";
+        for (int i = 0; i < 300; i++) {
+            std::string id = std::to_string(p) + "_" + std::to_string(i);
+            text += "  { \"id\": \"load_" + id + "\", \"condition\": \"street_wealth + " + id.substr(0, id.find('_')) + " > " + std::to_string(i) +
+                " and street_tag('t" + std::to_string(i) + "')\", \"outcomes\": { \"default\": { \"street_wealth\": \"street_wealth + 1\" } }, \"content\": { \"text\": \"Line " + id + "\" } },\n";
+        }
+        text += "  { \"id\": \"load_" + std::to_string(p) + "_end\" }\n] }";
+        texts.push_back(text);
+    }
+    auto pool = std::make_shared<StoryletFramework::ThreadPool>();
+
+    BENCHMARK("Load 100 packets, one thread") {
+        ExpressionParser::ExpressionCache::Global().Clear();
+        return DeckFromJsonTexts(texts);
+    };
+    BENCHMARK("Load 100 packets, thread pool") {
+        ExpressionParser::ExpressionCache::Global().Clear();
+        return DeckFromJsonTexts(texts, nullptr, pool.get());
+    };
+}
+
+TEST_CASE("Stream a packet", "[benchmark]") {
+
+    // One large packet file, with content for every storylet.
+    std::string text = "{ \"defaults\": { \"priority\": 1, \"redraw\": 2 }, \"storylets\": [\n";
+    for (int i = 0; i < 20000; i++) {
+        text += "  { \"id\": \"stream_" + std::to_string(i) + "\", \"condition\": \"street_wealth > " + std::to_string(i % 50) +
+            "\", \"content\": { \"title\": \"Storylet " + std::to_string(i) + "\", \"tags\": [\"street\", \"night\"], \"weight\": " + std::to_string(i % 7) + " } },\n";
+    }
+    text += "  { \"id\": \"stream_end\" }\n] }";
+
+    BENCHMARK("Load 20000 storylets, whole document") {
+        return DeckFromJson(nlohmann::json::parse(text, nullptr, true, true));
+    };
+    BENCHMARK("Load 20000 storylets, streamed") {
+        std::istringstream input(text);
+        return DeckFromJsonStream(input);
+    };
+}
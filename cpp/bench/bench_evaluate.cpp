@@ -0,0 +1,99 @@
+// This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+// Copyright (c) 2025 Ian Thomas
+
+#include "expression_parser/parser.h"
+#include "expression_parser/program.h"
+#include "storylet_framework/context.h"
+#include "catch_amalgamated.hpp"
+#include "test_utils.h"
+#include <string>
+
+using namespace ExpressionParser;
+using namespace StoryletFrameworkTest;
+
+namespace {
+
+void CollectConditions(const nlohmann::json& json, std::vector<std::string>& conditions) {
+    if (json.is_object()) {
+        for (auto it = json.begin(); it != json.end(); ++it) {
+            if (it.key() == "condition" && it.value().is_string() && !it.value().get<std::string>().empty())
+                conditions.push_back(it.value().get<std::string>());
+            else
+                CollectConditions(it.value(), conditions);
+        }
+    }
+    else if (json.is_array()) {
+        for (const auto& item : json)
+            CollectConditions(item, conditions);
+    }
+}
+
+Context MakeStreetContext() {
+    Context context;
+    context["street_id"] = std::string("market");
+    context["street_wealth"] = 0;
+    context["noble_storyline"] = 1.0;
+    context["street_tag"] = make_function_wrapper([](const std::string& tag) { return tag == "shops"; });
+    context["encounter_tag"] = make_function_wrapper([](const std::string& tag) { return tag == "threat"; });
+    return context;
+}
+
+}
+
+TEST_CASE("Evaluate sample conditions", "[benchmark]") {
+
+    std::vector<std::string> conditions;
+    for (const char* file : { "Streets.jsonc", "Encounters.jsonc", "Barks.jsonc" })
+        CollectConditions(loadJsonFile(file), conditions);
+    REQUIRE(!conditions.empty());
+
+    Parser parser;
+    std::vector<std::shared_ptr<ExpressionNode>> trees;
+    std::vector<Program> programs;
+    for (const auto& text : conditions) {
+        trees.push_back(parser.Parse(text));
+        programs.push_back(Compiler::Compile(*trees.back()));
+    }
+
+    Context context = MakeStreetContext();
+    std::string suffix = " (" + std::to_string(conditions.size()) + " conditions x 1000)";
+
+    BENCHMARK("Tree walk" + suffix) {
+        int passed = 0;
+        for (int i = 0; i < 1000; i++)
+            for (const auto& tree : trees)
+                passed += Utils::MakeBool(tree->Evaluate(context)) ? 1 : 0;
+        return passed;
+    };
+
+    BENCHMARK("Bytecode" + suffix) {
+        int passed = 0;
+        for (int i = 0; i < 1000; i++)
+            for (const auto& program : programs)
+                passed += Utils::MakeBool(program.Run(context)) ? 1 : 0;
+        return passed;
+    };
+}
+
+TEST_CASE("Apply outcomes", "[benchmark]") {
+
+    StoryletFramework::KeyedMap updates = {
+        {"noble_storyline", std::string("noble_storyline + 1")},
+        {"street_wealth", std::string("street_wealth - 1")},
+        {"street_id", std::string("'castlestreet'")},
+    };
+    StoryletFramework::ContextUpdates compiled = StoryletFramework::ContextUtils::CompileUpdates(updates);
+    Context context = MakeStreetContext();
+
+    BENCHMARK("Parse and apply (3 updates x 1000)") {
+        for (int i = 0; i < 1000; i++)
+            StoryletFramework::ContextUtils::UpdateContext(context, updates);
+        return context.Size();
+    };
+
+    BENCHMARK("Apply precompiled (3 updates x 1000)") {
+        for (int i = 0; i < 1000; i++)
+            StoryletFramework::ContextUtils::ApplyUpdates(context, compiled);
+        return context.Size();
+    };
+}
@@ -0,0 +1,89 @@
+// This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+// Copyright (c) 2025 Ian Thomas
+
+#include "storylet_framework/json_loader.h"
+#include "storylet_framework/deck_image.h"
+#include "expression_parser/expression_cache.h"
+#include "catch_amalgamated.hpp"
+#include "test_utils.h"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace StoryletFramework;
+using namespace StoryletFrameworkTest;
+
+namespace {
+
+// The Encounters storylets repeated with unique ids, so conditions repeat as they would across many packets.
+nlohmann::json MakeLargeDeckJson(int copies) {
+    nlohmann::json encounters = loadJsonFile("Encounters.jsonc");
+    nlohmann::json storylets = nlohmann::json::array();
+    for (int i = 0; i < copies; i++) {
+        for (auto storylet : encounters["storylets"]) {
+            storylet["id"] = storylet["id"].get<std::string>() + "_" + std::to_string(i);
+            storylets.push_back(storylet);
+        }
+    }
+    return {{"storylets", storylets}};
+}
+
+}
+
+TEST_CASE("Load decks", "[benchmark]") {
+
+    nlohmann::json json = MakeLargeDeckJson(200);
+    std::string suffix = " (" + std::to_string(json["storylets"].size()) + " storylets)";
+    auto& cache = ExpressionParser::ExpressionCache::Global();
+
+    BENCHMARK("Cold expression cache" + suffix) {
+        cache.Clear();
+        Context context;
+        return DeckFromJson(json, &context);
+    };
+
+    cache.Clear();
+    BENCHMARK("Warm expression cache" + suffix) {
+        Context context;
+        return DeckFromJson(json, &context);
+    };
+
+    auto stats = cache.GetStats();
+    std::cout << "Cache: " << stats.Entries << " entries, " << stats.MemoryUsage << " bytes, "
+              << stats.Hits << " hits, " << stats.Misses << " misses" << std::endl;
+    REQUIRE(stats.Entries < json["storylets"].size());
+}
+
+TEST_CASE("Load a deck image", "[benchmark]") {
+
+    // A large packet with a condition, outcome and content for every storylet.
+    std::string text = "{ \"defaults\": { \"priority\": 1, \"redraw\": 2 }, \"storylets\": [\n";
+    for (int i = 0; i < 20000; i++) {
+        text += "  { \"id\": \"image_" + std::to_string(i) + "\", \"condition\": \"street_wealth > " + std::to_string(i % 50) + " and street_tag('t" + std::to_string(i % 20) +
+            "')\", \"outcomes\": { \"default\": { \"street_wealth\": \"street_wealth + 1\" } }, \"content\": { \"title\": \"Storylet " + std::to_string(i) + "\", \"tags\": [\"street\", \"night\"] } },\n";
+    }
+    text += "  { \"id\": \"image_end\" }\n] }";
+
+    auto path = (std::filesystem::temp_directory_path() / "storylet_framework_bench.sfd").string();
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        DeckImage::Compile({ nlohmann::json::parse(text) }, file);
+    }
+    std::cout << "Packet: " << text.size() << " bytes, image: " << std::filesystem::file_size(path) << " bytes" << std::endl;
+
+    BENCHMARK("Load 20000 storylets from JSON") {
+        ExpressionParser::ExpressionCache::Global().Clear();
+        return DeckFromJson(nlohmann::json::parse(text, nullptr, true, true));
+    };
+    BENCHMARK("Load 20000 storylets, streamed") {
+        ExpressionParser::ExpressionCache::Global().Clear();
+        std::istringstream input(text);
+        return DeckFromJsonStream(input);
+    };
+    BENCHMARK("Load 20000 storylets from an image") {
+        return DeckFromImageFile(path);
+    };
+    std::filesystem::remove(path);
+}
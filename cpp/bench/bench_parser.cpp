@@ -0,0 +1,69 @@
+// This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+// Copyright (c) 2025 Ian Thomas
+
+#include "expression_parser/parser.h"
+#include "catch_amalgamated.hpp"
+#include <regex>
+#include <string>
+
+using namespace ExpressionParser;
+
+namespace {
+
+// The regex tokenizer the parser used to run, kept here as the baseline.
+std::vector<std::string> RegexTokenize(const std::string &expression) {
+    static const std::regex TOKEN_REGEX(R"(\s*(>=|<=|==|=|!=|>|<|\(|\)|,|and|&&|or|\|\||not|!|\+|\-|\/|\*|[A-Za-z_][A-Za-z0-9_]*|-?\d+\.\d+(?![A-Za-z_])|-?\d+(?![A-Za-z_])|"[^"]*"|'[^']*'|true|false|True|False)\s*)", std::regex::ECMAScript);
+    std::vector<std::string> tokens;
+    int pos = 0;
+    while (pos < static_cast<int>(expression.size())) {
+        std::smatch match;
+        std::string sub = expression.substr(pos);
+        if (!std::regex_search(sub, match, TOKEN_REGEX))
+            break;
+        std::string token = match[1].str();
+        if (!token.empty())
+            tokens.push_back(token);
+        pos += static_cast<int>(match.position() + match.length());
+    }
+    return tokens;
+}
+
+// Builds a condition of the form "var_0>=0 and street_tag('tag_1') or ..." with the given number of terms.
+std::string MakeCondition(int terms) {
+    std::string text;
+    for (int i = 0; i < terms; i++) {
+        if (i > 0)
+            text += (i % 3 == 0) ? " or " : " and ";
+        if (i % 2 == 0)
+            text += "var_" + std::to_string(i) + ">=" + std::to_string(i * 7);
+        else
+            text += "street_tag('tag_" + std::to_string(i) + "')";
+    }
+    return text;
+}
+
+}
+
+TEST_CASE("Tokenizer throughput", "[benchmark]") {
+
+    for (int terms : { 10, 100, 1000 }) {
+        std::string condition = MakeCondition(terms);
+        size_t tokenCount = Parser::Tokenize(condition).size();
+        REQUIRE(RegexTokenize(condition).size() == tokenCount);
+
+        std::string suffix = " (" + std::to_string(tokenCount) + " tokens)";
+
+        BENCHMARK("std::regex tokenizer" + suffix) {
+            return RegexTokenize(condition);
+        };
+
+        BENCHMARK("Hand-written lexer" + suffix) {
+            return Parser::Tokenize(condition);
+        };
+
+        Parser parser;
+        BENCHMARK("Parse" + suffix) {
+            return parser.Parse(condition);
+        };
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef SF_CONDITION_INDEX_H
+#define SF_CONDITION_INDEX_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "expression_parser/program.h"
+#include "context.h"
+
+namespace StoryletFramework
+{
+    // Indexes conditions that compare a variable with a literal, such as "street_id == 'docks'"
+    // or "street_wealth >= 0 and ...", so a draw can find the storylets whose comparison holds
+    // with a hash lookup or binary search instead of evaluating each one. Each storylet is
+    // indexed on the comparison its condition starts with, if any, and anything else in its
+    // condition is left to the evaluator.
+    class ConditionIndex
+    {
+    public:
+        // An indexed storylet returned by Match
+        struct IndexMatch
+        {
+            uint32_t handle;
+            bool holds; // False if the index couldn't decide, so the condition must be evaluated
+        };
+
+        // Index the conditions of a deck, by handle. Null conditions are left unindexed.
+        void Build(const std::vector<const ExpressionParser::CompiledExpression*>& conditions);
+
+        bool Empty() const { return _ranges.empty() && _equalities.empty(); }
+
+        // True if the storylet is indexed, so only Match will return it
+        bool IsIndexed(uint32_t handle) const { return handle < _indexed.size() && _indexed[handle] != Indexed::No; }
+        // True if the indexed comparison is the storylet's whole condition
+        bool IsExact(uint32_t handle) const { return handle < _indexed.size() && _indexed[handle] == Indexed::Exact; }
+
+        // Add the indexed storylets whose comparison holds in the context. If a variable
+        // isn't a number, every storylet indexed on it is added, undecided.
+        void Match(const Context& context, std::vector<IndexMatch>& matches) const;
+
+    private:
+        enum class Indexed : uint8_t
+        {
+            No,
+            Partly,
+            Exact
+        };
+
+        // A storylet that needs the variable above (or below) a threshold
+        struct Bound
+        {
+            double threshold;
+            bool inclusive;
+            uint32_t handle;
+        };
+
+        // Bounds on one variable. Lower bounds are sorted by ascending threshold and upper bounds by
+        // descending threshold, inclusive ones first, so the bounds that hold for a value are a prefix.
+        struct RangeIndex
+        {
+            ExpressionParser::SymbolId slot;
+            std::vector<Bound> lower;
+            std::vector<Bound> upper;
+        };
+
+        // Storylets that need a variable to equal a literal, bucketed by the literal. Equality
+        // converts the literal to the variable's type, so string literals are only looked up
+        // for string values and numbers for numbers. Anything else is left to the evaluator.
+        struct EqualityIndex
+        {
+            ExpressionParser::SymbolId slot;
+            std::unordered_map<const std::string*, std::vector<uint32_t>> strings; // By pooled string
+            std::vector<ExpressionParser::Value> literals; // Hold the pooled strings keyed by address
+            std::unordered_map<double, std::vector<uint32_t>> numbers;
+            std::vector<uint32_t> all;
+            std::vector<uint32_t> nonStrings;
+            std::vector<uint32_t> nonNumbers;
+        };
+
+        // Adds every storylet indexed on a predicate, undecided
+        static void MatchAll(const std::vector<uint32_t>& handles, std::vector<IndexMatch>& matches);
+
+        std::vector<RangeIndex> _ranges;
+        std::vector<EqualityIndex> _equalities;
+        std::vector<Indexed> _indexed;
+    };
+}
+
+#endif // SF_CONDITION_INDEX_H
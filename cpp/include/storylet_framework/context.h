@@ -5,25 +5,49 @@
 #include <unordered_map>
 #include <vector>
 #include "expression_parser/parser.h" 
+#include "expression_parser/program.h"
 
 namespace StoryletFramework
 {
     using Context = ExpressionParser::Context;
-    using DumpEval = std::vector<std::string>;
+    using TraceSink = ExpressionParser::TraceSink;
+    using ExpressionParser::TracingEnabled;
+    // A trace that keeps every event as a line of text
+    using DumpEval = ExpressionParser::TraceLines;
     using KeyedMap = std::unordered_map<std::string, std::any>;
 
+    // An update to a single context property, compiled ahead of time.
+    struct ContextUpdate
+    {
+        std::string name;
+        ExpressionParser::SymbolId slot;
+        std::shared_ptr<const ExpressionParser::CompiledExpression> expression; // Null if the update is a plain value
+        ExpressionParser::Value value;
+        std::string text; // Description for traces
+    };
+    using ContextUpdates = std::vector<ContextUpdate>;
+
     class ContextUtils
     {
     public:
 
         // Evaluate an expression
-        static std::any EvalExpression(const std::any& val, const Context& context, DumpEval* dumpEval = nullptr);
+        static std::any EvalExpression(const std::any& val, const Context& context, TraceSink* trace = nullptr);
+        // Evaluate an expression without converting the result to std::any
+        static ExpressionParser::Value EvalValue(const std::any& val, const Context& context, TraceSink* trace = nullptr);
 
         // Initialize context with properties
-        static void InitContext(Context& context, const KeyedMap& properties, DumpEval* dumpEval = nullptr);
+        static void InitContext(Context& context, const KeyedMap& properties, TraceSink* trace = nullptr);
+        static void InitContext(Context& context, const ContextUpdates& properties, TraceSink* trace = nullptr);
 
         // Update context with updates
-        static void UpdateContext(Context& context, const KeyedMap& updates, DumpEval* dumpEval = nullptr);
+        static void UpdateContext(Context& context, const KeyedMap& updates, TraceSink* trace = nullptr);
+
+        // Compile updates once, so they can be applied repeatedly without reparsing
+        static ContextUpdates CompileUpdates(const KeyedMap& updates);
+
+        // Apply compiled updates. Each property must already exist in the context.
+        static void ApplyUpdates(Context& context, const ContextUpdates& updates, TraceSink* trace = nullptr);
 
         // Dump the context as a string for debugging
         static std::string DumpContext(const Context& context);
@@ -0,0 +1,68 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef SF_DECK_IMAGE_H
+#define SF_DECK_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+#include "storylet_framework/json_loader.h"
+
+namespace StoryletFramework
+{
+    // Packets compiled ahead of time into a binary image, which loads without parsing any JSON or
+    // expressions. An image holds a table of the strings it uses, the bytecode of each distinct
+    // expression, fixed-size records for storylets, outcomes and context, and content as
+    // MessagePack. Files are mapped rather than read, and storylets' content is left in the
+    // image as MappedJson, so the image stays mapped while any of it is in use.
+    //
+    // The sfc tool compiles packets into an image:  sfc deck.sfd Streets.jsonc Encounters.jsonc
+    // auto deck = DeckFromImageFile("deck.sfd", &context);
+    //
+    // Images are little-endian, and are only loaded by the version that wrote them.
+    class DeckImage : public std::enable_shared_from_this<DeckImage>
+    {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        // Map an image file. Throws if it isn't an image of this version.
+        static std::shared_ptr<const DeckImage> Open(const std::string& path);
+        // Take an image that's already in memory
+        static std::shared_ptr<const DeckImage> FromBytes(std::vector<uint8_t> bytes);
+
+        // Compile packets into an image that loads the same as DeckFromJsonTexts would load them.
+        // Context is compiled rather than evaluated, so it's evaluated when the image is read.
+        static void Compile(const std::vector<nlohmann::json>& packets, std::ostream& output);
+
+        // Initialize context and add storylets to the deck, in the order loading the packets would
+        void ReadInto(Deck& deck, TraceSink* trace = nullptr) const;
+
+        std::span<const uint8_t> GetBytes() const { return {_data, _size}; }
+
+        ~DeckImage();
+        DeckImage(const DeckImage&) = delete;
+        DeckImage& operator=(const DeckImage&) = delete;
+
+    private:
+        DeckImage() = default;
+
+        // Check the header and that every section lies within the image
+        void Validate();
+
+        const uint8_t* _data = nullptr;
+        size_t _size = 0;
+        void* _mapping = nullptr; // Set when the image is a mapped file
+        std::vector<uint8_t> _bytes; // Set otherwise
+    };
+
+    std::shared_ptr<Deck> DeckFromImage(const DeckImage& image, Context* context = nullptr, TraceSink* trace = nullptr);
+    std::shared_ptr<Deck> DeckFromImageFile(const std::string& path, Context* context = nullptr, TraceSink* trace = nullptr);
+}
+
+#endif // SF_DECK_IMAGE_H
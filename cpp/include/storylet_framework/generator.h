@@ -0,0 +1,111 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef SF_GENERATOR_H
+#define SF_GENERATOR_H
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <optional>
+#include <utility>
+
+namespace StoryletFramework
+{
+    // A coroutine that yields values one at a time, running only as far as it's iterated.
+    // Move-only; destroying it stops the coroutine wherever it was suspended.
+    //
+    // for (auto& storylet : deck.DrawLazy()) { ... break; }
+    template<typename T>
+    class Generator
+    {
+    public:
+        struct promise_type
+        {
+            std::optional<T> current;
+            std::exception_ptr exception;
+
+            Generator get_return_object() { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            std::suspend_always yield_value(T value)
+            {
+                current = std::move(value);
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception() { exception = std::current_exception(); }
+        };
+
+        class Iterator
+        {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = T;
+            using difference_type = std::ptrdiff_t;
+
+            Iterator() = default;
+            explicit Iterator(std::coroutine_handle<promise_type> handle) : _handle(handle) { Advance(); }
+
+            T& operator*() const { return *_handle.promise().current; }
+            T* operator->() const { return &*_handle.promise().current; }
+            Iterator& operator++()
+            {
+                Advance();
+                return *this;
+            }
+            void operator++(int) { Advance(); }
+            bool operator==(std::default_sentinel_t) const { return !_handle || _handle.done(); }
+
+        private:
+            // Resumes the coroutine to its next value, rethrowing anything it threw
+            void Advance()
+            {
+                _handle.promise().current.reset();
+                _handle.resume();
+                if (_handle.promise().exception)
+                {
+                    std::rethrow_exception(std::exchange(_handle.promise().exception, nullptr));
+                }
+            }
+
+            std::coroutine_handle<promise_type> _handle;
+        };
+
+        Generator(Generator&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+        Generator& operator=(Generator&& other) noexcept
+        {
+            if (this != &other)
+            {
+                Destroy();
+                _handle = std::exchange(other._handle, nullptr);
+            }
+            return *this;
+        }
+        Generator(const Generator&) = delete;
+        Generator& operator=(const Generator&) = delete;
+        ~Generator() { Destroy(); }
+
+        // Starts the coroutine. Only call once.
+        Iterator begin() { return Iterator(_handle); }
+        std::default_sentinel_t end() const { return {}; }
+
+    private:
+        explicit Generator(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+        void Destroy()
+        {
+            if (_handle)
+            {
+                _handle.destroy();
+                _handle = nullptr;
+            }
+        }
+
+        std::coroutine_handle<promise_type> _handle;
+    };
+}
+
+#endif // SF_GENERATOR_H
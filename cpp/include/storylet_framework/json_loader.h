@@ -4,6 +4,8 @@
 #include "storylet_framework/storylets.h"
 #include <json.hpp>
 #include <any>
+#include <istream>
+#include <span>
 #include <string>
 #include <stdexcept>
 #include <typeinfo>
@@ -69,10 +71,48 @@ namespace StoryletFramework
 {
     using KeyedMap = std::unordered_map<std::string, std::any>;
 
+    // JSON kept as MessagePack bytes rather than a tree, which takes a fraction of the memory.
+    // Storylets read from a stream hold their content this way; ExtractJsonFromAny unpacks it.
+    struct PackedJson
+    {
+        std::vector<uint8_t> bytes;
+    };
+
+    // JSON kept as MessagePack bytes that belong to something else, such as a mapped deck image,
+    // which owner keeps alive.
+    struct MappedJson
+    {
+        std::shared_ptr<const void> owner;
+        std::span<const uint8_t> bytes;
+    };
+
+    // A step of loading a packet: context to initialize, or a storylet to add
+    struct PacketItem
+    {
+        std::unique_ptr<KeyedMap> context;
+        std::shared_ptr<Storylet> storylet;
+    };
+
     std::shared_ptr<Storylet> StoryletFromJson(const nlohmann::json& json, const nlohmann::json& defaults);
-    std::shared_ptr<Deck> DeckFromJson(const nlohmann::json& json, Context* context = nullptr, DumpEval* dumpEval = nullptr);
-    void _readPacketFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, DumpEval* dumpEval = nullptr);
-    void _readStoryletsFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, DumpEval* dumpEval = nullptr);
+    std::shared_ptr<Deck> DeckFromJson(const nlohmann::json& json, Context* context = nullptr, TraceSink* trace = nullptr);
+
+    // Load many JSONC packets into one deck, the same as loading each in turn. With an executor,
+    // the files are read and parsed and their storylets built and compiled in parallel; context
+    // is then initialized and storylets added in the order the packets are given.
+    std::shared_ptr<Deck> DeckFromJsonFiles(const std::vector<std::string>& paths, Context* context = nullptr, Executor* executor = nullptr, TraceSink* trace = nullptr);
+    std::shared_ptr<Deck> DeckFromJsonTexts(const std::vector<std::string>& texts, Context* context = nullptr, Executor* executor = nullptr, TraceSink* trace = nullptr);
+    // As DeckFromJsonFiles, but with a deck for each file
+    std::vector<std::shared_ptr<Deck>> DecksFromJsonFiles(const std::vector<std::string>& paths, Context* context = nullptr, Executor* executor = nullptr, TraceSink* trace = nullptr);
+
+    // Build a deck while reading a JSONC packet, without ever holding the whole document. Only the
+    // defaults in effect and the storylet being read are kept, and content is kept as PackedJson.
+    // Within a packet, "context" and "defaults" have to come before "storylets".
+    std::shared_ptr<Deck> DeckFromJsonStream(std::istream& input, Context* context = nullptr, TraceSink* trace = nullptr);
+    void ReadPacketFromJsonStream(Deck& deck, std::istream& input, TraceSink* trace = nullptr);
+    void _readPacketFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, TraceSink* trace = nullptr);
+    void _readStoryletsFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, TraceSink* trace = nullptr);
+    // Build a packet's storylets and read its context without touching a deck, in the order loading it would add them
+    std::vector<PacketItem> _collectPacketFromJson(const nlohmann::json& json, nlohmann::json defaults);
 
     // Utility to extract Json stored in a std::any
     nlohmann::json ExtractJsonFromAny(const std::any& value);
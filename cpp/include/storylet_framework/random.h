@@ -0,0 +1,100 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef SF_RANDOM_H
+#define SF_RANDOM_H
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <json.hpp>
+
+namespace StoryletFramework
+{
+    // The random number generator a Deck uses when drawing. Subclass it to supply
+    // your own. Everything built on it is platform-independent, so a seeded deck
+    // draws the same sequence everywhere.
+    class RandomSource
+    {
+    public:
+        using result_type = uint64_t;
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+        virtual ~RandomSource() = default;
+
+        // Next 64 random bits
+        virtual result_type operator()() = 0;
+
+        virtual void Seed(uint64_t seed) = 0;
+
+        // State, for saving alongside the deck. LoadState throws if the state came from a different kind of source.
+        virtual nlohmann::json SaveState() const = 0;
+        virtual void LoadState(const nlohmann::json& state) = 0;
+
+        // A uniformly distributed number in [0, bound). Unlike std::uniform_int_distribution,
+        // the result is the same with every standard library.
+        uint64_t Below(uint64_t bound);
+    };
+
+    // The default: xoshiro256**, which is small, fast and statistically strong.
+    class Xoshiro256 : public RandomSource
+    {
+    public:
+        // Seeds from std::random_device
+        Xoshiro256();
+        explicit Xoshiro256(uint64_t seed);
+
+        result_type operator()() override;
+        void Seed(uint64_t seed) override;
+        nlohmann::json SaveState() const override;
+        void LoadState(const nlohmann::json& state) override;
+
+    private:
+        uint64_t _state[4];
+    };
+
+    // Adapts a standard library engine, such as std::mt19937_64, to a RandomSource.
+    // State is saved in the engine's own text format.
+    template <typename Engine>
+    class EngineRandomSource : public RandomSource
+    {
+        static_assert(Engine::min() == 0 &&
+                      (Engine::max() == std::numeric_limits<uint32_t>::max() || Engine::max() == std::numeric_limits<uint64_t>::max()),
+                      "Engine must produce full-range 32 or 64 bit values.");
+    public:
+        explicit EngineRandomSource(uint64_t seed = Engine::default_seed) : _engine(static_cast<typename Engine::result_type>(seed)) {}
+
+        result_type operator()() override
+        {
+            if constexpr (Engine::max() == std::numeric_limits<uint64_t>::max())
+                return _engine();
+            uint64_t high = _engine();
+            return (high << 32) | _engine();
+        }
+
+        void Seed(uint64_t seed) override { _engine.seed(static_cast<typename Engine::result_type>(seed)); }
+
+        nlohmann::json SaveState() const override
+        {
+            std::ostringstream output;
+            output << _engine;
+            return output.str();
+        }
+
+        void LoadState(const nlohmann::json& state) override
+        {
+            std::istringstream input(state.get<std::string>());
+            input >> _engine;
+        }
+
+    private:
+        Engine _engine;
+    };
+}
+
+#endif // SF_RANDOM_H
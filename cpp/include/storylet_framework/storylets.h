@@ -10,10 +10,19 @@
 #include <unordered_map>
 #include <any>
 #include <vector>
+#include <limits>
+#include <queue>
 #include <json.hpp>
 #include "expression_parser/parser.h"
+#include "expression_parser/program.h"
+#include "expression_parser/expression_graph.h"
+#include "expression_parser/call_memo.h"
 #include "utils.h"
 #include "context.h"
+#include "random.h"
+#include "condition_index.h"
+#include "generator.h"
+#include "thread_pool.h"
 
 namespace StoryletFramework {
 
@@ -25,21 +34,26 @@ namespace StoryletFramework {
     class Storylet
     {
         friend class Deck;
+        friend class DeckImage;
 
     public:
         std::string id; // Unique ID of the storylet
         std::any content; // Application-defined content
-        int redraw = REDRAW_ALWAYS; // Redraw setting
-        KeyedMap outcomes; // Updates to context
 
     private:
-        std::shared_ptr<ExpressionParser::ExpressionNode> _condition; // Precompiled condition
-        std::any _priority = 0; // Priority (absolute value or expression)
-        int _nextPlay = 0; // The next draw this should be available
+        int _redraw = REDRAW_ALWAYS; // Redraw setting
+        KeyedMap _outcomes; // Updates to context, by outcome name
+        std::shared_ptr<const ExpressionParser::CompiledExpression> _condition; // Precompiled condition
+        int _priority = 0; // Fixed priority, used when there's no priority expression
+        std::shared_ptr<const ExpressionParser::CompiledExpression> _priorityExpression; // Precompiled priority
+        int _specificity = 0; // Specificity of the condition, kept so priorities don't need the condition
+        std::unordered_map<std::string, ContextUpdates> _outcomeUpdates; // Compiled outcomes
+        bool _outcomesCompiled = false;
         Deck* _deck = nullptr; // Pointer to the deck this storylet belongs to
+        uint32_t _handle = 0; // Index of this storylet in its deck
 
-        // Call when actually drawn - updates the redraw counter
-        void OnPlayed(int currentPlay, Context& context, const std::string& outcome = "default", DumpEval* dumpEval = nullptr);
+        // Call when actually played - applies the outcome to the context
+        void ApplyOutcome(Context& context, const std::string& outcome = "default", TraceSink* trace = nullptr);
 
     public:
         // Constructor
@@ -48,52 +62,233 @@ namespace StoryletFramework {
         // Reset the redraw counter
         void Reset();
 
+        // Set how many plays must pass before the storylet is drawn again, or REDRAW_ALWAYS or REDRAW_NEVER.
+        // The change applies at once: REDRAW_ALWAYS, or any setting for a storylet played with
+        // REDRAW_NEVER, makes it drawable now. A cooldown that's already running finishes as it was set.
+        void SetRedraw(int redraw);
+        int GetRedraw() const { return _redraw; }
+
         // Set condition as a string, which will be precompiled.
         void SetCondition(const std::string& text);
 
         // Evaluate condition using the current context. Returns true if no condition is set.
-        bool CheckCondition(const Context& context, DumpEval* dumpEval = nullptr) const;
+        bool CheckCondition(const Context& context, TraceSink* trace = nullptr) const;
+
+        // Set all the outcomes, or one outcome's updates to context. They're compiled again on the next play.
+        void SetOutcomes(KeyedMap outcomes);
+        void SetOutcome(const std::string& name, KeyedMap updates);
+        const KeyedMap& GetOutcomes() const { return _outcomes; }
+
+        // Compile outcomes ready for Play. Done automatically on the first play after they're set,
+        // but calling it sooner reports errors in them sooner.
+        void CompileOutcomes();
 
         // Set priority to a fixed number or a precompiled expression
         void SetPriority(int num);
         void SetPriority(std::string expression);
 
         // Evaluate priority using the current context
-        int CalcCurrentPriority(const Context& context, bool useSpecificity = true, DumpEval* dumpEval = nullptr) const;
+        int CalcCurrentPriority(const Context& context, bool useSpecificity = true, TraceSink* trace = nullptr) const;
 
-        // Check if the storylet is available to draw according to its redraw rules
+        // True if the priority doesn't depend on the context, so it never needs evaluating
+        bool HasStaticPriority() const { return !_priorityExpression; }
+
+        // The effective priority of a storylet with a static priority, including specificity if used
+        int GetStaticPriority(bool useSpecificity) const { return useSpecificity ? _priority * 100 + _specificity : _priority; }
+
+        // Check if the storylet is available to draw according to its redraw rules.
+        // A storylet that isn't in a deck has never been played, so it always can be.
         bool CanDraw(int currentPlay) const;
 
-        void Play(const std::string& outcome = "default", DumpEval* dumpEval = nullptr);
+        void Play(const std::string& outcome = "default", TraceSink* trace = nullptr);
     };
 
     class Deck
     {
+        friend class Storylet;
+
     private:
-        std::unordered_map<std::string, std::shared_ptr<Storylet>> _all;
+        // A storylet that passed its checks during a draw
+        struct DrawCandidate
+        {
+            int priority;
+            uint32_t handle;
+        };
+
+        // The next play of a storylet that can't be drawn again
+        static constexpr int NEXT_PLAY_NEVER = std::numeric_limits<int>::max();
+
+        // Where a storylet is in the redraw schedule
+        enum class Schedule : uint8_t
+        {
+            Ready,      // In _ready
+            Cooling,    // Waiting in _cooling for its next play
+            Retired     // Played with REDRAW_NEVER; never drawn again
+        };
+
+        // A storylet waiting for its next play. Entries are left in place when a storylet is
+        // played again while cooling, and skipped if they no longer match its next play.
+        struct CoolingEntry
+        {
+            int nextPlay;
+            uint32_t handle;
+            bool operator>(const CoolingEntry& other) const { return nextPlay > other.nextPlay; }
+        };
+
+        // Storylets are identified by a handle, which is their index in the order they were added.
+        // The fields Draw reads are kept in arrays indexed by handle, apart from the rest of the
+        // Storylet, so a draw streams through contiguous memory. The Storylet owns the expressions.
+        std::vector<std::shared_ptr<Storylet>> _storylets;
+        std::vector<int> _nextPlay; // The draw from which each storylet is available again
+        std::vector<const ExpressionParser::CompiledExpression*> _conditions;
+        std::vector<const ExpressionParser::CompiledExpression*> _priorityExpressions;
+        std::vector<int> _priorities;
+        std::vector<int> _specificities;
+        std::unordered_map<std::string, uint32_t> _handles; // Only used to look storylets up by id
+
+        // Draw only visits _ready, which is kept sorted by handle so draws are the same however
+        // the deck got into its current state. Storylets on cooldown wait in a min-heap.
+        std::vector<uint32_t> _ready;
+        std::vector<Schedule> _schedule;
+        std::priority_queue<CoolingEntry, std::vector<CoolingEntry>, std::greater<CoolingEntry>> _cooling;
+
+        // Condition results are kept between draws. Each slot a condition reads has a list of
+        // the storylets that read it, and when the slot's version changes their results are
+        // discarded. Conditions that call functions that aren't pure are evaluated every draw.
+        enum class CachedCondition : uint8_t
+        {
+            Unknown,
+            False,
+            True,
+            Volatile
+        };
+        std::vector<CachedCondition> _conditionCache;
+        std::vector<ExpressionParser::SymbolId> _watchedSlots;
+        std::vector<std::vector<uint32_t>> _dependents; // Storylets reading each of _watchedSlots
+        bool _dependentsDirty = true;
+        const Context* _cachedContext = nullptr;
+        uint64_t _cachedVersion = 0;
+
+        // Finds storylets with simple comparison conditions without evaluating them.
+        // Rebuilt along with _dependents.
+        ConditionIndex _index;
+
+        // All the deck's conditions merged into one graph, for useConditionGraph. Rebuilt when
+        // a condition changes. Constant and missing conditions have no root.
+        static constexpr ExpressionParser::ExpressionGraph::NodeId NO_ROOT = UINT32_MAX;
+        ExpressionParser::ExpressionGraph _graph;
+        std::vector<ExpressionParser::ExpressionGraph::NodeId> _graphRoots;
+        bool _graphDirty = true;
+        bool _graphPass = false; // True during a draw that evaluates through the graph
+
+        // Remembers calls to stable and pure functions for one draw, when the caller hasn't
+        // attached a memo of their own to the context
+        ExpressionParser::CallMemo _callMemo;
+
+        // Storylets with static priorities, highest first and then by handle, so small draws can
+        // stop once the tiers they've checked hold enough. Rebuilt when a storylet or
+        // useSpecificity changes. Storylets with priority expressions are kept apart.
+        std::vector<DrawCandidate> _tiers;
+        std::vector<uint32_t> _dynamicPriorities;
+        bool _tiersDirty = true;
+        bool _tiersSpecificity = false; // useSpecificity when _tiers was sorted
+
+        // Checks large draws in parallel when set. Chunks are small enough to spread over the
+        // threads and large enough that handing them out costs little.
+        static constexpr size_t PARALLEL_CHUNK = 4096;
+        std::shared_ptr<Executor> _executor;
+        std::vector<std::vector<DrawCandidate>> _chunkCandidates; // Scratch space for each chunk
+
+        std::vector<DrawCandidate> _candidates; // Scratch space for Draw, kept to avoid reallocating
+        std::vector<ConditionIndex::IndexMatch> _matches; // Scratch space for Draw
+        std::unique_ptr<RandomSource> _random;
         int _currentDraw = 0;
 
+        // Copy a storylet's draw-time fields into the deck's arrays after it changes
+        void SyncStorylet(uint32_t handle);
+        // Put a storylet in the right place in the schedule for its next play
+        void ScheduleStorylet(uint32_t handle);
+        // Make a storylet drawable now if its redraw setting no longer holds it back
+        void RescheduleStorylet(uint32_t handle);
+        // Move storylets whose cooldown has finished back into _ready
+        void ReleaseCooled();
+        // Rebuild the schedule from scratch, after Reset or loading state
+        void RebuildSchedule();
+        // Rebuild the condition graph if need be and start a pass for a draw
+        void BeginGraphPass();
+        // Bring cached conditions up to date and start a graph pass if it's used, before checking conditions
+        void BeginChecks(TraceSink* trace);
+        // Discard cached condition results that the context has changed under
+        void RefreshConditionCache();
+        // Check a storylet's condition, using the cached result if there is one
+        bool CheckCachedCondition(uint32_t handle, TraceSink* trace);
+        // Add a storylet to candidates if it passes the filter and its condition, which is
+        // skipped if it's already known to hold
+        void AddCandidate(std::vector<DrawCandidate>& candidates, uint32_t handle, const std::function<bool(const Storylet&)>& filter, bool conditionHolds, TraceSink* trace);
+        // Call check(i, candidates) for each i in [0, count), collecting candidates into _candidates
+        // in order of i. Large counts are split into chunks across the executor when not tracing.
+        template<typename Check>
+        void CollectCandidates(size_t count, TraceSink* trace, const Check& check);
+        // Add candidates a tier at a time from the highest, stopping once the top count are known
+        void AddTieredCandidates(size_t count, const std::function<bool(const Storylet&)>& filter, bool useIndex);
+        void ShuffleCandidates(size_t begin, size_t end);
+        // Sort the static priorities into _tiers if they've changed
+        void RefreshTiers();
+        int StaticPriority(uint32_t handle) const { return useSpecificity ? _priorities[handle] * 100 + _specificities[handle] : _priorities[handle]; }
+
     public:
         explicit Deck();
         explicit Deck(Context& context);
         void Reset();
-        std::vector<std::shared_ptr<Storylet>> Draw(int count=-1, std::function<bool(const Storylet&)> filter = nullptr, DumpEval* dumpEval = nullptr);
-        std::vector<std::shared_ptr<Storylet>> DrawAndPlay(int count=-1, std::function<bool(const Storylet&)> filter= nullptr, const std::string& outcome = "default", DumpEval* dumpEval = nullptr);
-        std::shared_ptr<Storylet> DrawSingle(std::function<bool(const Storylet&)> filter= nullptr, DumpEval* dumpEval = nullptr);
-        std::shared_ptr<Storylet> DrawAndPlaySingle(std::function<bool(const Storylet&)> filter= nullptr, const std::string& outcome = "default", DumpEval* dumpEval = nullptr);
+        std::vector<std::shared_ptr<Storylet>> Draw(int count=-1, std::function<bool(const Storylet&)> filter = nullptr, TraceSink* trace = nullptr);
+        std::vector<std::shared_ptr<Storylet>> DrawAndPlay(int count=-1, std::function<bool(const Storylet&)> filter= nullptr, const std::string& outcome = "default", TraceSink* trace = nullptr);
+        // Draw storylets one at a time, by descending priority and at random within a priority,
+        // as Draw does. Conditions are only checked for the priorities iteration reaches, against
+        // the context as it is then, so stopping early skips the rest. Storylets with a priority
+        // expression are checked up front, as their priority isn't known until they pass, and again
+        // when iteration reaches that priority. Storylets played while iterating aren't drawn
+        // again. The deck must outlive the generator.
+        Generator<std::shared_ptr<Storylet>> DrawLazy(std::function<bool(const Storylet&)> filter = nullptr, TraceSink* trace = nullptr);
+        std::shared_ptr<Storylet> DrawSingle(std::function<bool(const Storylet&)> filter= nullptr, TraceSink* trace = nullptr);
+        std::shared_ptr<Storylet> DrawAndPlaySingle(std::function<bool(const Storylet&)> filter= nullptr, const std::string& outcome = "default", TraceSink* trace = nullptr);
  
  
         std::shared_ptr<Storylet> GetStorylet(const std::string& id) const;
         void AddStorylet(std::shared_ptr<Storylet> storylet);
-        void Play(Storylet& storylet, const std::string& outcome = "default", DumpEval* dumpEval = nullptr);
+        void Play(Storylet& storylet, const std::string& outcome = "default", TraceSink* trace = nullptr);
+
+        // The generator used for draws. Seed it for reproducible draws, or replace it with your own.
+        RandomSource& GetRandom() { return *_random; }
+        void SetRandom(std::unique_ptr<RandomSource> random);
 
-        // Save the deck's play state to a JSON object.
+        // Check conditions and priorities of large draws in parallel across the executor, or
+        // pass nullptr to draw on the calling thread. Draws are the same either way for a given
+        // seed. Filters and the context's functions must then be safe to call from several
+        // threads at once. Traced draws stay on the calling thread, and function calls aren't
+        // memoized while checking in parallel.
+        void SetExecutor(std::shared_ptr<Executor> executor);
+        Executor* GetExecutor() const { return _executor.get(); }
+
+        // Save the deck's play state, including the random generator's, to a JSON object.
         nlohmann::json SaveStateToJson() const;
         // Restore deck play state from a previously saved JSON object.
         void LoadStateFromJson(const nlohmann::json& json);
 
+        // How many condition node evaluations useConditionGraph has saved, over the deck's lifetime
+        uint64_t GetSavedEvaluations() const { return _graph.GetSavedEvaluations(); }
+        // Hits and misses of the memo used for function calls during draws. To keep results
+        // for longer than a draw, attach your own memo to the context instead.
+        ExpressionParser::CallMemo::Stats GetCallMemoStats() const { return _callMemo.GetStats(); }
+
         std::shared_ptr<Context> context;
         bool useSpecificity = false;
+        // Evaluate conditions together, so a subexpression shared by several of them, like
+        // "street_wealth >= 0", is evaluated once per draw. Results are the same either way.
+        bool useConditionGraph = false;
+        // When drawing a set number of storylets, check static priorities a tier at a time from
+        // the highest and stop once enough are found, rather than checking every condition.
+        // Draws the same storylets, though ties may be broken differently for a given seed.
+        bool useTieredDraw = true;
     };
 
 } // namespace StoryletFramework
@@ -0,0 +1,75 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef SF_THREAD_POOL_H
+#define SF_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace StoryletFramework
+{
+    // Runs work for a Deck in parallel. Subclass it to run draws on your own job system.
+    class Executor
+    {
+    public:
+        virtual ~Executor() = default;
+
+        // Call task(i) for every i in [0, count), in any order and on any thread, returning once
+        // all have finished. If any throw, rethrow the exception from the lowest i that threw.
+        virtual void ParallelFor(size_t count, const std::function<void(size_t)>& task) = 0;
+    };
+
+    // The default: a fixed set of threads, each with its own queue. Idle threads steal from
+    // the others, and the thread calling ParallelFor works through the tasks too, so a task
+    // can call ParallelFor itself without deadlocking.
+    class ThreadPool : public Executor
+    {
+    public:
+        // Defaults to one thread per core, less the one calling ParallelFor
+        explicit ThreadPool(size_t threads = 0);
+        ~ThreadPool();
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        void ParallelFor(size_t count, const std::function<void(size_t)>& task) override;
+
+        size_t GetThreadCount() const { return _threads.size(); }
+
+    private:
+        struct Batch;
+        struct Job
+        {
+            Batch* batch;
+            size_t index;
+        };
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<Job> jobs;
+        };
+
+        // Take a job, from the back of our own queue if we have one or the front of another's
+        bool TakeJob(size_t queue, Job& job);
+        void RunJob(const Job& job);
+        void WorkerLoop(size_t queue);
+
+        std::vector<std::unique_ptr<Queue>> _queues; // One per thread
+        std::vector<std::thread> _threads;
+        std::atomic<size_t> _queued{0};
+        std::mutex _wakeMutex;
+        std::condition_variable _wake;
+        bool _stop = false;
+    };
+}
+
+#endif // SF_THREAD_POOL_H
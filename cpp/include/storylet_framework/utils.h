@@ -12,6 +12,7 @@
 #include <algorithm>
 #include <random>
 #include <any>
+#include "random.h"
 
 namespace StoryletFramework
 {
@@ -20,17 +21,22 @@ namespace StoryletFramework
     public:
         // Shuffle a vector in place
         template <typename T>
-        static void ShuffleArray(std::vector<T>& array)
+        static void ShuffleArray(std::vector<T>& array, RandomSource& random)
         {
-            std::random_device rd;
-            std::mt19937 generator(rd());
-            for (size_t i = array.size() - 1; i > 0; --i)
+            for (size_t i = array.size(); i > 1; --i)
             {
-                std::uniform_int_distribution<size_t> distribution(0, i);
-                size_t j = distribution(generator);
-                std::swap(array[i], array[j]);
+                size_t j = random.Below(i);
+                std::swap(array[i - 1], array[j]);
             }
         }
+
+        // Shuffle a vector in place, using a generator shared by the calling thread
+        template <typename T>
+        static void ShuffleArray(std::vector<T>& array)
+        {
+            thread_local Xoshiro256 random;
+            ShuffleArray(array, random);
+        }
     };
 }
 
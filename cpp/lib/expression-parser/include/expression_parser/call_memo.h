@@ -0,0 +1,53 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef CALL_MEMO_H
+#define CALL_MEMO_H
+
+#include <span>
+#include <string>
+#include <unordered_map>
+
+#include "context.h"
+
+namespace ExpressionParser {
+
+// Remembers the results of calls to functions that aren't volatile, by function and
+// arguments, until it's cleared. While one is attached to a Context, every evaluation
+// against that context uses it. Not thread-safe.
+//
+// CallMemo memo;
+// context.SetCallMemo(&memo);
+// ... evaluate ...
+// memo.Clear(); // When stable functions might start returning something else
+class CallMemo {
+public:
+    struct Stats {
+        size_t Hits = 0;
+        size_t Misses = 0;
+        size_t Entries = 0;
+    };
+
+    // The remembered result of the call, or nullptr.
+    const Value* Find(SymbolId slot, std::span<const Value> args);
+    void Store(SymbolId slot, std::span<const Value> args, const Value &result);
+
+    // Forgets every result. The counts of hits and misses are kept.
+    void Clear() { _results.clear(); }
+
+    Stats GetStats() const;
+    void ResetStats() { _stats = {}; }
+
+private:
+    void MakeKey(SymbolId slot, std::span<const Value> args);
+
+    std::string _key; // Reused, so lookups don't allocate
+    std::unordered_map<std::string, Value> _results;
+    Stats _stats;
+};
+
+} // namespace ExpressionParser
+
+#endif // CALL_MEMO_H
@@ -7,11 +7,17 @@
 #define CONTEXT_H
 
 #include <any>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <tuple>
 #include <stdexcept>
 #include <utility>
+#include "value.h"
 
 // This file is to make more readable wrappers for providing functions to a Context
 // and to provide more solid error checking.
@@ -23,12 +29,40 @@
 
 namespace ExpressionParser {
 
-// An alias for our evaluation context.
-using Context = std::unordered_map<std::string, std::any>;
+// Context entries are addressed by slot. The SymbolTable gives each name a
+// slot id the first time it's seen, shared by every Context in the process, so
+// Variable and FunctionCall nodes can be bound to a slot once, at parse time,
+// and evaluation is a vector index instead of a string hash.
+using SymbolId = uint32_t;
+
+class SymbolTable {
+public:
+    static constexpr SymbolId None = UINT32_MAX;
+
+    static SymbolId Intern(std::string_view name);
+    // Returns None if the name has never been interned.
+    static SymbolId Find(std::string_view name);
+    static const std::string& GetName(SymbolId id);
+    static size_t Size();
+};
+
+class CallMemo;
+
+// Whether a function's result depends only on its arguments. Results of expressions
+// that call volatile functions can't be cached, as the function may return something
+// different next time. Stable functions, such as queries of the game world, return the
+// same thing for the same arguments while a CallMemo remembers them, for example for the
+// length of a draw, but may change in between.
+enum class Purity {
+    Volatile,
+    Stable,
+    Pure
+};
 
 struct FunctionWrapper {
-    std::function<std::any(const std::vector<std::any>&)> func;
+    std::function<Value(std::span<const Value>)> func;
     int arity;
+    Purity purity = Purity::Volatile;
 };
 
 // Function traits for deducing the signature of a callable.
@@ -44,30 +78,161 @@ struct function_traits<R(C::*)(Args...) const> {
     using argument_tuple = std::tuple<Args...>;
 };
 
-// Helper to call a callable using arguments from a vector<any>
-// It unpacks the vector into a tuple using an index sequence.
+// Converts an argument Value to the type a callable expects.
+// Numbers convert freely between int and double; other types must match.
+template<typename T>
+decltype(auto) value_cast(const Value& val) {
+    using D = std::decay_t<T>;
+    if constexpr (std::is_same_v<D, std::string>)
+        return val.AsString();
+    else if constexpr (std::is_same_v<D, bool>)
+        return val.AsBool();
+    else if constexpr (std::is_arithmetic_v<D>)
+        return static_cast<D>(val.AsNumber());
+    else if constexpr (std::is_same_v<D, Value>)
+        return (val);
+    else
+        static_assert(std::is_arithmetic_v<D>, "Function arguments must be bool, string, or numeric.");
+}
+
+// Helper to call a callable using arguments from a span of Values.
+// It unpacks the span into the call using an index sequence.
 template<typename F, std::size_t... I>
-std::any call_with_any_args(F f, const std::vector<std::any>& args, std::index_sequence<I...>) {
+Value call_with_value_args(const F& f, [[maybe_unused]] std::span<const Value> args, std::index_sequence<I...>) {
     using traits = function_traits<F>;
     using arg_tuple = typename traits::argument_tuple;
-    // Attempt to cast each argument from std::any to the expected type.
-    return f(std::any_cast<std::tuple_element_t<I, arg_tuple>>(args[I])...);
+    return Value::From(f(value_cast<std::tuple_element_t<I, arg_tuple>>(args[I])...));
 }
 
 // The helper function to create a FunctionWrapper from a callable.
 template<typename F>
-FunctionWrapper make_function_wrapper(F f) {
+FunctionWrapper make_function_wrapper(F f, Purity purity = Purity::Volatile) {
     constexpr size_t arity = function_traits<F>::arity;
     FunctionWrapper wrapper;
-    wrapper.func = [f](const std::vector<std::any>& args) -> std::any {
+    wrapper.func = [f](std::span<const Value> args) -> Value {
         if (args.size() != arity)
             throw std::runtime_error("Incorrect number of arguments provided.");
-        return call_with_any_args(f, args, std::make_index_sequence<arity>{});
+        return call_with_value_args(f, args, std::make_index_sequence<arity>{});
     };
     wrapper.arity = static_cast<int>(arity);
+    wrapper.purity = purity;
     return wrapper;
 }
 
+// A single entry in a Context: a Value, a function, or some other host
+// object that expressions can't read but the host wants to keep alongside.
+class ContextValue {
+    friend class Context;
+
+public:
+    template<typename T>
+    void Set(T&& val) {
+        using D = std::decay_t<T>;
+        _set = true;
+        _version = NextVersion();
+        _function.reset();
+        _other.reset();
+        _value = Value();
+        if constexpr (std::is_same_v<D, FunctionWrapper>)
+            _function = std::make_shared<const FunctionWrapper>(std::forward<T>(val));
+        else if constexpr (std::is_same_v<D, std::any>)
+            SetAny(val);
+        else
+            _value = Value::From(std::forward<T>(val));
+    }
+
+    std::any ToAny() const;
+
+    bool IsSet() const { return _set; }
+    bool IsFunction() const { return _function != nullptr; }
+    const Value& GetValue() const { return _value; }
+    const FunctionWrapper* GetFunction() const { return _function.get(); }
+    // When this entry was last set. Versions increase across every Context in the process.
+    uint64_t GetVersion() const { return _version; }
+
+private:
+    static uint64_t NextVersion();
+    void SetAny(const std::any& val);
+
+    Value _value;
+    std::shared_ptr<const FunctionWrapper> _function;
+    std::any _other;
+    uint64_t _version = 0;
+    bool _set = false;
+};
+
+// What Context::operator[] returns. It supports assignment of any supported type
+// and converts to std::any, so code such as std::any_cast<int>(context["x"]) still works.
+// It can't be copied, which also stops std::any from wrapping the reference itself.
+class ContextValueRef {
+public:
+    ContextValueRef(ContextValue& entry, uint64_t& contextVersion) : _entry(entry), _contextVersion(contextVersion) {}
+    ContextValueRef(const ContextValueRef&) = delete;
+    ContextValueRef& operator=(const ContextValueRef&) = delete;
+
+    template<typename T>
+    ContextValueRef& operator=(T&& val) {
+        _entry.Set(std::forward<T>(val));
+        _contextVersion = _entry.GetVersion();
+        return *this;
+    }
+
+    operator std::any() const { return _entry.ToAny(); }
+
+    bool IsFunction() const { return _entry.IsFunction(); }
+    const Value& GetValue() const { return _entry.GetValue(); }
+    const FunctionWrapper* GetFunction() const { return _entry.GetFunction(); }
+
+private:
+    ContextValue& _entry;
+    uint64_t& _contextVersion;
+};
+
+// The evaluation context: named values and functions that expressions can refer to.
+class Context {
+public:
+    Context() = default;
+    Context(const Context& other) = default;
+    Context(Context&& other) noexcept = default;
+    // Assigning counts as changing every entry, so cached results from before are discarded.
+    Context& operator=(const Context& other);
+    Context& operator=(Context&& other) noexcept;
+
+    ContextValueRef operator[](const std::string& name) { return (*this)[SymbolTable::Intern(name)]; }
+    ContextValueRef operator[](SymbolId slot);
+
+    // Return nullptr if there is no entry with that name or slot.
+    const ContextValue* Find(const std::string& name) const { return Find(SymbolTable::Find(name)); }
+    const ContextValue* Find(SymbolId slot) const {
+        if (slot >= _slots.size() || !_slots[slot].IsSet())
+            return nullptr;
+        return &_slots[slot];
+    }
+    bool Contains(const std::string& name) const { return Find(name) != nullptr; }
+    size_t Size() const { return _size; }
+
+    // The version of the most recent change to any entry, so callers that cache results can
+    // tell whether anything has changed since. GetVersion(slot) is 0 for an entry that was never set.
+    uint64_t GetVersion() const { return _version; }
+    uint64_t GetVersion(SymbolId slot) const { return slot < _slots.size() ? _slots[slot].GetVersion() : 0; }
+
+    // Visits each entry in slot order.
+    void ForEach(const std::function<void(const std::string& name, const ContextValue& entry)>& visit) const;
+
+    // Calls made while a memo is attached remember their results in it. Attaching one isn't a
+    // change to the context, and assigning another context to this one keeps it.
+    void SetCallMemo(CallMemo* memo) { _callMemo = memo; }
+    CallMemo* GetCallMemo() const { return _callMemo; }
+
+private:
+    void Replace(std::vector<ContextValue> slots, size_t size);
+
+    std::vector<ContextValue> _slots;
+    size_t _size = 0;
+    uint64_t _version = 0;
+    CallMemo* _callMemo = nullptr;
+};
+
 }
 
-#endif // EXPRESSION_H
\ No newline at end of file
+#endif // CONTEXT_H
@@ -13,16 +13,27 @@
 #include <functional>
 #include <memory>
 #include <stdexcept>
-#include <regex>
+#include <cstdint>
 #include "context.h"
+#include "trace.h"
 
 namespace ExpressionParser {
 
+class Compiler;
+enum class OpCode : uint8_t;
+
 // ---------------------
 // Utility functions
 // ---------------------
 namespace Utils {
 
+    bool MakeBool(const Value &val);
+    double MakeNumeric(const Value &val);
+    Value MakeString(const Value &val);
+    Value MakeTypeMatch(const Value &leftVal, const Value &rightVal);
+    bool ValueEquals(const Value &a, const Value &b);
+
+    // std::any versions, kept for API compatibility.
     bool MakeBool(const std::any &val);
     double MakeNumeric(const std::any &val);
     std::string MakeString(const std::any &val);
@@ -32,13 +43,27 @@ namespace Utils {
     std::string FormatBoolean(bool val);
     std::string FormatNumeric(double num);
     std::string FormatString(const std::string &val);
+    std::string FormatValue(const Value &val);
     std::string FormatValue(const std::any &val);
+
+    // Context access shared by the tree evaluator and the bytecode VM.
+    const Value& FetchVariable(const Context &context, SymbolId slot);
+    Value CallFunction(const Context &context, SymbolId slot, std::span<const Value> args);
 }
 
+// A comparison between a variable and a literal, such as "wealth >= 2" or "street == 'docks'",
+// turned round if need be so the variable is on the left. Hosts can index conditions on these.
+struct Predicate {
+    SymbolId slot;
+    OpCode op;
+    Value operand;
+};
+
 // ---------------------
 // Base Node
 // ---------------------
 class ExpressionNode {
+    friend class Compiler;
 public:
     std::string Name;
     int Precedence;
@@ -48,11 +73,36 @@ public:
         : Name(name), Precedence(precedence) {}
 
     virtual ~ExpressionNode() = default;
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const = 0;
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const = 0;
     virtual std::string DumpStructure(int indent = 0) const = 0;
     virtual std::string Write() const = 0;
+    virtual void Compile(Compiler &compiler) const = 0;
+
+    // The type this node always evaluates to, or None if it depends on the context.
+    virtual Value::Type GetResultType() const { return Value::Type::None; }
+    // True for literals.
+    virtual bool IsConstant() const { return false; }
+    // Approximate bytes used by this node and its children.
+    virtual size_t GetMemoryUsage() const { return sizeof(ExpressionNode); }
+    // Adds the predicates that must all hold for this node to be true: the node itself,
+    // or the terms of an "and". Terms after one that isn't a predicate aren't added, as
+    // checking them first would skip a call or error it makes. Returns true if the node is
+    // made of nothing else.
+    virtual bool CollectPredicates(std::vector<Predicate>& /*predicates*/) const { return false; }
+
+    // Folds constant subexpressions and removes identities such as "true and x".
+    // May return a different node; the result keeps the original's specificity.
+    static std::shared_ptr<ExpressionNode> Optimize(std::shared_ptr<ExpressionNode> node);
 
 protected:
+    // Simplifies this node's children, then returns a replacement for this node, or nullptr.
+    virtual std::shared_ptr<ExpressionNode> Simplify() { return nullptr; }
+    static std::shared_ptr<ExpressionNode> MakeLiteral(const Value &value);
+    // True if the node is a literal of the same type as value and equal to it.
+    static bool IsLiteral(const ExpressionNode &node, const Value &value);
+    // Records the evaluation of a literal with this value.
+    void RecordLiteral(TraceSink &trace, const Value &value) const;
+
     int _specificity = 0;
 };
 
@@ -68,99 +118,126 @@ public:
     BinaryOp(const std::string &name, std::shared_ptr<ExpressionNode> left, const std::string &op,
              std::shared_ptr<ExpressionNode> right, int precedence);
 
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual size_t GetMemoryUsage() const override;
+    virtual Value::Type GetResultType() const override;
+    virtual bool CollectPredicates(std::vector<Predicate>& predicates) const override;
 protected:
-    virtual std::pair<bool, std::any> ShortCircuit(const std::any &leftVal) const;
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const = 0;
+    virtual std::shared_ptr<ExpressionNode> Simplify() override;
+    // Returns the operand that this node is equivalent to, if the other one is an identity element.
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const { return nullptr; }
+    virtual std::pair<bool, Value> ShortCircuit(const Value &leftVal) const;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const = 0;
+    virtual OpCode GetOpCode() const = 0;
 };
 
 class OpOr : public BinaryOp {
 public:
     OpOr(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::pair<bool, std::any> ShortCircuit(const std::any& leftVal) const override;
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const override;
+    virtual std::pair<bool, Value> ShortCircuit(const Value &leftVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpAnd : public BinaryOp {
 public:
     OpAnd(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
+    virtual bool CollectPredicates(std::vector<Predicate>& predicates) const override;
 protected:
-    virtual std::pair<bool, std::any> ShortCircuit(const std::any& leftVal) const override;
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const override;
+    virtual std::pair<bool, Value> ShortCircuit(const Value &leftVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpEquals : public BinaryOp {
 public:
     OpEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpNotEquals : public BinaryOp {
 public:
     OpNotEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpPlus : public BinaryOp {
 public:
     OpPlus(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpMinus : public BinaryOp {
 public:
     OpMinus(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpDivide : public BinaryOp {
 public:
     OpDivide(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpMultiply : public BinaryOp {
 public:
     OpMultiply(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::pair<bool, std::any> ShortCircuit(const std::any& leftVal) const override;
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual std::shared_ptr<ExpressionNode> SimplifyIdentity() const override;
+    virtual std::pair<bool, Value> ShortCircuit(const Value &leftVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpGreaterThan : public BinaryOp {
 public:
     OpGreaterThan(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpLessThan : public BinaryOp {
 public:
     OpLessThan(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpGreaterThanEquals : public BinaryOp {
 public:
     OpGreaterThanEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpLessThanEquals : public BinaryOp {
 public:
     OpLessThanEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right);
 protected:
-    virtual std::any DoEval(const std::any &leftVal, const std::any &rightVal) const override;
+    virtual Value DoEval(const Value &leftVal, const Value &rightVal) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 // ---------------------
@@ -172,25 +249,33 @@ protected:
     std::string Op;
 public:
     UnaryOp(const std::string &name, const std::string &op, std::shared_ptr<ExpressionNode> operand, int precedence);
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual size_t GetMemoryUsage() const override;
+    virtual Value::Type GetResultType() const override;
 protected:
-    virtual std::any DoEval(const std::any &val) const = 0;
+    virtual std::shared_ptr<ExpressionNode> Simplify() override;
+    virtual Value DoEval(const Value &val) const = 0;
+    virtual OpCode GetOpCode() const = 0;
 };
 
 class OpNegative : public UnaryOp {
 public:
     OpNegative(std::shared_ptr<ExpressionNode> operand);
 protected:
-    virtual std::any DoEval(const std::any &val) const override;
+    virtual Value DoEval(const Value &val) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 class OpNot : public UnaryOp {
 public:
     OpNot(std::shared_ptr<ExpressionNode> operand);
 protected:
-    virtual std::any DoEval(const std::any &val) const override;
+    virtual std::shared_ptr<ExpressionNode> Simplify() override;
+    virtual Value DoEval(const Value &val) const override;
+    virtual OpCode GetOpCode() const override;
 };
 
 // ---------------------
@@ -200,27 +285,37 @@ class LiteralBoolean : public ExpressionNode {
     bool value;
 public:
     LiteralBoolean(bool val);
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual Value::Type GetResultType() const override { return Value::Type::Bool; }
+    virtual bool IsConstant() const override { return true; }
 };
 
 class LiteralNumber : public ExpressionNode {
     double value;
 public:
     LiteralNumber(const std::string &val);
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    LiteralNumber(double val);
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual Value::Type GetResultType() const override { return Value::Type::Double; }
+    virtual bool IsConstant() const override { return true; }
 };
 
 class LiteralString : public ExpressionNode {
-    std::string value;
+    Value value;
 public:
     LiteralString(const std::string &val);
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual Value::Type GetResultType() const override { return Value::Type::String; }
+    virtual bool IsConstant() const override { return true; }
 };
 
 // ---------------------
@@ -229,11 +324,15 @@ public:
 
 class Variable : public ExpressionNode {
     std::string name;
+    SymbolId slot;
 public:
     Variable(const std::string &name);
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    SymbolId GetSlot() const { return slot; }
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual size_t GetMemoryUsage() const override;
 };
 
 // ---------------------
@@ -242,12 +341,15 @@ public:
 
 class FunctionCall : public ExpressionNode {
     std::string funcName;
+    SymbolId slot;
     std::vector<std::shared_ptr<ExpressionNode>> args;
 public:
     FunctionCall(const std::string &funcName, const std::vector<std::shared_ptr<ExpressionNode>> &args);
-    virtual std::any Evaluate(const Context &context, std::vector<std::string>* dumpEval = nullptr) const override;
+    virtual Value Evaluate(const Context &context, TraceSink* trace = nullptr) const override;
     virtual std::string DumpStructure(int indent = 0) const override;
     virtual std::string Write() const override;
+    virtual void Compile(Compiler &compiler) const override;
+    virtual size_t GetMemoryUsage() const override;
 };
 
 } // namespace ExpressionParser
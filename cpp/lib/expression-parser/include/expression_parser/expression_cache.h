@@ -0,0 +1,71 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef EXPRESSION_CACHE_H
+#define EXPRESSION_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "program.h"
+
+namespace ExpressionParser {
+
+// A thread-safe intern cache of compiled expressions, keyed by source text.
+// Text is normalized first, so "a>=0" and "a >= 0" share one entry. Entries
+// are immutable and shared, so the same condition used by many storylets is
+// parsed and compiled once.
+class ExpressionCache {
+public:
+    struct Stats {
+        size_t Hits = 0;
+        size_t Misses = 0;
+        size_t Evictions = 0;
+        size_t Entries = 0;
+        size_t MemoryUsage = 0; // Approximate bytes held by cached entries
+    };
+
+    // A capacity of 0 means unbounded. Otherwise the least recently used entries
+    // are dropped once the cache is full; anything still using them keeps them alive.
+    explicit ExpressionCache(size_t capacity = 0);
+
+    // The cache used by the storylet framework.
+    static ExpressionCache& Global();
+
+    // Returns the compiled expression for the text, parsing and compiling it on a miss.
+    // Throws if the text doesn't parse.
+    std::shared_ptr<const CompiledExpression> Get(const std::string &text);
+
+    Stats GetStats() const;
+    void SetCapacity(size_t capacity);
+    size_t GetCapacity() const;
+    void Clear();
+
+    // Token-by-token form of the text with whitespace normalized.
+    static std::string Normalize(std::string_view text);
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const CompiledExpression> expression;
+        size_t memoryUsage;
+    };
+
+    void EvictLocked();
+
+    mutable std::mutex _mutex;
+    std::list<Entry> _entries; // Most recently used first
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> _index;
+    size_t _capacity;
+    Stats _stats;
+};
+
+} // namespace ExpressionParser
+
+#endif // EXPRESSION_CACHE_H
@@ -0,0 +1,75 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef EXPRESSION_GRAPH_H
+#define EXPRESSION_GRAPH_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "program.h"
+
+// Merges many compiled expressions into one graph in which identical subexpressions,
+// such as the "wealth >= 0" shared by a deck of conditions, are a single node. Within
+// a pass each node is evaluated at most once, and every expression reuses its result.
+//
+// ExpressionGraph graph;
+// auto root = graph.Add(*compiled);
+// graph.BeginPass();
+// Value result = graph.Evaluate(root, context);
+
+namespace ExpressionParser {
+
+class ExpressionGraph {
+public:
+    using NodeId = uint32_t;
+
+    // Adds an expression, reusing any of its subexpressions already in the graph. Returns its root.
+    NodeId Add(const CompiledExpression &expression);
+    void Clear();
+
+    // Starts a new pass, discarding the results of the last one. The context shouldn't
+    // change during a pass.
+    void BeginPass();
+
+    // Evaluates an expression with the same result, errors and short-circuiting as running it
+    // on its own. Results that depend on a volatile function aren't kept, so stable
+    // functions should only be relied on to keep their results for a pass.
+    Value Evaluate(NodeId root, const Context &context);
+
+    size_t Size() const { return _nodes.size(); }
+    // How many node evaluations running each expression on its own would have made that
+    // were answered from results already in the pass, since the graph was created.
+    uint64_t GetSavedEvaluations() const { return _saved; }
+
+private:
+    struct Node {
+        OpCode op;
+        uint16_t count;         // Number of children
+        uint32_t operand;       // Slot for LoadVar and Call, index into _constants for PushConst
+        uint32_t firstChild;    // Index into _children
+    };
+
+    NodeId AddNode(OpCode op, uint32_t operand, const Value* constant, const NodeId* children, uint16_t count);
+    Value EvaluateNode(NodeId id, const Context &context, uint64_t &cost, bool &keep);
+
+    std::vector<Node> _nodes;
+    std::vector<NodeId> _children;
+    std::vector<Value> _constants;
+    std::unordered_map<std::string, NodeId> _lookup; // Nodes by their encoded contents
+
+    // Results kept for the current pass, by node, with the evaluations each one took
+    std::vector<uint64_t> _passes;
+    std::vector<Value> _results;
+    std::vector<uint64_t> _costs;
+    uint64_t _pass = 1;
+    uint64_t _saved = 0;
+};
+
+} // namespace ExpressionParser
+
+#endif // EXPRESSION_GRAPH_H
@@ -8,42 +8,40 @@
 
 #include <vector>
 #include <string>
-#include <regex>
+#include <string_view>
 #include <memory>
 
 #include "expression.h"
 
 namespace ExpressionParser {
 
+    enum class TokenKind {
+        Operator,   // Symbols: >= <= == = != > < ( ) , && || ! + - / *
+        Keyword,    // and, or, not
+        Boolean,    // true, false, True, False
+        Identifier,
+        Number,
+        String      // Includes the surrounding quotes
+    };
+
+    // A token is a view into the source text, so it is only valid while
+    // the string that was tokenized is alive.
+    struct Token {
+        TokenKind Kind;
+        std::string_view Text;
+        size_t Offset;
+    };
+
+    // Parses expression text into a tree. A parser holds no state between calls, so one
+    // can be shared, or several used at once from different threads.
     class Parser {
-    private:
-        std::vector<std::string> _tokens;
-        int _pos;
-        static const std::regex TOKEN_REGEX;
     public:
-        Parser();
-        std::shared_ptr<ExpressionNode> Parse(const std::string &expression);
-    private:
-        std::shared_ptr<ExpressionNode> ParseOr();
-        std::shared_ptr<ExpressionNode> ParseAnd();
-        std::shared_ptr<ExpressionNode> ParseMathAddSub();
-        std::shared_ptr<ExpressionNode> ParseMathMulDiv();
-        std::shared_ptr<ExpressionNode> ParseBinaryOp();
-        std::shared_ptr<ExpressionNode> ParseUnaryOp();
-        std::shared_ptr<ExpressionNode> ParseTerm();
-        std::shared_ptr<LiteralString> ParseStringLiteral();
-
-        std::vector<std::string> Tokenize(const std::string &expression);
-        bool _Match(std::initializer_list<const char*> tokens);
-        bool _Match(const char* token);
-        std::string _MatchIdentifier();
-        void _Consume(const std::string &expectedToken);
-        std::string _Peek();
-        std::string _Previous();
-        std::string _Advance();
-        std::string _Expect(const std::string &expectedToken);
+        std::shared_ptr<ExpressionNode> Parse(const std::string &expression) const;
+
+        // Single-pass lexer. Throws on any character that can't start a token.
+        static std::vector<Token> Tokenize(std::string_view expression);
     };
 
 } // namespace ExpressionParser
 
-#endif // PARSER_H
\ No newline at end of file
+#endif // PARSER_H
@@ -0,0 +1,147 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+#include "expression.h"
+
+// Lowers an ExpressionNode tree into flat bytecode for a small stack machine,
+// so hot conditions can be run without walking the tree or making virtual calls.
+//
+// auto program = Compiler::Compile(*parser.Parse("a > 1 and f('x')"));
+// Value result = program.Run(context);
+
+namespace ExpressionParser {
+
+enum class OpCode : uint8_t {
+    PushConst,          // Push constant [Operand]
+    LoadVar,            // Push the context variable in slot [Operand]
+    Call,               // Pop [Count] args, call the context function in slot [Operand], push result
+
+    // Short-circuit jumps. They test the top of the stack and, if it decides
+    // the result, replace it with that result and jump to [Operand].
+    JumpIfTrue,         // or
+    JumpIfFalse,        // and
+    JumpIfZero,         // *
+
+    // Binary operators pop two values and push one.
+    Or,
+    And,
+    Equals,
+    NotEquals,
+    Plus,
+    Minus,
+    Divide,
+    Multiply,
+    GreaterThan,
+    LessThan,
+    GreaterThanEquals,
+    LessThanEquals,
+
+    // Unary operators replace the top of the stack.
+    Negative,
+    Not
+};
+
+struct Instruction {
+    OpCode Op;
+    uint16_t Count;
+    uint32_t Operand;
+};
+
+class Program {
+    friend class Compiler;
+public:
+    Value Run(const Context &context) const;
+
+    // Human-readable listing of the bytecode, for debugging.
+    std::string Dump() const;
+
+    size_t Size() const { return _code.size(); }
+    const std::vector<Instruction>& GetCode() const { return _code; }
+    const std::vector<Value>& GetConstants() const { return _constants; }
+    // Approximate bytes used, including the Program itself.
+    size_t GetMemoryUsage() const;
+
+    // Applies a binary operator to values that have already been evaluated.
+    static Value EvalBinary(OpCode op, const Value &left, const Value &right);
+
+private:
+    std::vector<Instruction> _code;
+    std::vector<Value> _constants;
+    uint32_t _maxStack = 0;
+};
+
+class Compiler {
+public:
+    static Program Compile(const ExpressionNode &node);
+
+    // Rebuilds the tree a program was compiled from, so bytecode that was saved can be loaded
+    // without parsing. Bytecode doesn't record specificity, so it's given. Throws if the code
+    // isn't a whole expression.
+    static std::shared_ptr<ExpressionNode> Decompile(std::span<const Instruction> code, std::span<const Value> constants, int specificity);
+
+    // Used by ExpressionNode::Compile implementations.
+    void Emit(OpCode op, uint32_t operand = 0, uint16_t count = 0);
+    void EmitConstant(const Value &value);
+
+    // Emits the short-circuit jump for a binary operator, if it has one.
+    // Returns the jump's position so EndShortCircuit can point it past the operator.
+    size_t BeginShortCircuit(OpCode binaryOp);
+    void EndShortCircuit(size_t jump);
+
+private:
+    Program _program;
+    int _depth = 0;
+};
+
+// A parsed expression tree together with its bytecode. The tree is optimized
+// first, and kept for specificity, tracing and introspection; the program is
+// what normally gets run.
+class CompiledExpression {
+public:
+    explicit CompiledExpression(std::shared_ptr<ExpressionNode> tree);
+
+    // Runs the bytecode, or walks the tree when evaluation is being traced.
+    Value Evaluate(const Context &context, TraceSink* trace = nullptr) const;
+
+    // True if the expression folded down to a single value that doesn't depend on the context.
+    bool IsConstant() const { return _tree->IsConstant(); }
+    // The folded value, if IsConstant().
+    const Value& GetConstant() const { return _constant; }
+
+    const std::shared_ptr<ExpressionNode>& GetTree() const { return _tree; }
+    const Program& GetProgram() const { return _program; }
+    int GetSpecificity() const { return _tree->GetSpecificity(); }
+    // Approximate bytes used by the tree and the program.
+    size_t GetMemoryUsage() const;
+
+    // The slots of every variable and function the expression reads, sorted, and of the
+    // functions it calls. The result can only change when one of these entries changes,
+    // or when a called function isn't pure.
+    const std::vector<SymbolId>& GetReads() const { return _reads; }
+    const std::vector<SymbolId>& GetCalls() const { return _calls; }
+
+    // The comparisons of a variable with a literal that must all hold for the expression to be
+    // true. Returns true if the expression is nothing but these.
+    bool GetPredicates(std::vector<Predicate>& predicates) const { return _tree->CollectPredicates(predicates); }
+
+private:
+    std::shared_ptr<ExpressionNode> _tree;
+    Program _program;
+    Value _constant;
+    std::vector<SymbolId> _reads;
+    std::vector<SymbolId> _calls;
+};
+
+} // namespace ExpressionParser
+
+#endif // PROGRAM_H
@@ -0,0 +1,105 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include "context.h"
+
+// Tracing records what an evaluation did as compact events, and only turns them into
+// text when asked. Pass a TraceSink to Evaluate to trace it; with none, nothing is recorded.
+//
+// TraceBuffer trace(256); // Keeps the last 256 events
+// compiled.Evaluate(context, &trace);
+// for (const auto& line : trace.Format()) ...
+//
+// Build with EXPRESSION_PARSER_TRACING=0 to compile tracing out altogether.
+
+#ifndef EXPRESSION_PARSER_TRACING
+#define EXPRESSION_PARSER_TRACING 1
+#endif
+
+namespace ExpressionParser {
+
+enum class OpCode : uint8_t;
+
+// False when tracing is compiled out, in which case sinks are never called.
+inline constexpr bool TracingEnabled = EXPRESSION_PARSER_TRACING != 0;
+
+struct TraceEvent {
+    enum class Kind : uint8_t {
+        Literal,        // result
+        Variable,       // slot -> result
+        Call,           // slot(operands) = result
+        Unary,          // op operands[0] = result
+        Binary,         // operands[0] op operands[1] = result
+        ShortCircuit,   // operands[0] op (ignore) = result
+        Note            // text, with each % replaced by the next operand
+    };
+
+    // Calls with more arguments than this only record the first few.
+    static constexpr uint16_t MAX_OPERANDS = 4;
+
+    Kind kind = Kind::Note;
+    OpCode op{};
+    uint16_t count = 0;             // Number of operands, including any not recorded
+    SymbolId slot = 0;
+    const void* node = nullptr;     // The expression node that recorded it, if any
+    const char* text = nullptr;     // For notes. Must outlive the event, so is usually a literal.
+    Value operands[MAX_OPERANDS];
+    Value result;
+
+    // A message from the host, such as "Evaluating condition for %".
+    static TraceEvent Note(const char* text, std::initializer_list<Value> values);
+};
+
+// The text of an event, as it's shown in traces.
+std::string FormatTraceEvent(const TraceEvent &event);
+
+class TraceSink {
+public:
+    virtual ~TraceSink() = default;
+    virtual void Record(const TraceEvent &event) = 0;
+};
+
+// Keeps the most recent events in a ring allocated up front, so leaving tracing on costs
+// a copy per event. Older events are overwritten once it's full.
+class TraceBuffer : public TraceSink {
+public:
+    explicit TraceBuffer(size_t capacity = 1024);
+
+    void Record(const TraceEvent &event) override;
+
+    // Events held, oldest first.
+    size_t Size() const { return _size; }
+    const TraceEvent& operator[](size_t index) const;
+    size_t Capacity() const { return _events.size(); }
+    // Events that have been overwritten since the last Clear.
+    uint64_t Dropped() const { return _dropped; }
+
+    std::vector<std::string> Format() const;
+    void Clear();
+
+private:
+    std::vector<TraceEvent> _events;
+    size_t _next = 0;
+    size_t _size = 0;
+    uint64_t _dropped = 0;
+};
+
+// Formats each event as it's recorded and keeps every line, for callers that want the
+// whole trace as text. It is the vector of lines, so can be searched and iterated as one.
+class TraceLines : public TraceSink, public std::vector<std::string> {
+public:
+    void Record(const TraceEvent &event) override { push_back(FormatTraceEvent(event)); }
+};
+
+} // namespace ExpressionParser
+
+#endif // TRACE_H
@@ -0,0 +1,151 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#ifndef VALUE_H
+#define VALUE_H
+
+#include <any>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace ExpressionParser {
+
+// Strings held by a Value are pooled, so Values stay small and string equality
+// is a pointer comparison: while any Value holds a string, every Value with the
+// same text shares its entry. Entries are counted, and freed once nothing holds them.
+class StringPool {
+public:
+    struct Entry {
+        explicit Entry(std::string_view text) : text(text) {}
+        std::string text;
+        mutable std::atomic<uint32_t> refs{0};
+    };
+
+    // The entry for the text, with a reference added for the caller to release.
+    static const Entry* Acquire(std::string_view text);
+    static void AddRef(const Entry* entry) { entry->refs.fetch_add(1, std::memory_order_relaxed); }
+    static void Release(const Entry* entry);
+    // Number of strings held.
+    static size_t Size();
+};
+
+// The result of evaluating an expression: nothing, a bool, an int, a double or a string.
+class Value {
+public:
+    enum class Type : uint8_t {
+        None,
+        Bool,
+        Int,
+        Double,
+        String
+    };
+
+    Value() : _type(Type::None), _double(0) {}
+    Value(bool val) : _type(Type::Bool), _bool(val) {}
+    Value(int val) : _type(Type::Int), _int(val) {}
+    Value(double val) : _type(Type::Double), _double(val) {}
+    Value(const char* val) : Value(std::string_view(val)) {}
+    Value(std::string_view val) : _type(Type::String), _string(StringPool::Acquire(val)) {}
+    Value(const std::string& val) : Value(std::string_view(val)) {}
+
+    Value(const Value &other) : _type(other._type) { CopyPayload(other); }
+    Value(Value &&other) noexcept : _type(other._type) {
+        CopyPayload(other, false);
+        other._type = Type::None;
+    }
+    Value& operator=(const Value &other) {
+        if (this != &other) {
+            const StringPool::Entry* held = IsString() ? _string : nullptr;
+            _type = other._type;
+            CopyPayload(other);
+            if (held)
+                StringPool::Release(held);
+        }
+        return *this;
+    }
+    Value& operator=(Value &&other) noexcept {
+        if (this != &other) {
+            if (IsString())
+                StringPool::Release(_string);
+            _type = other._type;
+            CopyPayload(other, false);
+            other._type = Type::None;
+        }
+        return *this;
+    }
+    ~Value() {
+        if (IsString())
+            StringPool::Release(_string);
+    }
+
+    // Converts any other arithmetic type, e.g. the result of a host function.
+    template <typename T>
+    static Value From(T&& val) {
+        using D = std::decay_t<T>;
+        if constexpr (std::is_same_v<D, Value> || std::is_same_v<D, bool> || std::is_same_v<D, int> ||
+                      std::is_same_v<D, double> || std::is_same_v<D, std::string> ||
+                      std::is_same_v<D, std::string_view> || std::is_same_v<D, const char*> ||
+                      std::is_same_v<D, char*>)
+            return Value(std::forward<T>(val));
+        else if constexpr (std::is_integral_v<D> && sizeof(D) <= sizeof(int) && std::is_signed_v<D>)
+            return Value(static_cast<int>(val));
+        else if constexpr (std::is_arithmetic_v<D>)
+            return Value(static_cast<double>(val));
+        else
+            static_assert(std::is_arithmetic_v<D>, "Values must be bool, string, or numeric.");
+    }
+
+    // std::any interop, for the public API. FromAny returns a None value for unsupported types.
+    static Value FromAny(const std::any& val);
+    std::any ToAny() const;
+
+    Type GetType() const { return _type; }
+    bool IsNone() const { return _type == Type::None; }
+    bool IsBool() const { return _type == Type::Bool; }
+    bool IsNumeric() const { return _type == Type::Int || _type == Type::Double; }
+    bool IsString() const { return _type == Type::String; }
+
+    // Checked accessors: these throw if the Value holds a different type.
+    bool AsBool() const;
+    double AsNumber() const;
+    const std::string& AsString() const;
+
+    // Unchecked accessors, for callers that have already tested the type.
+    bool GetBool() const { return _bool; }
+    int GetInt() const { return _int; }
+    double GetDouble() const { return _double; }
+    double GetNumber() const { return _type == Type::Int ? static_cast<double>(_int) : _double; }
+    const std::string& GetString() const { return _string->text; }
+
+private:
+    // Copies the other value's payload for our _type, which must already match its own.
+    void CopyPayload(const Value &other, bool addRef = true) {
+        switch (_type) {
+            case Type::Bool: _bool = other._bool; break;
+            case Type::Int: _int = other._int; break;
+            case Type::String:
+                _string = other._string;
+                if (addRef)
+                    StringPool::AddRef(_string);
+                break;
+            default: _double = other._double; break;
+        }
+    }
+
+    Type _type;
+    union {
+        bool _bool;
+        int _int;
+        double _double;
+        const StringPool::Entry* _string;
+    };
+};
+
+} // namespace ExpressionParser
+
+#endif // VALUE_H
@@ -15,6 +15,8 @@
      ESCAPED_DOUBLEQUOTE = 3
  };
  
+ // How strings are quoted when values are written out. Each thread has its own setting,
+ // so one thread changing it doesn't change what another writes.
  class Writer {
  public:
      Writer() = delete; // Prevent instantiation
@@ -23,7 +25,7 @@
      static void setStringFormat(STRING_FORMAT format);
  
  private:
-     static STRING_FORMAT _stringFormat;
+     static thread_local STRING_FORMAT _stringFormat;
  };
  
  } // namespace ExpressionParser
@@ -0,0 +1,60 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/call_memo.h"
+
+namespace ExpressionParser {
+
+namespace {
+
+    template<typename T>
+    void AppendBytes(std::string &key, const T &value) {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+}
+
+// Arguments are keyed by type as well as value, as functions may treat 1 and 1.0 differently.
+// Strings are keyed by their text, as a pooled string's entry can be freed and reused while the memo is kept.
+void CallMemo::MakeKey(SymbolId slot, std::span<const Value> args) {
+    _key.clear();
+    AppendBytes(_key, slot);
+    for (const Value &arg : args) {
+        AppendBytes(_key, arg.GetType());
+        switch (arg.GetType()) {
+            case Value::Type::Bool: AppendBytes(_key, arg.GetBool()); break;
+            case Value::Type::Int: AppendBytes(_key, arg.GetInt()); break;
+            case Value::Type::Double: AppendBytes(_key, arg.GetDouble()); break;
+            case Value::Type::String:
+                AppendBytes(_key, arg.GetString().size());
+                _key += arg.GetString();
+                break;
+            default: break;
+        }
+    }
+}
+
+const Value* CallMemo::Find(SymbolId slot, std::span<const Value> args) {
+    MakeKey(slot, args);
+    auto it = _results.find(_key);
+    if (it == _results.end()) {
+        _stats.Misses++;
+        return nullptr;
+    }
+    _stats.Hits++;
+    return &it->second;
+}
+
+void CallMemo::Store(SymbolId slot, std::span<const Value> args, const Value &result) {
+    MakeKey(slot, args);
+    _results[_key] = result;
+}
+
+CallMemo::Stats CallMemo::GetStats() const {
+    Stats stats = _stats;
+    stats.Entries = _results.size();
+    return stats;
+}
+
+} // namespace ExpressionParser
@@ -0,0 +1,142 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/context.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+
+namespace ExpressionParser {
+
+namespace {
+
+    struct NameHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view text) const { return std::hash<std::string_view>{}(text); }
+    };
+
+    // Names live in a deque so references returned by GetName stay valid.
+    struct Symbols {
+        std::deque<std::string> names;
+        std::unordered_map<std::string, SymbolId, NameHash, std::equal_to<>> ids;
+        std::shared_mutex mutex;
+    };
+
+    Symbols& GetSymbols() {
+        static Symbols symbols;
+        return symbols;
+    }
+}
+
+// ---------------------
+// SymbolTable
+// ---------------------
+SymbolId SymbolTable::Intern(std::string_view name) {
+    SymbolId id = Find(name);
+    if (id != None)
+        return id;
+    Symbols& symbols = GetSymbols();
+    std::unique_lock lock(symbols.mutex);
+    auto [it, inserted] = symbols.ids.emplace(std::string(name), static_cast<SymbolId>(symbols.names.size()));
+    if (inserted)
+        symbols.names.emplace_back(name);
+    return it->second;
+}
+
+SymbolId SymbolTable::Find(std::string_view name) {
+    Symbols& symbols = GetSymbols();
+    std::shared_lock lock(symbols.mutex);
+    auto it = symbols.ids.find(name);
+    return it == symbols.ids.end() ? None : it->second;
+}
+
+const std::string& SymbolTable::GetName(SymbolId id) {
+    Symbols& symbols = GetSymbols();
+    std::shared_lock lock(symbols.mutex);
+    return symbols.names.at(id);
+}
+
+size_t SymbolTable::Size() {
+    Symbols& symbols = GetSymbols();
+    std::shared_lock lock(symbols.mutex);
+    return symbols.names.size();
+}
+
+// ---------------------
+// ContextValue
+// ---------------------
+uint64_t ContextValue::NextVersion() {
+    static std::atomic<uint64_t> version{0};
+    return version.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+std::any ContextValue::ToAny() const {
+    if (_function)
+        return *_function;
+    if (_other.has_value())
+        return _other;
+    return _value.ToAny();
+}
+
+void ContextValue::SetAny(const std::any& val) {
+    if (val.type() == typeid(FunctionWrapper)) {
+        _function = std::make_shared<const FunctionWrapper>(std::any_cast<const FunctionWrapper&>(val));
+        return;
+    }
+    _value = Value::FromAny(val);
+    if (_value.IsNone())
+        _other = val;
+}
+
+// ---------------------
+// Context
+// ---------------------
+Context& Context::operator=(const Context& other) {
+    if (this != &other)
+        Replace(other._slots, other._size);
+    return *this;
+}
+
+Context& Context::operator=(Context&& other) noexcept {
+    if (this != &other)
+        Replace(std::move(other._slots), other._size);
+    return *this;
+}
+
+void Context::Replace(std::vector<ContextValue> slots, size_t size) {
+    // Keep at least as many slots as before, so entries that have gone are versioned too.
+    size_t count = std::max(_slots.size(), slots.size());
+    _slots = std::move(slots);
+    _slots.resize(count);
+    _size = size;
+    for (ContextValue& entry : _slots)
+        entry._version = ContextValue::NextVersion();
+    _version = _slots.empty() ? ContextValue::NextVersion() : _slots.back()._version;
+}
+
+ContextValueRef Context::operator[](SymbolId slot) {
+    if (slot >= _slots.size())
+        _slots.resize(slot + 1);
+    ContextValue& entry = _slots[slot];
+    if (!entry.IsSet()) {
+        // As with std::unordered_map, looking up a name creates its entry.
+        entry.Set(Value());
+        _version = entry.GetVersion();
+        _size++;
+    }
+    return ContextValueRef(entry, _version);
+}
+
+void Context::ForEach(const std::function<void(const std::string& name, const ContextValue& entry)>& visit) const {
+    for (SymbolId slot = 0; slot < _slots.size(); slot++) {
+        if (_slots[slot].IsSet())
+            visit(SymbolTable::GetName(slot), _slots[slot]);
+    }
+}
+
+} // namespace ExpressionParser
@@ -1,9 +1,12 @@
 #include "expression_parser/expression.h"
 #include "expression_parser/writer.h"
+#include "expression_parser/program.h"
+#include "expression_parser/call_memo.h"
 #include <sstream>
 #include <cmath>
 #include <stdexcept>
 #include <algorithm>
+#include <cctype>
 
 namespace ExpressionParser {
 
@@ -12,81 +15,122 @@ namespace ExpressionParser {
 // ---------------------
 namespace Utils {
 
-bool MakeBool(const std::any &val) {
-    if (val.type() == typeid(bool))
-        return std::any_cast<bool>(val);
-    if (val.type() == typeid(int))
-        return std::any_cast<int>(val) != 0;
-    if (val.type() == typeid(double))
-        return std::any_cast<double>(val) != 0;
-    if (val.type() == typeid(std::string)) {
-        std::string s = std::any_cast<std::string>(val);
-        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
-        return (s == "true" || s == "1");
+bool MakeBool(const Value &val) {
+    switch (val.GetType()) {
+        case Value::Type::Bool:
+            return val.GetBool();
+        case Value::Type::Int:
+            return val.GetInt() != 0;
+        case Value::Type::Double:
+            return val.GetDouble() != 0;
+        case Value::Type::String: {
+            const std::string &s = val.GetString();
+            if (s == "1")
+                return true;
+            return s.size() == 4 && std::equal(s.begin(), s.end(), "true",
+                [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; });
+        }
+        default:
+            break;
     }
     throw std::runtime_error("Type mismatch: Expecting bool");
 }
 
-double MakeNumeric(const std::any &val) {
-    if (val.type() == typeid(bool))
-        return std::any_cast<bool>(val) ? 1.0 : 0.0;
-    if (val.type() == typeid(int))
-        return static_cast<double>(std::any_cast<int>(val));
-    if (val.type() == typeid(double))
-        return std::any_cast<double>(val);
-    if (val.type() == typeid(std::string)) {
-        const std::string &s = std::any_cast<std::string>(val);
-        size_t pos = 0;
-        double result = 0.0;
-        try {
-            result = std::stod(s, &pos);
-        } catch (...) {
-            throw std::runtime_error("Type mismatch: Expecting number but got '" + s + "'");
+double MakeNumeric(const Value &val) {
+    switch (val.GetType()) {
+        case Value::Type::Bool:
+            return val.GetBool() ? 1.0 : 0.0;
+        case Value::Type::Int:
+            return static_cast<double>(val.GetInt());
+        case Value::Type::Double:
+            return val.GetDouble();
+        case Value::Type::String: {
+            const std::string &s = val.GetString();
+            size_t pos = 0;
+            double result = 0.0;
+            try {
+                result = std::stod(s, &pos);
+            } catch (...) {
+                throw std::runtime_error("Type mismatch: Expecting number but got '" + s + "'");
+            }
+            if (pos != s.size())
+                throw std::runtime_error("Type mismatch: Expecting number but got '" + s +"'");
+            return result;
         }
-        if (pos != s.size())
-            throw std::runtime_error("Type mismatch: Expecting number but got '" + s +"'");
-        return result;
+        default:
+            break;
     }
     throw std::runtime_error("Type mismatch: Expecting number");
 }
 
-std::string MakeString(const std::any &val) {
-    if (val.type() == typeid(std::string))
-        return std::any_cast<std::string>(val);
-    if (val.type() == typeid(bool))
-        return std::any_cast<bool>(val) ? "true" : "false";
-    if (val.type() == typeid(int))
-        return std::to_string(std::any_cast<int>(val));
-    if (val.type() == typeid(double))
-        return std::to_string(std::any_cast<double>(val));
+Value MakeString(const Value &val) {
+    switch (val.GetType()) {
+        case Value::Type::String:
+            return val;
+        case Value::Type::Bool:
+            return Value(val.GetBool() ? "true" : "false");
+        case Value::Type::Int:
+            return Value(std::to_string(val.GetInt()));
+        case Value::Type::Double:
+            return Value(std::to_string(val.GetDouble()));
+        default:
+            break;
+    }
     throw std::runtime_error("Type mismatch: Expecting string");
 }
 
-std::any MakeTypeMatch(const std::any &leftVal, const std::any &rightVal) {
-    if (leftVal.type() == typeid(bool))
-        return MakeBool(rightVal);
-    if (leftVal.type() == typeid(int) || leftVal.type() == typeid(double))
-        return MakeNumeric(rightVal);
-    if (leftVal.type() == typeid(std::string))
-        return MakeString(rightVal);
+Value MakeTypeMatch(const Value &leftVal, const Value &rightVal) {
+    switch (leftVal.GetType()) {
+        case Value::Type::Bool:
+            return MakeBool(rightVal);
+        case Value::Type::Int:
+        case Value::Type::Double:
+            return MakeNumeric(rightVal);
+        case Value::Type::String:
+            return MakeString(rightVal);
+        default:
+            break;
+    }
     throw std::runtime_error("Type mismatch: unrecognised type");
 }
 
-bool AnyEquals(const std::any &a, const std::any &b) {
-    // First, if the types don't match, we consider them unequal.
-    if (a.type() != b.type())
+bool ValueEquals(const Value &a, const Value &b) {
+    // Ints and doubles compare by value; otherwise differing types are unequal.
+    if (a.IsNumeric() && b.IsNumeric())
+        return a.GetNumber() == b.GetNumber();
+    if (a.GetType() != b.GetType())
         return false;
 
-    if (a.type() == typeid(int))
-        return std::any_cast<int>(a) == std::any_cast<int>(b);
-    else if (a.type() == typeid(double))
-        return std::any_cast<double>(a) == std::any_cast<double>(b);
-    else if (a.type() == typeid(bool))
-        return std::any_cast<bool>(a) == std::any_cast<bool>(b);
-    else if (a.type() == typeid(std::string))
-        return std::any_cast<std::string>(a) == std::any_cast<std::string>(b);
-    else
-        throw std::runtime_error("Unsupported type for equality comparison");
+    switch (a.GetType()) {
+        case Value::Type::Bool:
+            return a.GetBool() == b.GetBool();
+        case Value::Type::String:
+            // Pooled, so the same text is always the same string.
+            return &a.GetString() == &b.GetString();
+        default:
+            break;
+    }
+    throw std::runtime_error("Unsupported type for equality comparison");
+}
+
+bool MakeBool(const std::any &val) {
+    return MakeBool(Value::FromAny(val));
+}
+
+double MakeNumeric(const std::any &val) {
+    return MakeNumeric(Value::FromAny(val));
+}
+
+std::string MakeString(const std::any &val) {
+    return MakeString(Value::FromAny(val)).GetString();
+}
+
+std::any MakeTypeMatch(const std::any &leftVal, const std::any &rightVal) {
+    return MakeTypeMatch(Value::FromAny(leftVal), Value::FromAny(rightVal)).ToAny();
+}
+
+bool AnyEquals(const std::any &a, const std::any &b) {
+    return ValueEquals(Value::FromAny(a), Value::FromAny(b));
 }
 
 std::string FormatBoolean(bool val) {
@@ -116,20 +160,106 @@ std::string FormatString(const std::string &val) {
     }
 }
 
+std::string FormatValue(const Value &val) {
+    switch (val.GetType()) {
+        case Value::Type::Bool:
+            return FormatBoolean(val.GetBool());
+        case Value::Type::Int:
+            return std::to_string(val.GetInt());
+        case Value::Type::Double:
+            return FormatNumeric(val.GetDouble());
+        case Value::Type::String:
+            return FormatString(val.GetString());
+        default:
+            return "";
+    }
+}
+
 std::string FormatValue(const std::any &val) {
-    if (val.type() == typeid(bool))
-        return FormatBoolean(std::any_cast<bool>(val));
-    if (val.type() == typeid(int))
-        return std::to_string(std::any_cast<int>(val));
-    if (val.type() == typeid(double))
-        return FormatNumeric(std::any_cast<double>(val));
-    if (val.type() == typeid(std::string))
-        return FormatString(std::any_cast<std::string>(val));
-    return "";
+    return FormatValue(Value::FromAny(val));
+}
+
+const Value& FetchVariable(const Context &context, SymbolId slot) {
+    const ContextValue* entry = context.Find(slot);
+    if (!entry)
+        throw std::runtime_error("Variable '" + SymbolTable::GetName(slot) + "' not found in context.");
+    if (entry->GetValue().IsNone())
+        throw std::runtime_error("Variable '" + SymbolTable::GetName(slot) + "' must return bool, string, or numeric.");
+    return entry->GetValue();
+}
+
+Value CallFunction(const Context &context, SymbolId slot, std::span<const Value> args) {
+    const ContextValue* entry = context.Find(slot);
+    if (!entry)
+        throw std::runtime_error("Function '" + SymbolTable::GetName(slot) + "' not found in context.");
+    const FunctionWrapper* wrapper = entry->GetFunction();
+    if (!wrapper)
+        throw std::runtime_error("Context entry for '" + SymbolTable::GetName(slot) + "' is not a function.");
+
+    if (args.size() != static_cast<size_t>(wrapper->arity)) {
+        std::string formattedArgs;
+        for (const auto &val : args)
+            formattedArgs += FormatValue(val) + ", ";
+        if (!formattedArgs.empty())
+            formattedArgs = formattedArgs.substr(0, formattedArgs.size() - 2);
+        throw std::runtime_error("Function '" + SymbolTable::GetName(slot) + "' does not support the provided arguments (" + formattedArgs + ").");
+    }
+
+    CallMemo* memo = (wrapper->purity != Purity::Volatile) ? context.GetCallMemo() : nullptr;
+    if (memo) {
+        if (const Value* remembered = memo->Find(slot, args))
+            return *remembered;
+    }
+
+    Value result = wrapper->func(args);
+    if (result.IsNone())
+        throw std::runtime_error("Function '" + SymbolTable::GetName(slot) + "' must return bool, string, or numeric.");
+    if (memo)
+        memo->Store(slot, args, result);
+    return result;
 }
 
 } // namespace Utils
 
+// ---------------------
+// ExpressionNode optimization
+// ---------------------
+std::shared_ptr<ExpressionNode> ExpressionNode::Optimize(std::shared_ptr<ExpressionNode> node) {
+    std::shared_ptr<ExpressionNode> replacement = node->Simplify();
+    if (!replacement)
+        return node;
+    replacement->_specificity = node->_specificity;
+    return replacement;
+}
+
+std::shared_ptr<ExpressionNode> ExpressionNode::MakeLiteral(const Value &value) {
+    switch (value.GetType()) {
+        case Value::Type::Bool:
+            return std::make_shared<LiteralBoolean>(value.GetBool());
+        case Value::Type::Int:
+        case Value::Type::Double:
+            return std::make_shared<LiteralNumber>(value.GetNumber());
+        case Value::Type::String:
+            return std::make_shared<LiteralString>(value.GetString());
+        default:
+            return nullptr;
+    }
+}
+
+bool ExpressionNode::IsLiteral(const ExpressionNode &node, const Value &value) {
+    if (!node.IsConstant() || node.GetResultType() != value.GetType())
+        return false;
+    return Utils::ValueEquals(node.Evaluate(Context()), value);
+}
+
+void ExpressionNode::RecordLiteral(TraceSink &trace, const Value &value) const {
+    TraceEvent event;
+    event.kind = TraceEvent::Kind::Literal;
+    event.node = this;
+    event.result = value;
+    trace.Record(event);
+}
+
 // ---------------------
 // BinaryOp implementations
 // ---------------------
@@ -139,30 +269,79 @@ BinaryOp::BinaryOp(const std::string &name, std::shared_ptr<ExpressionNode> left
         this->_specificity = left->GetSpecificity() + right->GetSpecificity();
     }
 
-std::any BinaryOp::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    std::any leftVal = Left->Evaluate(context, dumpEval);
+bool BinaryOp::CollectPredicates(std::vector<Predicate>& predicates) const {
+    OpCode op = GetOpCode();
+    auto variable = std::dynamic_pointer_cast<const Variable>(Left);
+    const ExpressionNode* literal = Right.get();
+    if (!variable) {
+        // Numeric comparisons can be turned round. Equality can't, as the
+        // right-hand side is converted to the type of the left.
+        variable = std::dynamic_pointer_cast<const Variable>(Right);
+        literal = Left.get();
+        switch (op) {
+            case OpCode::GreaterThan: op = OpCode::LessThan; break;
+            case OpCode::LessThan: op = OpCode::GreaterThan; break;
+            case OpCode::GreaterThanEquals: op = OpCode::LessThanEquals; break;
+            case OpCode::LessThanEquals: op = OpCode::GreaterThanEquals; break;
+            default: return false;
+        }
+    }
+
+    switch (op) {
+        case OpCode::Equals:
+        case OpCode::GreaterThan:
+        case OpCode::LessThan:
+        case OpCode::GreaterThanEquals:
+        case OpCode::LessThanEquals:
+            break;
+        default:
+            return false;
+    }
+    if (!variable || !literal->IsConstant())
+        return false;
+
+    predicates.push_back({ variable->GetSlot(), op, literal->Evaluate(Context()) });
+    return true;
+}
+
+Value BinaryOp::Evaluate(const Context &context, TraceSink* trace) const {
+    Value leftVal = Left->Evaluate(context, trace);
 
     auto [shortCircuit, shortCircuitResult] = ShortCircuit(leftVal);
     if (shortCircuit)
     {
-        if (dumpEval != nullptr)
+        if (TracingEnabled && trace)
         {
-            dumpEval->push_back("Evaluated: " + Utils::FormatValue(leftVal) + " " + Op + " (ignore) = " + Utils::FormatValue(shortCircuitResult));
+            TraceEvent event;
+            event.kind = TraceEvent::Kind::ShortCircuit;
+            event.op = GetOpCode();
+            event.count = 1;
+            event.node = this;
+            event.operands[0] = leftVal;
+            event.result = shortCircuitResult;
+            trace->Record(event);
         }
         return shortCircuitResult;
     }
 
-    std::any rightVal = Right->Evaluate(context, dumpEval);
-    std::any result = DoEval(leftVal, rightVal);
-    if (dumpEval) {
-        dumpEval->push_back("Evaluated: " + Utils::FormatValue(leftVal) + " " + Op + " " +
-                              Utils::FormatValue(rightVal) + " = " + Utils::FormatValue(result));
+    Value rightVal = Right->Evaluate(context, trace);
+    Value result = DoEval(leftVal, rightVal);
+    if (TracingEnabled && trace) {
+        TraceEvent event;
+        event.kind = TraceEvent::Kind::Binary;
+        event.op = GetOpCode();
+        event.count = 2;
+        event.node = this;
+        event.operands[0] = leftVal;
+        event.operands[1] = rightVal;
+        event.result = result;
+        trace->Record(event);
     }
     return result;
 }
 
-std::pair<bool, std::any> BinaryOp::ShortCircuit(const std::any& leftVal) const {
-    return { false, std::any() };
+std::pair<bool, Value> BinaryOp::ShortCircuit(const Value &/*leftVal*/) const {
+    return { false, Value() };
 }
 
 std::string BinaryOp::DumpStructure(int indent) const {
@@ -182,124 +361,260 @@ std::string BinaryOp::Write() const {
     return leftStr + " " + Op + " " + rightStr;
 }
 
+void BinaryOp::Compile(Compiler &compiler) const {
+    Left->Compile(compiler);
+    size_t jump = compiler.BeginShortCircuit(GetOpCode());
+    Right->Compile(compiler);
+    compiler.Emit(GetOpCode());
+    compiler.EndShortCircuit(jump);
+}
+
+Value::Type BinaryOp::GetResultType() const {
+    switch (GetOpCode()) {
+        case OpCode::Plus:
+        case OpCode::Minus:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+            return Value::Type::Double;
+        default:
+            return Value::Type::Bool;
+    }
+}
+
+size_t BinaryOp::GetMemoryUsage() const {
+    return sizeof(BinaryOp) + Left->GetMemoryUsage() + Right->GetMemoryUsage();
+}
+
+std::shared_ptr<ExpressionNode> BinaryOp::Simplify() {
+    Left = Optimize(Left);
+    Right = Optimize(Right);
+
+    if (Left->IsConstant()) {
+        // Anything that throws, such as a division by zero, is left for evaluation to report.
+        try {
+            Context empty;
+            if (Right->IsConstant() || ShortCircuit(Left->Evaluate(empty)).first)
+                return MakeLiteral(Evaluate(empty));
+        } catch (const std::exception &) {
+        }
+    }
+    return SimplifyIdentity();
+}
+
 // Concrete BinaryOp classes
 OpOr::OpOr(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("Or", left, "or", right, 40) {
         this->_specificity+=1;
     }
 
-std::pair<bool, std::any> OpOr::ShortCircuit(const std::any& leftVal) const {
+std::pair<bool, Value> OpOr::ShortCircuit(const Value &leftVal) const {
 
     bool result = Utils::MakeBool(leftVal);
     if (result)
         return {true, true};
-    return { false, std::any() };
+    return { false, Value() };
 }
 
-std::any OpOr::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpOr::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeBool(leftVal) || Utils::MakeBool(rightVal);
 }
 
+OpCode OpOr::GetOpCode() const {
+    return OpCode::Or;
+}
+
+std::shared_ptr<ExpressionNode> OpOr::SimplifyIdentity() const {
+    if (IsLiteral(*Left, false) && Right->GetResultType() == Value::Type::Bool)
+        return Right;
+    if (IsLiteral(*Right, false) && Left->GetResultType() == Value::Type::Bool)
+        return Left;
+    return nullptr;
+}
+
 OpAnd::OpAnd(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("And", left, "and", right, 50) {
         this->_specificity+=1;
     }
 
-std::pair<bool, std::any> OpAnd::ShortCircuit(const std::any& leftVal) const {
+std::pair<bool, Value> OpAnd::ShortCircuit(const Value &leftVal) const {
 
     bool result = Utils::MakeBool(leftVal);
     if (!result)
         return {true, false};
-    return { false, std::any() };
+    return { false, Value() };
 }
 
-std::any OpAnd::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpAnd::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeBool(leftVal) && Utils::MakeBool(rightVal);
 }
 
+OpCode OpAnd::GetOpCode() const {
+    return OpCode::And;
+}
+
+bool OpAnd::CollectPredicates(std::vector<Predicate>& predicates) const {
+    return Left->CollectPredicates(predicates) && Right->CollectPredicates(predicates);
+}
+
+std::shared_ptr<ExpressionNode> OpAnd::SimplifyIdentity() const {
+    if (IsLiteral(*Left, true) && Right->GetResultType() == Value::Type::Bool)
+        return Right;
+    if (IsLiteral(*Right, true) && Left->GetResultType() == Value::Type::Bool)
+        return Left;
+    return nullptr;
+}
+
 OpEquals::OpEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("Equals", left, "==", right, 60) {}
 
-std::any OpEquals::DoEval(const std::any &leftVal, const std::any &rightVal) const {
-    std::any rVal = Utils::MakeTypeMatch(leftVal, rightVal);
-    return Utils::AnyEquals(leftVal, rVal);
+Value OpEquals::DoEval(const Value &leftVal, const Value &rightVal) const {
+    Value rVal = Utils::MakeTypeMatch(leftVal, rightVal);
+    return Utils::ValueEquals(leftVal, rVal);
+}
+
+OpCode OpEquals::GetOpCode() const {
+    return OpCode::Equals;
 }
 
 OpNotEquals::OpNotEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("NotEquals", left, "!=", right, 60) {}
 
-std::any OpNotEquals::DoEval(const std::any &leftVal, const std::any &rightVal) const {
-    std::any rVal = Utils::MakeTypeMatch(leftVal, rightVal);
-    return !Utils::AnyEquals(leftVal, rVal);
+Value OpNotEquals::DoEval(const Value &leftVal, const Value &rightVal) const {
+    Value rVal = Utils::MakeTypeMatch(leftVal, rightVal);
+    return !Utils::ValueEquals(leftVal, rVal);
+}
+
+OpCode OpNotEquals::GetOpCode() const {
+    return OpCode::NotEquals;
 }
 
 OpPlus::OpPlus(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("Plus", left, "+", right, 70) {}
 
-std::any OpPlus::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpPlus::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) + Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpPlus::GetOpCode() const {
+    return OpCode::Plus;
+}
+
+std::shared_ptr<ExpressionNode> OpPlus::SimplifyIdentity() const {
+    if (IsLiteral(*Left, 0.0) && Right->GetResultType() == Value::Type::Double)
+        return Right;
+    if (IsLiteral(*Right, 0.0) && Left->GetResultType() == Value::Type::Double)
+        return Left;
+    return nullptr;
+}
+
 OpMinus::OpMinus(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("Minus", left, "-", right, 70) {}
 
-std::any OpMinus::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpMinus::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) - Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpMinus::GetOpCode() const {
+    return OpCode::Minus;
+}
+
+std::shared_ptr<ExpressionNode> OpMinus::SimplifyIdentity() const {
+    if (IsLiteral(*Right, 0.0) && Left->GetResultType() == Value::Type::Double)
+        return Left;
+    return nullptr;
+}
+
 OpDivide::OpDivide(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("Divide", left, "/", right, 85) {}
 
-std::any OpDivide::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpDivide::DoEval(const Value &leftVal, const Value &rightVal) const {
     double numRight = Utils::MakeNumeric(rightVal);
     if (numRight == 0)
         throw std::runtime_error("Division by zero.");
     return Utils::MakeNumeric(leftVal) / numRight;
 }
 
+OpCode OpDivide::GetOpCode() const {
+    return OpCode::Divide;
+}
+
+std::shared_ptr<ExpressionNode> OpDivide::SimplifyIdentity() const {
+    if (IsLiteral(*Right, 1.0) && Left->GetResultType() == Value::Type::Double)
+        return Left;
+    return nullptr;
+}
+
 OpMultiply::OpMultiply(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("Multiply", left, "*", right, 80) {}
 
-std::pair<bool, std::any> OpMultiply::ShortCircuit(const std::any& leftVal) const {
+std::pair<bool, Value> OpMultiply::ShortCircuit(const Value &leftVal) const {
 
     double result = Utils::MakeNumeric(leftVal);
     if (result==0.0)
         return {true, 0.0};
-    return { false, std::any() };
+    return { false, Value() };
 }
 
-std::any OpMultiply::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpMultiply::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) * Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpMultiply::GetOpCode() const {
+    return OpCode::Multiply;
+}
+
+std::shared_ptr<ExpressionNode> OpMultiply::SimplifyIdentity() const {
+    if (IsLiteral(*Left, 1.0) && Right->GetResultType() == Value::Type::Double)
+        return Right;
+    if (IsLiteral(*Right, 1.0) && Left->GetResultType() == Value::Type::Double)
+        return Left;
+    return nullptr;
+}
+
 OpGreaterThan::OpGreaterThan(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("GreaterThan", left, ">", right, 60) {}
 
-std::any OpGreaterThan::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpGreaterThan::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) > Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpGreaterThan::GetOpCode() const {
+    return OpCode::GreaterThan;
+}
+
 OpLessThan::OpLessThan(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("LessThan", left, "<", right, 60) {}
 
-std::any OpLessThan::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpLessThan::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) < Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpLessThan::GetOpCode() const {
+    return OpCode::LessThan;
+}
+
 OpGreaterThanEquals::OpGreaterThanEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("GreaterThanEquals", left, ">=", right, 60) {}
 
-std::any OpGreaterThanEquals::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpGreaterThanEquals::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) >= Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpGreaterThanEquals::GetOpCode() const {
+    return OpCode::GreaterThanEquals;
+}
+
 OpLessThanEquals::OpLessThanEquals(std::shared_ptr<ExpressionNode> left, std::shared_ptr<ExpressionNode> right)
     : BinaryOp("LessThanEquals", left, "<=", right, 60) {}
 
-std::any OpLessThanEquals::DoEval(const std::any &leftVal, const std::any &rightVal) const {
+Value OpLessThanEquals::DoEval(const Value &leftVal, const Value &rightVal) const {
     return Utils::MakeNumeric(leftVal) <= Utils::MakeNumeric(rightVal);
 }
 
+OpCode OpLessThanEquals::GetOpCode() const {
+    return OpCode::LessThanEquals;
+}
+
 // ---------------------
 // UnaryOp implementations
 // ---------------------
@@ -308,12 +623,18 @@ UnaryOp::UnaryOp(const std::string &name, const std::string &op, std::shared_ptr
         this->_specificity = operand->GetSpecificity();
     }
 
-std::any UnaryOp::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    std::any val = Operand->Evaluate(context, dumpEval);
-    std::any result = DoEval(val);
-    if (dumpEval) {
-        dumpEval->push_back("Evaluated: " + Op + " " + Utils::FormatValue(val) +
-                              " = " + Utils::FormatValue(result));
+Value UnaryOp::Evaluate(const Context &context, TraceSink* trace) const {
+    Value val = Operand->Evaluate(context, trace);
+    Value result = DoEval(val);
+    if (TracingEnabled && trace) {
+        TraceEvent event;
+        event.kind = TraceEvent::Kind::Unary;
+        event.op = GetOpCode();
+        event.count = 1;
+        event.node = this;
+        event.operands[0] = val;
+        event.result = result;
+        trace->Record(event);
     }
     return result;
 }
@@ -330,29 +651,72 @@ std::string UnaryOp::Write() const {
     return Op + " " + operandStr;
 }
 
+void UnaryOp::Compile(Compiler &compiler) const {
+    Operand->Compile(compiler);
+    compiler.Emit(GetOpCode());
+}
+
+Value::Type UnaryOp::GetResultType() const {
+    return GetOpCode() == OpCode::Not ? Value::Type::Bool : Value::Type::Double;
+}
+
+size_t UnaryOp::GetMemoryUsage() const {
+    return sizeof(UnaryOp) + Operand->GetMemoryUsage();
+}
+
+std::shared_ptr<ExpressionNode> UnaryOp::Simplify() {
+    Operand = Optimize(Operand);
+    if (Operand->IsConstant()) {
+        try {
+            return MakeLiteral(Evaluate(Context()));
+        } catch (const std::exception &) {
+        }
+    }
+    return nullptr;
+}
+
 OpNegative::OpNegative(std::shared_ptr<ExpressionNode> operand)
     : UnaryOp("Negative", "-", operand, 90) {}
 
-std::any OpNegative::DoEval(const std::any &val) const {
+Value OpNegative::DoEval(const Value &val) const {
     return -Utils::MakeNumeric(val);
 }
 
+OpCode OpNegative::GetOpCode() const {
+    return OpCode::Negative;
+}
+
 OpNot::OpNot(std::shared_ptr<ExpressionNode> operand)
     : UnaryOp("Not", "not", operand, 90) {}
 
-std::any OpNot::DoEval(const std::any &val) const {
+Value OpNot::DoEval(const Value &val) const {
     return !Utils::MakeBool(val);
 }
 
+OpCode OpNot::GetOpCode() const {
+    return OpCode::Not;
+}
+
+std::shared_ptr<ExpressionNode> OpNot::Simplify() {
+    std::shared_ptr<ExpressionNode> folded = UnaryOp::Simplify();
+    if (folded)
+        return folded;
+    // "not not x" is just x, if x is already a bool.
+    auto inner = std::dynamic_pointer_cast<OpNot>(Operand);
+    if (inner && inner->Operand->GetResultType() == Value::Type::Bool)
+        return inner->Operand;
+    return nullptr;
+}
+
 // ---------------------
 // Literal node implementations
 // ---------------------
 LiteralBoolean::LiteralBoolean(bool val)
     : ExpressionNode("Boolean", 100), value(val) {}
 
-std::any LiteralBoolean::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    if (dumpEval)
-        dumpEval->push_back("Boolean: " + Utils::FormatBoolean(value));
+Value LiteralBoolean::Evaluate(const Context &/*context*/, TraceSink* trace) const {
+    if (TracingEnabled && trace)
+        RecordLiteral(*trace, value);
     return value;
 }
 
@@ -365,14 +729,21 @@ std::string LiteralBoolean::Write() const {
     return Utils::FormatBoolean(value);
 }
 
+void LiteralBoolean::Compile(Compiler &compiler) const {
+    compiler.EmitConstant(value);
+}
+
 LiteralNumber::LiteralNumber(const std::string &val)
     : ExpressionNode("Number", 100) {
     value = std::stod(val);
 }
 
-std::any LiteralNumber::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    if (dumpEval)
-        dumpEval->push_back("Number: " + Utils::FormatNumeric(value));
+LiteralNumber::LiteralNumber(double val)
+    : ExpressionNode("Number", 100), value(val) {}
+
+Value LiteralNumber::Evaluate(const Context &/*context*/, TraceSink* trace) const {
+    if (TracingEnabled && trace)
+        RecordLiteral(*trace, value);
     return value;
 }
 
@@ -385,42 +756,45 @@ std::string LiteralNumber::Write() const {
     return Utils::FormatNumeric(value);
 }
 
+void LiteralNumber::Compile(Compiler &compiler) const {
+    compiler.EmitConstant(value);
+}
+
 LiteralString::LiteralString(const std::string &val)
     : ExpressionNode("String", 100), value(val) {}
 
-std::any LiteralString::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    if (dumpEval)
-        dumpEval->push_back("String: " + Utils::FormatString(value));
+Value LiteralString::Evaluate(const Context &/*context*/, TraceSink* trace) const {
+    if (TracingEnabled && trace)
+        RecordLiteral(*trace, value);
     return value;
 }
 
 std::string LiteralString::DumpStructure(int indent) const {
     std::string indentStr(indent * 2, ' ');
-    return indentStr + "String(" + Utils::FormatString(value) + ")\n";
+    return indentStr + "String(" + Utils::FormatString(value.GetString()) + ")\n";
 }
 
 std::string LiteralString::Write() const {
-    return Utils::FormatString(value);
+    return Utils::FormatString(value.GetString());
 }
 
-Variable::Variable(const std::string &name)
-    : ExpressionNode("Variable", 100), name(name) {}
-
-std::any Variable::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    auto it = context.find(name);
-    if (it == context.end())
-        throw std::runtime_error("Variable '" + name + "' not found in context.");
-    std::any value = it->second;
+void LiteralString::Compile(Compiler &compiler) const {
+    compiler.EmitConstant(value);
+}
 
-    if (value.type() == typeid(const char*)) {
-        value = std::string(std::any_cast<const char*>(value));
+Variable::Variable(const std::string &name)
+    : ExpressionNode("Variable", 100), name(name), slot(SymbolTable::Intern(name)) {}
+
+Value Variable::Evaluate(const Context &context, TraceSink* trace) const {
+    const Value &value = Utils::FetchVariable(context, slot);
+    if (TracingEnabled && trace) {
+        TraceEvent event;
+        event.kind = TraceEvent::Kind::Variable;
+        event.slot = slot;
+        event.node = this;
+        event.result = value;
+        trace->Record(event);
     }
-
-    if (!(value.type() == typeid(int) || value.type() == typeid(double) ||
-          value.type() == typeid(bool) || value.type() == typeid(std::string)))
-        throw std::runtime_error("Variable '" + name + "' must return bool, string, or numeric.");
-    if (dumpEval)
-        dumpEval->push_back("Fetching variable: " + name + " -> " + Utils::FormatValue(value));
     return value;
 }
 
@@ -433,50 +807,40 @@ std::string Variable::Write() const {
     return name;
 }
 
+void Variable::Compile(Compiler &compiler) const {
+    compiler.Emit(OpCode::LoadVar, slot);
+}
+
+size_t Variable::GetMemoryUsage() const {
+    return sizeof(Variable) + name.capacity();
+}
+
 // ---------------------
 // FunctionCall implementation
 // ---------------------
 FunctionCall::FunctionCall(const std::string &funcName, const std::vector<std::shared_ptr<ExpressionNode>> &args)
-    : ExpressionNode("FunctionCall", 100), funcName(funcName), args(args) {}
-
-std::any FunctionCall::Evaluate(const Context &context, std::vector<std::string>* dumpEval) const {
-    auto it = context.find(funcName);
-    if (it == context.end())
-        throw std::runtime_error("Function '" + funcName + "' not found in context.");
-    std::any funcObj = it->second;
-    if (funcObj.type() != typeid(FunctionWrapper))
-        throw std::runtime_error("Context entry for '" + funcName + "' is not a function.");
-    FunctionWrapper wrapper = std::any_cast<FunctionWrapper>(funcObj);
-    
-    std::vector<std::any> argValues;
+    : ExpressionNode("FunctionCall", 100), funcName(funcName), slot(SymbolTable::Intern(funcName)), args(args) {}
+
+Value FunctionCall::Evaluate(const Context &context, TraceSink* trace) const {
+    std::vector<Value> argValues;
+    argValues.reserve(args.size());
     for (const auto &arg : args) {
-        argValues.push_back(arg->Evaluate(context, dumpEval));
+        argValues.push_back(arg->Evaluate(context, trace));
     }
-    
-    if (argValues.size() != static_cast<size_t>(wrapper.arity)) {
-        std::string formattedArgs;
-        for (const auto &val : argValues)
-            formattedArgs += Utils::FormatValue(val) + ", ";
-        if (!formattedArgs.empty())
-            formattedArgs = formattedArgs.substr(0, formattedArgs.size() - 2);
-        throw std::runtime_error("Function '" + funcName + "' does not support the provided arguments (" + formattedArgs + ").");
-    }
-    
-    std::any result = wrapper.func(argValues);
-    if (!(result.type() == typeid(int) || result.type() == typeid(double) ||
-          result.type() == typeid(bool) || result.type() == typeid(std::string)))
-        throw std::runtime_error("Function '" + funcName + "' must return bool, string, or numeric.");
-    
-    if (dumpEval) {
-        std::string formattedArgs;
-        for (const auto &val : argValues)
-            formattedArgs += Utils::FormatValue(val) + ", ";
-        if (!formattedArgs.empty())
-            formattedArgs = formattedArgs.substr(0, formattedArgs.size() - 2);
-        dumpEval->push_back("Called function: " + funcName + "(" + formattedArgs +
-                              ") = " + Utils::FormatValue(result));
+
+    Value result = Utils::CallFunction(context, slot, argValues);
+
+    if (TracingEnabled && trace) {
+        TraceEvent event;
+        event.kind = TraceEvent::Kind::Call;
+        event.slot = slot;
+        event.count = static_cast<uint16_t>(argValues.size());
+        event.node = this;
+        std::copy_n(argValues.begin(), std::min<size_t>(argValues.size(), TraceEvent::MAX_OPERANDS), event.operands);
+        event.result = result;
+        trace->Record(event);
     }
-    
+
     return result;
 }
 
@@ -498,4 +862,17 @@ std::string FunctionCall::Write() const {
     return funcName + "(" + argsStr + ")";
 }
 
+void FunctionCall::Compile(Compiler &compiler) const {
+    for (const auto &arg : args)
+        arg->Compile(compiler);
+    compiler.Emit(OpCode::Call, slot, static_cast<uint16_t>(args.size()));
+}
+
+size_t FunctionCall::GetMemoryUsage() const {
+    size_t total = sizeof(FunctionCall) + funcName.capacity() + args.capacity() * sizeof(args[0]);
+    for (const auto &arg : args)
+        total += arg->GetMemoryUsage();
+    return total;
+}
+
 } // namespace ExpressionParser
\ No newline at end of file
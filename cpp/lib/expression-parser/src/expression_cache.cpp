@@ -0,0 +1,99 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/expression_cache.h"
+#include "expression_parser/parser.h"
+
+namespace ExpressionParser {
+
+ExpressionCache::ExpressionCache(size_t capacity)
+    : _capacity(capacity) {}
+
+ExpressionCache& ExpressionCache::Global() {
+    static ExpressionCache cache;
+    return cache;
+}
+
+std::string ExpressionCache::Normalize(std::string_view text) {
+    std::string normalized;
+    normalized.reserve(text.size());
+    for (const Token &token : Parser::Tokenize(text)) {
+        if (!normalized.empty())
+            normalized += ' ';
+        normalized += token.Text;
+    }
+    return normalized;
+}
+
+std::shared_ptr<const CompiledExpression> ExpressionCache::Get(const std::string &text) {
+    std::string key = Normalize(text);
+    {
+        std::lock_guard lock(_mutex);
+        auto it = _index.find(key);
+        if (it != _index.end()) {
+            _stats.Hits++;
+            _entries.splice(_entries.begin(), _entries, it->second);
+            return it->second->expression;
+        }
+    }
+
+    // Compile outside the lock, so other threads aren't held up by a miss.
+    Parser parser;
+    auto expression = std::make_shared<const CompiledExpression>(parser.Parse(text));
+    size_t memoryUsage = key.capacity() + expression->GetMemoryUsage();
+
+    std::lock_guard lock(_mutex);
+    _stats.Misses++;
+    auto it = _index.find(key);
+    if (it != _index.end()) {
+        // Another thread got there first; share its copy.
+        _entries.splice(_entries.begin(), _entries, it->second);
+        return it->second->expression;
+    }
+    _entries.push_front(Entry{std::move(key), expression, memoryUsage});
+    _index.emplace(_entries.front().key, _entries.begin());
+    _stats.Entries++;
+    _stats.MemoryUsage += memoryUsage;
+    EvictLocked();
+    return expression;
+}
+
+ExpressionCache::Stats ExpressionCache::GetStats() const {
+    std::lock_guard lock(_mutex);
+    return _stats;
+}
+
+void ExpressionCache::SetCapacity(size_t capacity) {
+    std::lock_guard lock(_mutex);
+    _capacity = capacity;
+    EvictLocked();
+}
+
+size_t ExpressionCache::GetCapacity() const {
+    std::lock_guard lock(_mutex);
+    return _capacity;
+}
+
+void ExpressionCache::Clear() {
+    std::lock_guard lock(_mutex);
+    _index.clear();
+    _entries.clear();
+    _stats = Stats();
+}
+
+void ExpressionCache::EvictLocked() {
+    if (_capacity == 0)
+        return;
+    while (_entries.size() > _capacity) {
+        Entry &oldest = _entries.back();
+        _stats.Evictions++;
+        _stats.Entries--;
+        _stats.MemoryUsage -= oldest.memoryUsage;
+        _index.erase(oldest.key);
+        _entries.pop_back();
+    }
+}
+
+} // namespace ExpressionParser
@@ -0,0 +1,192 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/expression_graph.h"
+#include <cstring>
+#include <span>
+#include <stdexcept>
+
+namespace ExpressionParser {
+
+namespace {
+
+    // Calls rarely have many arguments, so avoid the heap for those.
+    constexpr uint16_t INLINE_ARGS = 8;
+
+    template<typename T>
+    void AppendBytes(std::string &key, const T &value) {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+}
+
+// The bytecode is walked with a stack of nodes instead of values. Each short-circuit jump
+// lands just past the operator it belongs to, so the operator's node is all it needs.
+ExpressionGraph::NodeId ExpressionGraph::Add(const CompiledExpression &expression) {
+    const Program &program = expression.GetProgram();
+    std::vector<NodeId> stack;
+    for (const Instruction &ins : program.GetCode()) {
+        switch (ins.Op) {
+            case OpCode::PushConst:
+                stack.push_back(AddNode(ins.Op, 0, &program.GetConstants()[ins.Operand], nullptr, 0));
+                break;
+            case OpCode::LoadVar:
+                stack.push_back(AddNode(ins.Op, ins.Operand, nullptr, nullptr, 0));
+                break;
+            case OpCode::Call: {
+                NodeId node = AddNode(ins.Op, ins.Operand, nullptr, stack.data() + stack.size() - ins.Count, ins.Count);
+                stack.resize(stack.size() - ins.Count);
+                stack.push_back(node);
+                break;
+            }
+            case OpCode::JumpIfTrue:
+            case OpCode::JumpIfFalse:
+            case OpCode::JumpIfZero:
+                break;
+            case OpCode::Negative:
+            case OpCode::Not:
+                stack.back() = AddNode(ins.Op, 0, nullptr, &stack.back(), 1);
+                break;
+            default: {
+                NodeId node = AddNode(ins.Op, 0, nullptr, stack.data() + stack.size() - 2, 2);
+                stack.resize(stack.size() - 2);
+                stack.push_back(node);
+                break;
+            }
+        }
+    }
+    if (stack.size() != 1)
+        throw std::runtime_error("Expression compiled to an unbalanced program.");
+    return stack[0];
+}
+
+ExpressionGraph::NodeId ExpressionGraph::AddNode(OpCode op, uint32_t operand, const Value* constant, const NodeId* children, uint16_t count) {
+    std::string key;
+    AppendBytes(key, op);
+    AppendBytes(key, operand);
+    if (constant) {
+        // Constants of different types convert differently, so 1 and 1.0 aren't merged
+        AppendBytes(key, constant->GetType());
+        switch (constant->GetType()) {
+            case Value::Type::Bool: AppendBytes(key, constant->GetBool()); break;
+            case Value::Type::Int: AppendBytes(key, constant->GetInt()); break;
+            case Value::Type::Double: AppendBytes(key, constant->GetDouble()); break;
+            case Value::Type::String: AppendBytes(key, &constant->GetString()); break;
+            default: break;
+        }
+    }
+    for (uint16_t i = 0; i < count; i++)
+        AppendBytes(key, children[i]);
+
+    auto [it, inserted] = _lookup.emplace(std::move(key), static_cast<NodeId>(_nodes.size()));
+    if (!inserted)
+        return it->second;
+
+    if (constant) {
+        operand = static_cast<uint32_t>(_constants.size());
+        _constants.push_back(*constant);
+    }
+    _nodes.push_back({ op, count, operand, static_cast<uint32_t>(_children.size()) });
+    _children.insert(_children.end(), children, children + count);
+    _passes.push_back(0);
+    _results.emplace_back();
+    _costs.push_back(0);
+    return it->second;
+}
+
+void ExpressionGraph::Clear() {
+    _nodes.clear();
+    _children.clear();
+    _constants.clear();
+    _lookup.clear();
+    _passes.clear();
+    _results.clear();
+    _costs.clear();
+}
+
+void ExpressionGraph::BeginPass() {
+    _pass++;
+}
+
+Value ExpressionGraph::Evaluate(NodeId root, const Context &context) {
+    uint64_t cost = 0;
+    bool keep = true;
+    return EvaluateNode(root, context, cost, keep);
+}
+
+// Cost is the number of nodes the expression on its own would have evaluated to get this
+// result, so a reused result adds that many to the evaluations saved. Keep is cleared if
+// the result depends on a volatile function.
+Value ExpressionGraph::EvaluateNode(NodeId id, const Context &context, uint64_t &cost, bool &keep) {
+    if (_passes[id] == _pass) {
+        _saved += _costs[id];
+        cost += _costs[id];
+        return _results[id];
+    }
+
+    const Node node = _nodes[id];
+    const NodeId* children = _children.data() + node.firstChild;
+    uint64_t nodeCost = 1;
+    bool nodeKeep = true;
+    Value result;
+
+    switch (node.op) {
+        case OpCode::PushConst:
+            result = _constants[node.operand];
+            break;
+
+        case OpCode::LoadVar:
+            result = Utils::FetchVariable(context, node.operand);
+            break;
+
+        case OpCode::Call: {
+            Value inlineArgs[INLINE_ARGS];
+            std::vector<Value> heapArgs;
+            Value* args = inlineArgs;
+            if (node.count > INLINE_ARGS) {
+                heapArgs.resize(node.count);
+                args = heapArgs.data();
+            }
+            for (uint16_t i = 0; i < node.count; i++)
+                args[i] = EvaluateNode(children[i], context, nodeCost, nodeKeep);
+            result = Utils::CallFunction(context, node.operand, std::span<const Value>(args, node.count));
+            if (context.Find(node.operand)->GetFunction()->purity == Purity::Volatile)
+                nodeKeep = false;
+            break;
+        }
+
+        case OpCode::Negative:
+            result = -Utils::MakeNumeric(EvaluateNode(children[0], context, nodeCost, nodeKeep));
+            break;
+
+        case OpCode::Not:
+            result = !Utils::MakeBool(EvaluateNode(children[0], context, nodeCost, nodeKeep));
+            break;
+
+        default: {
+            // Short-circuit exactly as the bytecode's jumps do
+            Value left = EvaluateNode(children[0], context, nodeCost, nodeKeep);
+            if (node.op == OpCode::Or && Utils::MakeBool(left))
+                result = true;
+            else if (node.op == OpCode::And && !Utils::MakeBool(left))
+                result = false;
+            else if (node.op == OpCode::Multiply && Utils::MakeNumeric(left) == 0.0)
+                result = 0.0;
+            else
+                result = Program::EvalBinary(node.op, left, EvaluateNode(children[1], context, nodeCost, nodeKeep));
+            break;
+        }
+    }
+
+    if (nodeKeep) {
+        _passes[id] = _pass;
+        _results[id] = result;
+        _costs[id] = nodeCost;
+    }
+    cost += nodeCost;
+    keep = keep && nodeKeep;
+    return result;
+}
+
+} // namespace ExpressionParser
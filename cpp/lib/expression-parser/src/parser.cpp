@@ -11,45 +11,145 @@
 
 namespace ExpressionParser {
 
-    // Define the static TOKEN_REGEX.
-    const std::regex Parser::TOKEN_REGEX = std::regex(R"(\s*(>=|<=|==|=|!=|>|<|\(|\)|,|and|&&|or|\|\||not|!|\+|\-|\/|\*|[A-Za-z_][A-Za-z0-9_]*|-?\d+\.\d+(?![A-Za-z_])|-?\d+(?![A-Za-z_])|"[^"]*"|'[^']*'|true|false|True|False)\s*)", std::regex::ECMAScript);
+    namespace {
 
-    Parser::Parser() : _pos(0) { }
+        bool IsSpace(char c) {
+            return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+        }
 
-    std::shared_ptr<ExpressionNode> Parser::Parse(const std::string &expression) {
-        _tokens = Tokenize(expression);
-        _pos = 0;
-        std::shared_ptr<ExpressionNode> node = ParseOr();
-        if (_pos < static_cast<int>(_tokens.size()))
-            throw std::runtime_error("Unexpected token '" + _tokens[_pos] +
-                                     "' at position " + std::to_string(_pos));
-        return node;
+        bool IsDigit(char c) {
+            return c >= '0' && c <= '9';
+        }
+
+        bool IsIdentifierStart(char c) {
+            return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+        }
+
+        bool IsIdentifierChar(char c) {
+            return IsIdentifierStart(c) || IsDigit(c);
+        }
+
+        TokenKind ClassifyWord(std::string_view word) {
+            if (word == "and" || word == "or" || word == "not")
+                return TokenKind::Keyword;
+            if (word == "true" || word == "false" || word == "True" || word == "False")
+                return TokenKind::Boolean;
+            return TokenKind::Identifier;
+        }
+
+        [[noreturn]] void ThrowUnrecognized(std::string_view expression, size_t pos) {
+            throw std::runtime_error("Unrecognized token at position " + std::to_string(pos) +
+                                     ": '" + std::string(expression.substr(pos)) + "'");
+        }
+
+        // The state of one parse: a recursive descent over the tokens of one expression.
+        // Each call to Parser::Parse has its own, so parsers can be used from any thread.
+        class Descent {
+        public:
+            explicit Descent(std::vector<Token> tokens) : _tokens(std::move(tokens)) {}
+
+            std::shared_ptr<ExpressionNode> ParseAll();
+
+        private:
+            std::vector<Token> _tokens;
+            int _pos = 0;
+
+            std::shared_ptr<ExpressionNode> ParseOr();
+            std::shared_ptr<ExpressionNode> ParseAnd();
+            std::shared_ptr<ExpressionNode> ParseMathAddSub();
+            std::shared_ptr<ExpressionNode> ParseMathMulDiv();
+            std::shared_ptr<ExpressionNode> ParseBinaryOp();
+            std::shared_ptr<ExpressionNode> ParseUnaryOp();
+            std::shared_ptr<ExpressionNode> ParseTerm();
+            std::shared_ptr<LiteralString> ParseStringLiteral();
+
+            bool _Match(std::initializer_list<std::string_view> tokens);
+            bool _Match(std::string_view token);
+            bool _MatchKind(TokenKind kind);
+            void _Consume(std::string_view expectedToken);
+            std::string_view _Peek();
+            std::string_view _Previous();
+        };
     }
 
-    std::vector<std::string> Parser::Tokenize(const std::string &expression) {
-        std::vector<std::string> tokens;
-        int pos = 0;
-        while (pos < static_cast<int>(expression.size())) {
-            std::smatch match;
-            std::string sub = expression.substr(pos);
-            if (!std::regex_search(sub, match, TOKEN_REGEX))
-                throw std::runtime_error("Unrecognized token at position " + std::to_string(pos) +
-                                         ": '" + expression.substr(pos) + "'");
-            std::string token = match[1].str();
+    std::shared_ptr<ExpressionNode> Parser::Parse(const std::string &expression) const {
+        return Descent(Tokenize(expression)).ParseAll();
+    }
+
+    std::vector<Token> Parser::Tokenize(std::string_view expression) {
+        std::vector<Token> tokens;
+        const size_t len = expression.size();
+        size_t pos = 0;
+        while (pos < len) {
+            char c = expression[pos];
+            if (IsSpace(c)) {
+                pos++;
+                continue;
+            }
 
-            token.erase(0, token.find_first_not_of(" \t\r\n"));
-            token.erase(token.find_last_not_of(" \t\r\n") + 1);
+            size_t start = pos;
+            TokenKind kind = TokenKind::Operator;
+            char next = (pos + 1 < len) ? expression[pos + 1] : '\0';
 
-            if (!token.empty()) {
-                tokens.push_back(token);
+            switch (c) {
+                case '>': case '<': case '=': case '!':
+                    pos += (next == '=') ? 2 : 1;
+                    break;
+                case '&': case '|':
+                    if (next != c)
+                        ThrowUnrecognized(expression, pos);
+                    pos += 2;
+                    break;
+                case '(': case ')': case ',': case '+': case '-': case '/': case '*':
+                    pos++;
+                    break;
+                case '"': case '\'': {
+                    size_t close = expression.find(c, pos + 1);
+                    if (close == std::string_view::npos)
+                        ThrowUnrecognized(expression, pos);
+                    kind = TokenKind::String;
+                    pos = close + 1;
+                    break;
+                }
+                default:
+                    if (IsDigit(c)) {
+                        kind = TokenKind::Number;
+                        while (pos < len && IsDigit(expression[pos]))
+                            pos++;
+                        if (pos + 1 < len && expression[pos] == '.' && IsDigit(expression[pos + 1])) {
+                            pos++;
+                            while (pos < len && IsDigit(expression[pos]))
+                                pos++;
+                        }
+                        // Numbers can't run straight into a name, e.g. "12abc".
+                        if (pos < len && IsIdentifierStart(expression[pos]))
+                            ThrowUnrecognized(expression, start);
+                    }
+                    else if (IsIdentifierStart(c)) {
+                        while (pos < len && IsIdentifierChar(expression[pos]))
+                            pos++;
+                        kind = ClassifyWord(expression.substr(start, pos - start));
+                    }
+                    else {
+                        ThrowUnrecognized(expression, pos);
+                    }
+                    break;
             }
 
-            pos += static_cast<int>(match.position() + match.length());
+            tokens.push_back({ kind, expression.substr(start, pos - start), start });
         }
         return tokens;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseOr() {
+    std::shared_ptr<ExpressionNode> Descent::ParseAll() {
+        std::shared_ptr<ExpressionNode> node = ParseOr();
+        if (_pos < static_cast<int>(_tokens.size()))
+            throw std::runtime_error("Unexpected token '" + std::string(_tokens[_pos].Text) +
+                                     "' at position " + std::to_string(_tokens[_pos].Offset));
+        return node;
+    }
+
+    std::shared_ptr<ExpressionNode> Descent::ParseOr() {
         std::shared_ptr<ExpressionNode> node = ParseAnd();
         while (_Match({"or", "||"})) {
             node = std::make_shared<OpOr>(node, ParseAnd());
@@ -57,7 +157,7 @@ namespace ExpressionParser {
         return node;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseAnd() {
+    std::shared_ptr<ExpressionNode> Descent::ParseAnd() {
         std::shared_ptr<ExpressionNode> node = ParseBinaryOp();
         while (_Match({"and", "&&"})) {
             node = std::make_shared<OpAnd>(node, ParseBinaryOp());
@@ -65,10 +165,10 @@ namespace ExpressionParser {
         return node;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseMathAddSub() {
+    std::shared_ptr<ExpressionNode> Descent::ParseMathAddSub() {
         std::shared_ptr<ExpressionNode> node = ParseMathMulDiv();
         while (_Match({"+", "-"})) {
-            std::string op = _Previous();
+            std::string_view op = _Previous();
             if (op == "+")
                 node = std::make_shared<OpPlus>(node, ParseMathMulDiv());
             else
@@ -77,10 +177,10 @@ namespace ExpressionParser {
         return node;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseMathMulDiv() {
+    std::shared_ptr<ExpressionNode> Descent::ParseMathMulDiv() {
         std::shared_ptr<ExpressionNode> node = ParseUnaryOp();
         while (_Match({"*", "/"})) {
-            std::string op = _Previous();
+            std::string_view op = _Previous();
             if (op == "*")
                 node = std::make_shared<OpMultiply>(node, ParseUnaryOp());
             else
@@ -89,10 +189,10 @@ namespace ExpressionParser {
         return node;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseBinaryOp() {
+    std::shared_ptr<ExpressionNode> Descent::ParseBinaryOp() {
         std::shared_ptr<ExpressionNode> node = ParseMathAddSub();
         while (_Match({"==", "!=", ">", "<", ">=", "<=", "="})) {
-            std::string op = _Previous();
+            std::string_view op = _Previous();
             if (op == "=" || op == "==")
                 node = std::make_shared<OpEquals>(node, ParseMathAddSub());
             else if (op == "!=")
@@ -109,7 +209,7 @@ namespace ExpressionParser {
         return node;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseUnaryOp() {
+    std::shared_ptr<ExpressionNode> Descent::ParseUnaryOp() {
         if (_Match("not") || _Match("!"))
             return std::make_shared<OpNot>(ParseUnaryOp());
         else if (_Match("-"))
@@ -117,17 +217,15 @@ namespace ExpressionParser {
         return ParseTerm();
     }
 
-    std::shared_ptr<LiteralString> Parser::ParseStringLiteral() {
-        std::string s = _Peek();
-        if (!s.empty() &&
-            ((s.front() == '"' && s.back() == '"') || (s.front() == '\'' && s.back() == '\''))) {
-            _Advance();
-            return std::make_shared<LiteralString>(s.substr(1, s.size() - 2));
+    std::shared_ptr<LiteralString> Descent::ParseStringLiteral() {
+        if (_MatchKind(TokenKind::String)) {
+            std::string_view s = _Previous();
+            return std::make_shared<LiteralString>(std::string(s.substr(1, s.size() - 2)));
         }
         return nullptr;
     }
 
-    std::shared_ptr<ExpressionNode> Parser::ParseTerm() {
+    std::shared_ptr<ExpressionNode> Descent::ParseTerm() {
         if (_Match("(")) {
             std::shared_ptr<ExpressionNode> node = ParseOr();
             _Consume(")");
@@ -137,16 +235,16 @@ namespace ExpressionParser {
             return std::make_shared<LiteralBoolean>(true);
         else if (_Match("false") || _Match("False"))
             return std::make_shared<LiteralBoolean>(false);
-        else if (std::regex_match(_Peek(), std::regex("^-?\\d+(\\.\\d+)?$"))) {
-            return std::make_shared<LiteralNumber>(_Advance());
+        else if (_MatchKind(TokenKind::Number)) {
+            return std::make_shared<LiteralNumber>(std::string(_Previous()));
         }
 
         std::shared_ptr<LiteralString> stringLiteral = ParseStringLiteral();
         if (stringLiteral != nullptr)
             return stringLiteral;
 
-        std::string identifier = _MatchIdentifier();
-        if (!identifier.empty()) {
+        if (_MatchKind(TokenKind::Identifier)) {
+            std::string identifier(_Previous());
             if (_Match("(")) {
                 std::vector<std::shared_ptr<ExpressionNode>> args;
                 if (!_Match(")")) {
@@ -160,15 +258,21 @@ namespace ExpressionParser {
             return std::make_shared<Variable>(identifier);
         }
 
-        throw std::runtime_error("Unexpected token: " + _Peek());
+        throw std::runtime_error("Unexpected token: " + std::string(_Peek()));
     }
 
     // Helper functions:
 
-    bool Parser::_Match(std::initializer_list<const char*> tokens) {
+    bool Descent::_Match(std::initializer_list<std::string_view> tokens) {
         if (_pos < static_cast<int>(_tokens.size())) {
+            const Token& current = _tokens[_pos];
+            // Only symbols and keywords are matched by text, so a string literal
+            // such as 'and' can never be mistaken for an operator.
+            if (current.Kind != TokenKind::Operator && current.Kind != TokenKind::Keyword &&
+                current.Kind != TokenKind::Boolean)
+                return false;
             for (auto token : tokens) {
-                if (_tokens[_pos] == token) {
+                if (current.Text == token) {
                     _pos++;
                     return true;
                 }
@@ -177,49 +281,32 @@ namespace ExpressionParser {
         return false;
     }
 
-    bool Parser::_Match(const char* token) {
+    bool Descent::_Match(std::string_view token) {
         return _Match({ token });
     }
 
-    std::string Parser::_MatchIdentifier() {
-        if (_pos < static_cast<int>(_tokens.size()) &&
-            std::regex_match(_tokens[_pos], std::regex("^[A-Za-z_][A-Za-z0-9_]*$"))) {
-            std::string token = _tokens[_pos];
+    bool Descent::_MatchKind(TokenKind kind) {
+        if (_pos < static_cast<int>(_tokens.size()) && _tokens[_pos].Kind == kind) {
             _pos++;
-            return token;
+            return true;
         }
-        return "";
+        return false;
     }
 
-    void Parser::_Consume(const std::string &expectedToken) {
-        if (!_Match(expectedToken.c_str())) {
+    void Descent::_Consume(std::string_view expectedToken) {
+        if (!_Match(expectedToken)) {
             if (_pos >= static_cast<int>(_tokens.size()))
-                throw std::runtime_error("Expected '" + expectedToken + "' but expression ended.");
-            throw std::runtime_error("Expected '" + expectedToken + "' but found '" + _Peek() + "'");
+                throw std::runtime_error("Expected '" + std::string(expectedToken) + "' but expression ended.");
+            throw std::runtime_error("Expected '" + std::string(expectedToken) + "' but found '" + std::string(_Peek()) + "'");
         }
     }
 
-    std::string Parser::_Peek() {
-        return (_pos < static_cast<int>(_tokens.size())) ? _tokens[_pos] : "";
-    }
-
-    std::string Parser::_Previous() {
-        return (_pos > 0) ? _tokens[_pos - 1] : "";
-    }
-
-    std::string Parser::_Advance() {
-        if (_pos < static_cast<int>(_tokens.size())) {
-            _pos++;
-            return _tokens[_pos - 1];
-        }
-        return "";
+    std::string_view Descent::_Peek() {
+        return (_pos < static_cast<int>(_tokens.size())) ? _tokens[_pos].Text : std::string_view();
     }
 
-    std::string Parser::_Expect(const std::string &expectedToken) {
-        std::string token = _Advance();
-        if (token != expectedToken)
-            throw std::runtime_error("Expected '" + expectedToken + "', but found '" + token + "'");
-        return token;
+    std::string_view Descent::_Previous() {
+        return (_pos > 0) ? _tokens[_pos - 1].Text : std::string_view();
     }
 
 } // namespace ExpressionParser
\ No newline at end of file
@@ -0,0 +1,357 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/program.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace ExpressionParser {
+
+namespace {
+
+    // Most conditions need only a handful of stack slots, so avoid the heap for those.
+    constexpr uint32_t INLINE_STACK_SIZE = 16;
+
+    const char* OpCodeName(OpCode op) {
+        switch (op) {
+            case OpCode::PushConst: return "PushConst";
+            case OpCode::LoadVar: return "LoadVar";
+            case OpCode::Call: return "Call";
+            case OpCode::JumpIfTrue: return "JumpIfTrue";
+            case OpCode::JumpIfFalse: return "JumpIfFalse";
+            case OpCode::JumpIfZero: return "JumpIfZero";
+            case OpCode::Or: return "Or";
+            case OpCode::And: return "And";
+            case OpCode::Equals: return "Equals";
+            case OpCode::NotEquals: return "NotEquals";
+            case OpCode::Plus: return "Plus";
+            case OpCode::Minus: return "Minus";
+            case OpCode::Divide: return "Divide";
+            case OpCode::Multiply: return "Multiply";
+            case OpCode::GreaterThan: return "GreaterThan";
+            case OpCode::LessThan: return "LessThan";
+            case OpCode::GreaterThanEquals: return "GreaterThanEquals";
+            case OpCode::LessThanEquals: return "LessThanEquals";
+            case OpCode::Negative: return "Negative";
+            case OpCode::Not: return "Not";
+        }
+        return "?";
+    }
+
+    // Net change in stack depth for each instruction.
+    int StackEffect(OpCode op, uint16_t count) {
+        switch (op) {
+            case OpCode::PushConst:
+            case OpCode::LoadVar:
+                return 1;
+            case OpCode::Call:
+                return 1 - static_cast<int>(count);
+            case OpCode::JumpIfTrue:
+            case OpCode::JumpIfFalse:
+            case OpCode::JumpIfZero:
+            case OpCode::Negative:
+            case OpCode::Not:
+                return 0;
+            default:
+                return -1;
+        }
+    }
+}
+
+// ---------------------
+// Program
+// ---------------------
+Value Program::Run(const Context &context) const {
+    Value inlineStack[INLINE_STACK_SIZE];
+    std::vector<Value> heapStack;
+    Value* stack = inlineStack;
+    if (_maxStack > INLINE_STACK_SIZE) {
+        heapStack.resize(_maxStack);
+        stack = heapStack.data();
+    }
+
+    size_t sp = 0;
+    size_t pc = 0;
+    const size_t end = _code.size();
+
+    while (pc < end) {
+        const Instruction &ins = _code[pc++];
+        switch (ins.Op) {
+            case OpCode::PushConst:
+                stack[sp++] = _constants[ins.Operand];
+                break;
+
+            case OpCode::LoadVar:
+                stack[sp++] = Utils::FetchVariable(context, ins.Operand);
+                break;
+
+            case OpCode::Call: {
+                // Arguments are passed straight from the stack.
+                sp -= ins.Count;
+                stack[sp] = Utils::CallFunction(context, ins.Operand, std::span<const Value>(stack + sp, ins.Count));
+                sp++;
+                break;
+            }
+
+            case OpCode::JumpIfTrue:
+                if (Utils::MakeBool(stack[sp - 1])) {
+                    stack[sp - 1] = true;
+                    pc = ins.Operand;
+                }
+                break;
+
+            case OpCode::JumpIfFalse:
+                if (!Utils::MakeBool(stack[sp - 1])) {
+                    stack[sp - 1] = false;
+                    pc = ins.Operand;
+                }
+                break;
+
+            case OpCode::JumpIfZero:
+                if (Utils::MakeNumeric(stack[sp - 1]) == 0.0) {
+                    stack[sp - 1] = 0.0;
+                    pc = ins.Operand;
+                }
+                break;
+
+            case OpCode::Negative:
+                stack[sp - 1] = -Utils::MakeNumeric(stack[sp - 1]);
+                break;
+
+            case OpCode::Not:
+                stack[sp - 1] = !Utils::MakeBool(stack[sp - 1]);
+                break;
+
+            default:
+                stack[sp - 2] = EvalBinary(ins.Op, stack[sp - 2], stack[sp - 1]);
+                sp--;
+                break;
+        }
+    }
+
+    return stack[0];
+}
+
+Value Program::EvalBinary(OpCode op, const Value &left, const Value &right) {
+    switch (op) {
+        case OpCode::Or:
+            return Utils::MakeBool(left) || Utils::MakeBool(right);
+        case OpCode::And:
+            return Utils::MakeBool(left) && Utils::MakeBool(right);
+        case OpCode::Equals:
+            return Utils::ValueEquals(left, Utils::MakeTypeMatch(left, right));
+        case OpCode::NotEquals:
+            return !Utils::ValueEquals(left, Utils::MakeTypeMatch(left, right));
+        case OpCode::Plus:
+            return Utils::MakeNumeric(left) + Utils::MakeNumeric(right);
+        case OpCode::Minus:
+            return Utils::MakeNumeric(left) - Utils::MakeNumeric(right);
+        case OpCode::Divide: {
+            double numRight = Utils::MakeNumeric(right);
+            if (numRight == 0)
+                throw std::runtime_error("Division by zero.");
+            return Utils::MakeNumeric(left) / numRight;
+        }
+        case OpCode::Multiply:
+            return Utils::MakeNumeric(left) * Utils::MakeNumeric(right);
+        case OpCode::GreaterThan:
+            return Utils::MakeNumeric(left) > Utils::MakeNumeric(right);
+        case OpCode::LessThan:
+            return Utils::MakeNumeric(left) < Utils::MakeNumeric(right);
+        case OpCode::GreaterThanEquals:
+            return Utils::MakeNumeric(left) >= Utils::MakeNumeric(right);
+        case OpCode::LessThanEquals:
+            return Utils::MakeNumeric(left) <= Utils::MakeNumeric(right);
+        default:
+            throw std::runtime_error("Bad opcode in expression program.");
+    }
+}
+
+size_t Program::GetMemoryUsage() const {
+    return sizeof(Program) + _code.capacity() * sizeof(Instruction) + _constants.capacity() * sizeof(Value);
+}
+
+std::string Program::Dump() const {
+    std::ostringstream output;
+    for (size_t i = 0; i < _code.size(); i++) {
+        const Instruction &ins = _code[i];
+        output << i << ": " << OpCodeName(ins.Op);
+        switch (ins.Op) {
+            case OpCode::PushConst:
+                output << " " << Utils::FormatValue(_constants[ins.Operand]);
+                break;
+            case OpCode::LoadVar:
+                output << " " << SymbolTable::GetName(ins.Operand);
+                break;
+            case OpCode::Call:
+                output << " " << SymbolTable::GetName(ins.Operand) << "/" << ins.Count;
+                break;
+            case OpCode::JumpIfTrue:
+            case OpCode::JumpIfFalse:
+            case OpCode::JumpIfZero:
+                output << " -> " << ins.Operand;
+                break;
+            default:
+                break;
+        }
+        output << "\n";
+    }
+    return output.str();
+}
+
+// ---------------------
+// Compiler
+// ---------------------
+Program Compiler::Compile(const ExpressionNode &node) {
+    Compiler compiler;
+    node.Compile(compiler);
+    if (compiler._depth != 1)
+        throw std::runtime_error("Expression compiled to an unbalanced program.");
+    return std::move(compiler._program);
+}
+
+std::shared_ptr<ExpressionNode> Compiler::Decompile(std::span<const Instruction> code, std::span<const Value> constants, int specificity) {
+    // Each node's code ends with its own instruction, so replaying the stack effects rebuilds the tree.
+    // Jumps belong to the binary operator that follows their right operand.
+    std::vector<std::shared_ptr<ExpressionNode>> stack;
+    auto pop = [&stack]() {
+        if (stack.empty())
+            throw std::runtime_error("Program pops more values than it pushes.");
+        std::shared_ptr<ExpressionNode> node = std::move(stack.back());
+        stack.pop_back();
+        return node;
+    };
+
+    for (size_t i = 0; i < code.size(); i++) {
+        const Instruction &ins = code[i];
+        switch (ins.Op) {
+            case OpCode::PushConst: {
+                if (ins.Operand >= constants.size())
+                    throw std::runtime_error("Program refers to a missing constant.");
+                std::shared_ptr<ExpressionNode> literal = ExpressionNode::MakeLiteral(constants[ins.Operand]);
+                if (!literal)
+                    throw std::runtime_error("Program has a constant with no value.");
+                stack.push_back(std::move(literal));
+                break;
+            }
+            case OpCode::LoadVar:
+                stack.push_back(std::make_shared<Variable>(SymbolTable::GetName(ins.Operand)));
+                break;
+            case OpCode::Call: {
+                if (ins.Count > stack.size())
+                    throw std::runtime_error("Program pops more values than it pushes.");
+                std::vector<std::shared_ptr<ExpressionNode>> args(std::make_move_iterator(stack.end() - ins.Count), std::make_move_iterator(stack.end()));
+                stack.resize(stack.size() - ins.Count);
+                stack.push_back(std::make_shared<FunctionCall>(SymbolTable::GetName(ins.Operand), args));
+                break;
+            }
+            case OpCode::JumpIfTrue:
+            case OpCode::JumpIfFalse:
+            case OpCode::JumpIfZero:
+                if (ins.Operand <= i || ins.Operand > code.size())
+                    throw std::runtime_error("Program jumps outside its code.");
+                break;
+            case OpCode::Negative:
+                stack.push_back(std::make_shared<OpNegative>(pop()));
+                break;
+            case OpCode::Not:
+                stack.push_back(std::make_shared<OpNot>(pop()));
+                break;
+            default: {
+                std::shared_ptr<ExpressionNode> right = pop();
+                std::shared_ptr<ExpressionNode> left = pop();
+                std::shared_ptr<ExpressionNode> node;
+                switch (ins.Op) {
+                    case OpCode::Or: node = std::make_shared<OpOr>(left, right); break;
+                    case OpCode::And: node = std::make_shared<OpAnd>(left, right); break;
+                    case OpCode::Equals: node = std::make_shared<OpEquals>(left, right); break;
+                    case OpCode::NotEquals: node = std::make_shared<OpNotEquals>(left, right); break;
+                    case OpCode::Plus: node = std::make_shared<OpPlus>(left, right); break;
+                    case OpCode::Minus: node = std::make_shared<OpMinus>(left, right); break;
+                    case OpCode::Divide: node = std::make_shared<OpDivide>(left, right); break;
+                    case OpCode::Multiply: node = std::make_shared<OpMultiply>(left, right); break;
+                    case OpCode::GreaterThan: node = std::make_shared<OpGreaterThan>(left, right); break;
+                    case OpCode::LessThan: node = std::make_shared<OpLessThan>(left, right); break;
+                    case OpCode::GreaterThanEquals: node = std::make_shared<OpGreaterThanEquals>(left, right); break;
+                    case OpCode::LessThanEquals: node = std::make_shared<OpLessThanEquals>(left, right); break;
+                    default:
+                        throw std::runtime_error("Program has an unknown instruction.");
+                }
+                stack.push_back(std::move(node));
+                break;
+            }
+        }
+    }
+
+    if (stack.size() != 1)
+        throw std::runtime_error("Program doesn't leave a single value.");
+    stack.back()->_specificity = specificity;
+    return stack.back();
+}
+
+void Compiler::Emit(OpCode op, uint32_t operand, uint16_t count) {
+    _program._code.push_back({ op, count, operand });
+    _depth += StackEffect(op, count);
+    if (_depth > static_cast<int>(_program._maxStack))
+        _program._maxStack = static_cast<uint32_t>(_depth);
+}
+
+void Compiler::EmitConstant(const Value &value) {
+    _program._constants.push_back(value);
+    Emit(OpCode::PushConst, static_cast<uint32_t>(_program._constants.size() - 1));
+}
+
+size_t Compiler::BeginShortCircuit(OpCode binaryOp) {
+    OpCode jump;
+    switch (binaryOp) {
+        case OpCode::Or: jump = OpCode::JumpIfTrue; break;
+        case OpCode::And: jump = OpCode::JumpIfFalse; break;
+        case OpCode::Multiply: jump = OpCode::JumpIfZero; break;
+        default:
+            return SIZE_MAX;
+    }
+    Emit(jump);
+    return _program._code.size() - 1;
+}
+
+void Compiler::EndShortCircuit(size_t jump) {
+    if (jump == SIZE_MAX)
+        return;
+    _program._code[jump].Operand = static_cast<uint32_t>(_program._code.size());
+}
+
+// ---------------------
+// CompiledExpression
+// ---------------------
+CompiledExpression::CompiledExpression(std::shared_ptr<ExpressionNode> tree)
+    : _tree(ExpressionNode::Optimize(std::move(tree))), _program(Compiler::Compile(*_tree)) {
+    if (_tree->IsConstant())
+        _constant = _tree->Evaluate(Context());
+
+    for (const Instruction &ins : _program.GetCode()) {
+        if (ins.Op == OpCode::LoadVar || ins.Op == OpCode::Call)
+            _reads.push_back(ins.Operand);
+        if (ins.Op == OpCode::Call)
+            _calls.push_back(ins.Operand);
+    }
+    for (auto* slots : { &_reads, &_calls }) {
+        std::sort(slots->begin(), slots->end());
+        slots->erase(std::unique(slots->begin(), slots->end()), slots->end());
+    }
+}
+
+size_t CompiledExpression::GetMemoryUsage() const {
+    return sizeof(CompiledExpression) + _tree->GetMemoryUsage() + _program.GetMemoryUsage() +
+           (_reads.capacity() + _calls.capacity()) * sizeof(SymbolId);
+}
+
+Value CompiledExpression::Evaluate(const Context &context, TraceSink* trace) const {
+    if (TracingEnabled && trace)
+        return _tree->Evaluate(context, trace);
+    return _program.Run(context);
+}
+
+} // namespace ExpressionParser
@@ -0,0 +1,134 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/trace.h"
+#include "expression_parser/program.h"
+#include <algorithm>
+
+namespace ExpressionParser {
+
+namespace {
+
+    const char* OpCodeSymbol(OpCode op) {
+        switch (op) {
+            case OpCode::Or: return "or";
+            case OpCode::And: return "and";
+            case OpCode::Equals: return "==";
+            case OpCode::NotEquals: return "!=";
+            case OpCode::Plus: return "+";
+            case OpCode::Minus: return "-";
+            case OpCode::Divide: return "/";
+            case OpCode::Multiply: return "*";
+            case OpCode::GreaterThan: return ">";
+            case OpCode::LessThan: return "<";
+            case OpCode::GreaterThanEquals: return ">=";
+            case OpCode::LessThanEquals: return "<=";
+            case OpCode::Negative: return "-";
+            case OpCode::Not: return "not";
+            default: return "?";
+        }
+    }
+
+    // Notes show strings as they are, without quotes.
+    std::string FormatNoteValue(const Value &value) {
+        return value.IsString() ? value.GetString() : Utils::FormatValue(value);
+    }
+}
+
+TraceEvent TraceEvent::Note(const char* text, std::initializer_list<Value> values) {
+    TraceEvent event;
+    event.kind = Kind::Note;
+    event.text = text;
+    event.count = static_cast<uint16_t>(std::min<size_t>(values.size(), MAX_OPERANDS));
+    std::copy_n(values.begin(), event.count, event.operands);
+    return event;
+}
+
+std::string FormatTraceEvent(const TraceEvent &event) {
+    switch (event.kind) {
+        case TraceEvent::Kind::Literal:
+            switch (event.result.GetType()) {
+                case Value::Type::Bool: return "Boolean: " + Utils::FormatBoolean(event.result.GetBool());
+                case Value::Type::String: return "String: " + Utils::FormatString(event.result.GetString());
+                default: return "Number: " + Utils::FormatValue(event.result);
+            }
+
+        case TraceEvent::Kind::Variable:
+            return "Fetching variable: " + SymbolTable::GetName(event.slot) + " -> " + Utils::FormatValue(event.result);
+
+        case TraceEvent::Kind::Call: {
+            std::string args;
+            for (uint16_t i = 0; i < event.count; i++) {
+                if (i > 0)
+                    args += ", ";
+                args += (i < TraceEvent::MAX_OPERANDS) ? Utils::FormatValue(event.operands[i]) : "...";
+                if (i >= TraceEvent::MAX_OPERANDS)
+                    break;
+            }
+            return "Called function: " + SymbolTable::GetName(event.slot) + "(" + args + ") = " + Utils::FormatValue(event.result);
+        }
+
+        case TraceEvent::Kind::Unary:
+            return std::string("Evaluated: ") + OpCodeSymbol(event.op) + " " + Utils::FormatValue(event.operands[0]) +
+                   " = " + Utils::FormatValue(event.result);
+
+        case TraceEvent::Kind::Binary:
+            return "Evaluated: " + Utils::FormatValue(event.operands[0]) + " " + OpCodeSymbol(event.op) + " " +
+                   Utils::FormatValue(event.operands[1]) + " = " + Utils::FormatValue(event.result);
+
+        case TraceEvent::Kind::ShortCircuit:
+            return "Evaluated: " + Utils::FormatValue(event.operands[0]) + " " + OpCodeSymbol(event.op) +
+                   " (ignore) = " + Utils::FormatValue(event.result);
+
+        case TraceEvent::Kind::Note: {
+            std::string text;
+            uint16_t next = 0;
+            for (const char* c = event.text; c && *c; c++) {
+                if (*c == '%' && next < event.count)
+                    text += FormatNoteValue(event.operands[next++]);
+                else
+                    text += *c;
+            }
+            return text;
+        }
+    }
+    return "";
+}
+
+// ---------------------
+// TraceBuffer
+// ---------------------
+TraceBuffer::TraceBuffer(size_t capacity)
+    : _events(std::max<size_t>(capacity, 1)) {}
+
+void TraceBuffer::Record(const TraceEvent &event) {
+    _events[_next] = event;
+    _next = (_next + 1) % _events.size();
+    if (_size < _events.size())
+        _size++;
+    else
+        _dropped++;
+}
+
+const TraceEvent& TraceBuffer::operator[](size_t index) const {
+    size_t oldest = (_next + _events.size() - _size) % _events.size();
+    return _events[(oldest + index) % _events.size()];
+}
+
+std::vector<std::string> TraceBuffer::Format() const {
+    std::vector<std::string> lines;
+    lines.reserve(_size);
+    for (size_t i = 0; i < _size; i++)
+        lines.push_back(FormatTraceEvent((*this)[i]));
+    return lines;
+}
+
+void TraceBuffer::Clear() {
+    _next = 0;
+    _size = 0;
+    _dropped = 0;
+}
+
+} // namespace ExpressionParser
@@ -0,0 +1,130 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "expression_parser/value.h"
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace ExpressionParser {
+
+namespace {
+
+    struct EntryHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view text) const { return std::hash<std::string_view>{}(text); }
+        size_t operator()(const StringPool::Entry &entry) const { return (*this)(std::string_view(entry.text)); }
+    };
+
+    struct EntryEquals {
+        using is_transparent = void;
+        static std::string_view Text(std::string_view text) { return text; }
+        static std::string_view Text(const StringPool::Entry &entry) { return entry.text; }
+        template <typename A, typename B>
+        bool operator()(const A &a, const B &b) const { return Text(a) == Text(b); }
+    };
+
+    // Node-based, so entries never move once inserted.
+    struct Pool {
+        std::unordered_set<StringPool::Entry, EntryHash, EntryEquals> strings;
+        std::shared_mutex mutex;
+    };
+
+    Pool& GetPool() {
+        static Pool pool;
+        return pool;
+    }
+}
+
+// ---------------------
+// StringPool
+// ---------------------
+const StringPool::Entry* StringPool::Acquire(std::string_view text) {
+    Pool& pool = GetPool();
+    {
+        std::shared_lock lock(pool.mutex);
+        auto it = pool.strings.find(text);
+        if (it != pool.strings.end()) {
+            AddRef(&*it);
+            return &*it;
+        }
+    }
+    std::unique_lock lock(pool.mutex);
+    const Entry &entry = *pool.strings.emplace(text).first;
+    AddRef(&entry);
+    return &entry;
+}
+
+void StringPool::Release(const Entry* entry) {
+    uint32_t refs = entry->refs.load(std::memory_order_relaxed);
+    while (refs > 1) {
+        if (entry->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_release, std::memory_order_relaxed))
+            return;
+    }
+    // Likely the last reference. It's only dropped under the lock, so Acquire can't find the
+    // entry as it's erased; if Acquire got there first, the entry is still in use.
+    Pool& pool = GetPool();
+    std::unique_lock lock(pool.mutex);
+    if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        pool.strings.erase(pool.strings.find(entry->text));
+}
+
+size_t StringPool::Size() {
+    Pool& pool = GetPool();
+    std::shared_lock lock(pool.mutex);
+    return pool.strings.size();
+}
+
+// ---------------------
+// Value
+// ---------------------
+Value Value::FromAny(const std::any& val) {
+    if (val.type() == typeid(bool))
+        return Value(std::any_cast<bool>(val));
+    if (val.type() == typeid(int))
+        return Value(std::any_cast<int>(val));
+    if (val.type() == typeid(double))
+        return Value(std::any_cast<double>(val));
+    if (val.type() == typeid(std::string))
+        return Value(std::any_cast<const std::string&>(val));
+    if (val.type() == typeid(const char*))
+        return Value(std::any_cast<const char*>(val));
+    if (val.type() == typeid(Value))
+        return std::any_cast<Value>(val);
+    return Value();
+}
+
+std::any Value::ToAny() const {
+    switch (_type) {
+        case Type::Bool: return _bool;
+        case Type::Int: return _int;
+        case Type::Double: return _double;
+        case Type::String: return _string->text;
+        case Type::None: break;
+    }
+    return std::any();
+}
+
+bool Value::AsBool() const {
+    if (_type != Type::Bool)
+        throw std::runtime_error("Type mismatch: Expecting bool");
+    return _bool;
+}
+
+double Value::AsNumber() const {
+    if (!IsNumeric())
+        throw std::runtime_error("Type mismatch: Expecting number");
+    return GetNumber();
+}
+
+const std::string& Value::AsString() const {
+    if (_type != Type::String)
+        throw std::runtime_error("Type mismatch: Expecting string");
+    return _string->text;
+}
+
+} // namespace ExpressionParser
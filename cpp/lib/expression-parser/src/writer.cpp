@@ -7,7 +7,7 @@
 
 namespace ExpressionParser {
 
-STRING_FORMAT Writer::_stringFormat = STRING_FORMAT::SINGLEQUOTE;
+thread_local STRING_FORMAT Writer::_stringFormat = STRING_FORMAT::SINGLEQUOTE;
 
 STRING_FORMAT Writer::getStringFormat() {
     return _stringFormat;
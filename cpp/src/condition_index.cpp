@@ -0,0 +1,176 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "storylet_framework/condition_index.h"
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace StoryletFramework
+{
+    using ExpressionParser::OpCode;
+
+    // Equality can be looked up with any literal, but a range needs a number to search for
+    static bool IsIndexable(const ExpressionParser::Predicate& predicate)
+    {
+        if (predicate.operand.IsNumeric() && std::isnan(predicate.operand.GetNumber()))
+            return false;
+        return predicate.op == OpCode::Equals || predicate.operand.IsNumeric();
+    }
+
+    void ConditionIndex::Build(const std::vector<const ExpressionParser::CompiledExpression*>& conditions)
+    {
+        _ranges.clear();
+        _equalities.clear();
+        _indexed.assign(conditions.size(), Indexed::No);
+
+        std::unordered_map<ExpressionParser::SymbolId, size_t> ranges;
+        std::unordered_map<ExpressionParser::SymbolId, size_t> equalities;
+        std::vector<ExpressionParser::Predicate> predicates;
+        for (uint32_t handle = 0; handle < conditions.size(); handle++)
+        {
+            if (!conditions[handle])
+                continue;
+
+            predicates.clear();
+            bool onlyPredicates = conditions[handle]->GetPredicates(predicates);
+            // Only the first term is evaluated whatever the context, so skipping the rest when it
+            // fails can't hide an error they would throw
+            if (predicates.empty() || !IsIndexable(predicates.front()))
+                continue;
+
+            const ExpressionParser::Predicate& predicate = predicates.front();
+            _indexed[handle] = (onlyPredicates && predicates.size() == 1) ? Indexed::Exact : Indexed::Partly;
+
+            if (predicate.op == OpCode::Equals)
+            {
+                auto [it, inserted] = equalities.emplace(predicate.slot, _equalities.size());
+                if (inserted)
+                {
+                    _equalities.push_back({predicate.slot, {}, {}, {}, {}, {}, {}});
+                }
+                EqualityIndex& equality = _equalities[it->second];
+
+                equality.all.push_back(handle);
+                if (predicate.operand.IsString())
+                {
+                    auto& bucket = equality.strings[&predicate.operand.GetString()];
+                    if (bucket.empty())
+                        equality.literals.push_back(predicate.operand);
+                    bucket.push_back(handle);
+                }
+                else
+                    equality.nonStrings.push_back(handle);
+                if (predicate.operand.IsNumeric())
+                    equality.numbers[predicate.operand.GetNumber() + 0.0].push_back(handle); // +0.0 makes -0.0 the same key as 0.0
+                else
+                    equality.nonNumbers.push_back(handle);
+                continue;
+            }
+
+            auto [it, inserted] = ranges.emplace(predicate.slot, _ranges.size());
+            if (inserted)
+            {
+                _ranges.push_back({predicate.slot, {}, {}});
+            }
+            RangeIndex& range = _ranges[it->second];
+
+            Bound bound = {predicate.operand.GetNumber(), false, handle};
+            switch (predicate.op)
+            {
+                case OpCode::GreaterThanEquals: bound.inclusive = true; [[fallthrough]];
+                case OpCode::GreaterThan: range.lower.push_back(bound); break;
+                case OpCode::LessThanEquals: bound.inclusive = true; [[fallthrough]];
+                default: range.upper.push_back(bound); break;
+            }
+        }
+
+        for (RangeIndex& range : _ranges)
+        {
+            std::sort(range.lower.begin(), range.lower.end(), [](const Bound& a, const Bound& b) {
+                if (a.threshold != b.threshold)
+                    return a.threshold < b.threshold;
+                if (a.inclusive != b.inclusive)
+                    return a.inclusive;
+                return a.handle < b.handle;
+            });
+            std::sort(range.upper.begin(), range.upper.end(), [](const Bound& a, const Bound& b) {
+                if (a.threshold != b.threshold)
+                    return a.threshold > b.threshold;
+                if (a.inclusive != b.inclusive)
+                    return a.inclusive;
+                return a.handle < b.handle;
+            });
+        }
+    }
+
+    void ConditionIndex::MatchAll(const std::vector<uint32_t>& handles, std::vector<IndexMatch>& matches)
+    {
+        for (uint32_t handle : handles)
+            matches.push_back({handle, false});
+    }
+
+    void ConditionIndex::Match(const Context& context, std::vector<IndexMatch>& matches) const
+    {
+        for (const EqualityIndex& equality : _equalities)
+        {
+            const ExpressionParser::ContextValue* entry = context.Find(equality.slot);
+            const ExpressionParser::Value* value = (entry && !entry->IsFunction()) ? &entry->GetValue() : nullptr;
+            if (value && value->IsString())
+            {
+                auto it = equality.strings.find(&value->GetString());
+                if (it != equality.strings.end())
+                {
+                    for (uint32_t handle : it->second)
+                        matches.push_back({handle, true});
+                }
+                MatchAll(equality.nonStrings, matches);
+            }
+            else if (value && value->IsNumeric())
+            {
+                auto it = equality.numbers.find(value->GetNumber() + 0.0);
+                if (it != equality.numbers.end())
+                {
+                    for (uint32_t handle : it->second)
+                        matches.push_back({handle, true});
+                }
+                MatchAll(equality.nonNumbers, matches);
+            }
+            else
+            {
+                // Leave anything unusual, including missing variables, to the evaluator
+                MatchAll(equality.all, matches);
+            }
+        }
+
+        for (const RangeIndex& range : _ranges)
+        {
+            const ExpressionParser::ContextValue* entry = context.Find(range.slot);
+            if (!entry || entry->IsFunction() || !(entry->GetValue().IsNumeric() || entry->GetValue().IsBool()))
+            {
+                // Strings may or may not convert to numbers, so leave them to the evaluator
+                for (const auto* bounds : {&range.lower, &range.upper})
+                {
+                    for (const Bound& bound : *bounds)
+                        matches.push_back({bound.handle, false});
+                }
+                continue;
+            }
+
+            // Compared the same way as OpGreaterThan and friends
+            double value = ExpressionParser::Utils::MakeNumeric(entry->GetValue());
+            auto lowerEnd = std::partition_point(range.lower.begin(), range.lower.end(), [value](const Bound& bound) {
+                return value > bound.threshold || (value == bound.threshold && bound.inclusive);
+            });
+            auto upperEnd = std::partition_point(range.upper.begin(), range.upper.end(), [value](const Bound& bound) {
+                return value < bound.threshold || (value == bound.threshold && bound.inclusive);
+            });
+            for (auto it = range.lower.begin(); it != lowerEnd; ++it)
+                matches.push_back({it->handle, true});
+            for (auto it = range.upper.begin(); it != upperEnd; ++it)
+                matches.push_back({it->handle, true});
+        }
+    }
+}
@@ -4,6 +4,7 @@
  */
 
  #include "storylet_framework/context.h"
+ #include "expression_parser/expression_cache.h"
  
  #include <iostream>
  #include <string>
@@ -13,79 +14,137 @@
 namespace StoryletFramework
 {
 
-    ExpressionParser::Parser expressionParser;
+    // Describe an outcome or property expression for traces
+    static std::string DescribeExpression(const std::any& val)
+    {
+        if (val.type() == typeid(std::string))
+        {
+            return std::any_cast<const std::string&>(val);
+        }
+        return ExpressionParser::Utils::FormatValue(val);
+    }
 
     // Evaluate an expression
-    std::any ContextUtils::EvalExpression(const std::any& val, const Context& context, DumpEval* dumpEval)
+    std::any ContextUtils::EvalExpression(const std::any& val, const Context& context, TraceSink* trace)
+    {
+        return EvalValue(val, context, trace).ToAny();
+    }
+
+    ExpressionParser::Value ContextUtils::EvalValue(const std::any& val, const Context& context, TraceSink* trace)
     {
         if (val.type() == typeid(bool) || val.type() == typeid(double) || val.type() == typeid(int))
         {
-            return val;
+            return ExpressionParser::Value::FromAny(val);
         }
 
         if (val.type() == typeid(std::string))
         {
             const auto& str = std::any_cast<std::string>(val);
-            auto expression = expressionParser.Parse(str);
+            auto expression = ExpressionParser::ExpressionCache::Global().Get(str);
             if (!expression)
             {
                 throw std::invalid_argument("Expression result should never be null.");
             }
-            return expression->Evaluate(context, dumpEval);
+            return expression->Evaluate(context, trace);
         }
 
         throw std::invalid_argument("Expression text cannot be null or empty.");
     }
 
-    // Initialize context with properties
-    void ContextUtils::InitContext(Context& context, const KeyedMap& properties, DumpEval* dumpEval)
+    // Evaluate a compiled update
+    static ExpressionParser::Value EvalUpdate(const ContextUpdate& update, const Context& context, TraceSink* trace)
     {
-        for (const auto& kvp : properties)
+        if (update.expression)
         {
-            const auto& propName = kvp.first;
-            const auto& expression = kvp.second;
+            return update.expression->Evaluate(context, trace);
+        }
+        return update.value;
+    }
 
-            if (context.find(propName) != context.end())
+    // Initialize context with properties
+    void ContextUtils::InitContext(Context& context, const KeyedMap& properties, TraceSink* trace)
+    {
+        InitContext(context, CompileUpdates(properties), trace);
+    }
+
+    // Initialize context with compiled properties
+    void ContextUtils::InitContext(Context& context, const ContextUpdates& properties, TraceSink* trace)
+    {
+        for (const auto& update : properties)
+        {
+            if (context.Find(update.slot))
             {
-                throw std::invalid_argument("Trying to initialize property '" + propName + "' in context when it already exists.");
+                throw std::invalid_argument("Trying to initialize property '" + update.name + "' in context when it already exists.");
             }
 
-            if (dumpEval)
+            if (TracingEnabled && trace)
             {
-                dumpEval->push_back("InitContext: Evaluating " + propName + " = " + std::any_cast<std::string>(expression));
+                trace->Record(ExpressionParser::TraceEvent::Note("InitContext: Evaluating % = %", {update.name, update.text}));
             }
 
-            auto result = EvalExpression(expression, context, dumpEval);
-            context[propName] = result;
+            ExpressionParser::Value result = EvalUpdate(update, context, trace);
+            context[update.slot] = result;
         }
     }
 
     // Update context with updates
-    void ContextUtils::UpdateContext(Context& context, const KeyedMap& updates, DumpEval* dumpEval)
+    void ContextUtils::UpdateContext(Context& context, const KeyedMap& updates, TraceSink* trace)
     {
-        for (const auto& kvp : updates)
+        ApplyUpdates(context, CompileUpdates(updates), trace);
+    }
+
+    // Compile updates, sharing expressions through the global cache
+    ContextUpdates ContextUtils::CompileUpdates(const KeyedMap& updates)
+    {
+        ContextUpdates compiled;
+        compiled.reserve(updates.size());
+        for (const auto& [propName, expression] : updates)
         {
-            const auto& propName = kvp.first;
-            const auto& expression = kvp.second;
+            ContextUpdate update;
+            update.name = propName;
+            update.slot = ExpressionParser::SymbolTable::Intern(propName);
+            update.text = DescribeExpression(expression);
 
-            if (context.find(propName) == context.end())
+            if (expression.type() == typeid(bool) || expression.type() == typeid(double) || expression.type() == typeid(int))
+            {
+                update.value = ExpressionParser::Value::FromAny(expression);
+            }
+            else if (expression.type() == typeid(std::string))
             {
-                throw std::out_of_range("Context variable '" + propName + "' is undefined.");
+                update.expression = ExpressionParser::ExpressionCache::Global().Get(std::any_cast<const std::string&>(expression));
+            }
+            else
+            {
+                throw std::invalid_argument("Expression for '" + propName + "' must be a string, bool or number.");
+            }
+            compiled.push_back(std::move(update));
+        }
+        return compiled;
+    }
+
+    // Apply compiled updates in order, so later updates see earlier ones
+    void ContextUtils::ApplyUpdates(Context& context, const ContextUpdates& updates, TraceSink* trace)
+    {
+        for (const auto& update : updates)
+        {
+            if (!context.Find(update.slot))
+            {
+                throw std::out_of_range("Context variable '" + update.name + "' is undefined.");
             }
 
-            if (dumpEval)
+            if (TracingEnabled && trace)
             {
-                dumpEval->push_back("UpdateContext: Evaluating " + propName + " = " + std::any_cast<std::string>(expression));
+                trace->Record(ExpressionParser::TraceEvent::Note("UpdateContext: Evaluating % = %", {update.name, update.text}));
             }
 
-            auto result = EvalExpression(expression, context, dumpEval);
+            ExpressionParser::Value result = EvalUpdate(update, context, trace);
 
-            if (dumpEval)
+            if (TracingEnabled && trace)
             {
-                dumpEval->push_back("Setting " + propName + " to " + std::any_cast<std::string>(expression));
+                trace->Record(ExpressionParser::TraceEvent::Note("Setting % to %", {update.name, update.text}));
             }
 
-            context[propName] = result;
+            context[update.slot] = result;
         }
     }
 
@@ -94,36 +153,35 @@ namespace StoryletFramework
     {
         std::ostringstream output;
 
-        for (const auto& kvp : context)
+        context.ForEach([&output](const std::string& propName, const ExpressionParser::ContextValue& entry)
         {
-            const auto& propName = kvp.first;
-            const auto& expression = kvp.second;
+            const ExpressionParser::Value& value = entry.GetValue();
 
-            if (expression.type() == typeid(ExpressionParser::FunctionWrapper))
+            if (entry.IsFunction())
             {
                 output << propName << " = <function>\n";
             }
-            else if (expression.type() == typeid(bool))
+            else if (value.IsBool())
             {
-                output << propName << " = " << (std::any_cast<bool>(expression) ? "true" : "false") << "\n";
+                output << propName << " = " << (value.GetBool() ? "true" : "false") << "\n";
             }
-            else if (expression.type() == typeid(int))
+            else if (value.GetType() == ExpressionParser::Value::Type::Int)
             {
-                output << propName << " = " << std::any_cast<int>(expression) << "\n";
+                output << propName << " = " << value.GetInt() << "\n";
             } 
-            else if (expression.type() == typeid(std::string))
+            else if (value.IsString())
             {
-                output << propName << " = \"" << std::any_cast<std::string>(expression) << "\"\n";
+                output << propName << " = \"" << value.GetString() << "\"\n";
             } 
-            else if (expression.type() == typeid(double))
+            else if (value.GetType() == ExpressionParser::Value::Type::Double)
             {
-                output << propName << " = " << std::any_cast<double>(expression) << "\n";
+                output << propName << " = " << value.GetDouble() << "\n";
             } 
             else
             {
                 output << propName << " = <unknown type>\n";
             }
-        }
+        });
 
         return output.str();
     }
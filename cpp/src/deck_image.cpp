@@ -0,0 +1,624 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "storylet_framework/deck_image.h"
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+
+#if defined(_WIN32)
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace StoryletFramework
+{
+    namespace
+    {
+        using ExpressionParser::CompiledExpression;
+        using ExpressionParser::Instruction;
+        using ExpressionParser::OpCode;
+        using ExpressionParser::SymbolId;
+        using ExpressionParser::SymbolTable;
+        using ExpressionParser::Value;
+
+        constexpr char MAGIC[4] = {'S', 'F', 'D', 'K'};
+        constexpr uint32_t NONE = UINT32_MAX; // No string or expression
+
+        // An image is a header followed by its sections, each starting on an 8-byte boundary.
+        // Records refer to strings and expressions by index, and to other records by a range.
+        enum Section : uint32_t
+        {
+            Strings,        // StringRecord, for each string in StringData
+            StringData,     // Bytes
+            Expressions,    // ExpressionRecord
+            Code,           // InstructionRecord
+            Constants,      // ValueRecord
+            Storylets,      // StoryletRecord
+            Outcomes,       // OutcomeRecord
+            Updates,        // UpdateRecord, for outcomes and context
+            ContextBlocks,  // ContextRecord
+            Content,        // Bytes
+            SECTION_COUNT
+        };
+
+        struct SectionRecord
+        {
+            uint64_t offset;
+            uint64_t count;
+        };
+
+        struct Header
+        {
+            char magic[4];
+            uint32_t version;
+            uint32_t sectionCount;
+            uint32_t reserved;
+            SectionRecord sections[SECTION_COUNT];
+        };
+
+        struct StringRecord
+        {
+            uint32_t offset;
+            uint32_t size;
+        };
+
+        // Variables and functions are named by string. Constants and jumps count from the expression's own.
+        struct ExpressionRecord
+        {
+            uint32_t firstInstruction;
+            uint32_t instructionCount;
+            uint32_t firstConstant;
+            uint32_t constantCount;
+            int32_t specificity;
+            uint32_t reserved;
+        };
+
+        struct InstructionRecord
+        {
+            uint8_t op;
+            uint8_t reserved;
+            uint16_t count;
+            uint32_t operand;
+        };
+
+        struct ValueRecord
+        {
+            uint32_t type; // A Value::Type
+            uint32_t string;
+            double number; // For bools too
+        };
+
+        struct StoryletRecord
+        {
+            uint32_t id;
+            int32_t redraw;
+            uint32_t condition;
+            uint32_t priorityExpression;
+            int32_t priority;
+            uint32_t firstOutcome;
+            uint32_t outcomeCount;
+            uint32_t reserved;
+            uint64_t contentOffset;
+            uint64_t contentSize; // 0 if there's no content
+        };
+
+        struct OutcomeRecord
+        {
+            uint32_t name;
+            uint32_t firstUpdate;
+            uint32_t updateCount;
+        };
+
+        struct UpdateRecord
+        {
+            uint32_t name;
+            uint32_t expression;
+            uint32_t text;
+            uint32_t reserved;
+            ValueRecord value; // Used if there's no expression
+        };
+
+        // Context to initialize before the storylet at beforeStorylet is added
+        struct ContextRecord
+        {
+            uint32_t beforeStorylet;
+            uint32_t firstUpdate;
+            uint32_t updateCount;
+        };
+
+        // The layout is the format, so pin it down
+        static_assert(sizeof(Header) == 176 && sizeof(StringRecord) == 8 && sizeof(ExpressionRecord) == 24 &&
+            sizeof(InstructionRecord) == 8 && sizeof(ValueRecord) == 16 && sizeof(StoryletRecord) == 48 &&
+            sizeof(OutcomeRecord) == 12 && sizeof(UpdateRecord) == 32 && sizeof(ContextRecord) == 12);
+
+        // Bytes taken by each entry of each section
+        constexpr size_t ENTRY_SIZES[SECTION_COUNT] = { sizeof(StringRecord), 1, sizeof(ExpressionRecord), sizeof(InstructionRecord),
+            sizeof(ValueRecord), sizeof(StoryletRecord), sizeof(OutcomeRecord), sizeof(UpdateRecord), sizeof(ContextRecord), 1 };
+
+        void CheckImage(bool ok, const char* what)
+        {
+            if (!ok)
+            {
+                throw std::runtime_error(std::string("Deck image is corrupt: ") + what);
+            }
+        }
+
+        // Reads records where they lie in the image, checking every index against its section
+        class ImageReader
+        {
+        public:
+            explicit ImageReader(std::span<const uint8_t> bytes) : _bytes(bytes)
+            {
+                std::memcpy(&_header, bytes.data(), sizeof(Header));
+            }
+
+            size_t Count(Section section) const { return _header.sections[section].count; }
+
+            template<typename T>
+            T Get(Section section, size_t index) const
+            {
+                CheckImage(index < Count(section), "a record is out of range");
+                T record;
+                std::memcpy(&record, _bytes.data() + _header.sections[section].offset + index * sizeof(T), sizeof(T));
+                return record;
+            }
+
+            std::span<const uint8_t> Bytes(Section section, uint64_t offset, uint64_t size) const
+            {
+                CheckImage(offset <= Count(section) && size <= Count(section) - offset, "bytes are out of range");
+                return _bytes.subspan(_header.sections[section].offset + offset, size);
+            }
+
+            std::string_view String(uint32_t index) const
+            {
+                StringRecord record = Get<StringRecord>(Strings, index);
+                std::span<const uint8_t> bytes = Bytes(StringData, record.offset, record.size);
+                return {reinterpret_cast<const char*>(bytes.data()), bytes.size()};
+            }
+
+            Value ReadValue(const ValueRecord& record) const
+            {
+                switch (static_cast<Value::Type>(record.type))
+                {
+                    case Value::Type::None:
+                        return Value();
+                    case Value::Type::Bool:
+                        return Value(record.number != 0);
+                    case Value::Type::Int:
+                        return Value(static_cast<int>(record.number));
+                    case Value::Type::Double:
+                        return Value(record.number);
+                    case Value::Type::String:
+                        return Value(String(record.string));
+                }
+                CheckImage(false, "a value has an unknown type");
+                return Value();
+            }
+
+        private:
+            std::span<const uint8_t> _bytes;
+            Header _header;
+        };
+
+        // Gathers the records for an image, sharing strings and expressions between them
+        class ImageWriter
+        {
+        public:
+            uint32_t AddString(std::string_view text)
+            {
+                auto [it, added] = _stringIds.try_emplace(std::string(text), static_cast<uint32_t>(_strings.size()));
+                if (added)
+                {
+                    _strings.push_back({static_cast<uint32_t>(_stringData.size()), static_cast<uint32_t>(text.size())});
+                    _stringData.insert(_stringData.end(), text.begin(), text.end());
+                }
+                return it->second;
+            }
+
+            // Expressions are kept until the image is written, so an address is never reused by another
+            uint32_t AddExpression(const std::shared_ptr<const CompiledExpression>& expression)
+            {
+                if (!expression)
+                {
+                    return NONE;
+                }
+                auto [it, added] = _expressionIds.try_emplace(expression, static_cast<uint32_t>(_expressions.size()));
+                if (!added)
+                {
+                    return it->second;
+                }
+
+                const ExpressionParser::Program& program = expression->GetProgram();
+                ExpressionRecord record{};
+                record.firstInstruction = static_cast<uint32_t>(_code.size());
+                record.instructionCount = static_cast<uint32_t>(program.GetCode().size());
+                record.firstConstant = static_cast<uint32_t>(_constants.size());
+                record.constantCount = static_cast<uint32_t>(program.GetConstants().size());
+                record.specificity = expression->GetSpecificity();
+                for (const Instruction& ins : program.GetCode())
+                {
+                    InstructionRecord instruction{};
+                    instruction.op = static_cast<uint8_t>(ins.Op);
+                    instruction.count = ins.Count;
+                    instruction.operand = (ins.Op == OpCode::LoadVar || ins.Op == OpCode::Call) ? AddString(SymbolTable::GetName(ins.Operand)) : ins.Operand;
+                    _code.push_back(instruction);
+                }
+                for (const Value& constant : program.GetConstants())
+                {
+                    _constants.push_back(MakeValue(constant));
+                }
+                _expressions.push_back(record);
+                return it->second;
+            }
+
+            void AddContext(const KeyedMap& properties)
+            {
+                ContextUpdates updates = ContextUtils::CompileUpdates(properties);
+                _contexts.push_back({static_cast<uint32_t>(_storylets.size()), AddUpdates(updates), static_cast<uint32_t>(updates.size())});
+            }
+
+            void AddStorylet(const std::string& id, int redraw, const std::shared_ptr<const CompiledExpression>& condition, int priority,
+                const std::shared_ptr<const CompiledExpression>& priorityExpression, const std::unordered_map<std::string, ContextUpdates>& outcomes, const std::any& content)
+            {
+                StoryletRecord record{};
+                record.id = AddString(id);
+                record.redraw = redraw;
+                record.condition = AddExpression(condition);
+                record.priority = priority;
+                record.priorityExpression = AddExpression(priorityExpression);
+                record.firstOutcome = static_cast<uint32_t>(_outcomes.size());
+                record.outcomeCount = static_cast<uint32_t>(outcomes.size());
+                for (const auto& [name, updates] : outcomes)
+                {
+                    _outcomes.push_back({AddString(name), AddUpdates(updates), static_cast<uint32_t>(updates.size())});
+                }
+                if (content.has_value())
+                {
+                    std::vector<uint8_t> packed = nlohmann::json::to_msgpack(ExtractJsonFromAny(content));
+                    record.contentOffset = _content.size();
+                    record.contentSize = packed.size();
+                    _content.insert(_content.end(), packed.begin(), packed.end());
+                }
+                _storylets.push_back(record);
+            }
+
+            void Write(std::ostream& output) const
+            {
+                std::span<const uint8_t> sections[SECTION_COUNT] = { AsBytes(_strings), AsBytes(_stringData), AsBytes(_expressions), AsBytes(_code),
+                    AsBytes(_constants), AsBytes(_storylets), AsBytes(_outcomes), AsBytes(_updates), AsBytes(_contexts), AsBytes(_content) };
+
+                Header header{};
+                std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+                header.version = DeckImage::VERSION;
+                header.sectionCount = SECTION_COUNT;
+                uint64_t offset = sizeof(Header);
+                for (uint32_t i = 0; i < SECTION_COUNT; i++)
+                {
+                    header.sections[i] = {offset, sections[i].size() / ENTRY_SIZES[i]};
+                    offset += Aligned(sections[i].size());
+                }
+
+                const char padding[8] = {};
+                output.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+                for (const auto& section : sections)
+                {
+                    output.write(reinterpret_cast<const char*>(section.data()), section.size());
+                    output.write(padding, Aligned(section.size()) - section.size());
+                }
+                if (!output)
+                {
+                    throw std::runtime_error("Failed to write deck image.");
+                }
+            }
+
+        private:
+            template<typename T>
+            static std::span<const uint8_t> AsBytes(const std::vector<T>& records)
+            {
+                return {reinterpret_cast<const uint8_t*>(records.data()), records.size() * sizeof(T)};
+            }
+
+            static uint64_t Aligned(uint64_t size) { return (size + 7) & ~uint64_t(7); }
+
+            ValueRecord MakeValue(const Value& value)
+            {
+                ValueRecord record{};
+                record.type = static_cast<uint32_t>(value.GetType());
+                record.string = value.IsString() ? AddString(value.GetString()) : NONE;
+                record.number = value.IsBool() ? (value.GetBool() ? 1 : 0) : value.IsNumeric() ? value.GetNumber() : 0;
+                return record;
+            }
+
+            uint32_t AddUpdates(const ContextUpdates& updates)
+            {
+                uint32_t first = static_cast<uint32_t>(_updates.size());
+                for (const ContextUpdate& update : updates)
+                {
+                    UpdateRecord record{};
+                    record.name = AddString(update.name);
+                    record.expression = AddExpression(update.expression);
+                    record.text = AddString(update.text);
+                    record.value = MakeValue(update.value);
+                    _updates.push_back(record);
+                }
+                return first;
+            }
+
+            std::vector<StringRecord> _strings;
+            std::vector<uint8_t> _stringData;
+            std::unordered_map<std::string, uint32_t> _stringIds;
+            std::vector<ExpressionRecord> _expressions;
+            std::unordered_map<std::shared_ptr<const CompiledExpression>, uint32_t> _expressionIds;
+            std::vector<InstructionRecord> _code;
+            std::vector<ValueRecord> _constants;
+            std::vector<StoryletRecord> _storylets;
+            std::vector<OutcomeRecord> _outcomes;
+            std::vector<UpdateRecord> _updates;
+            std::vector<ContextRecord> _contexts;
+            std::vector<uint8_t> _content;
+        };
+    }
+
+    std::shared_ptr<const DeckImage> DeckImage::Open(const std::string& path)
+    {
+        std::shared_ptr<DeckImage> image(new DeckImage());
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        if (!file.is_open())
+        {
+            throw std::runtime_error("Failed to open deck image: " + path);
+        }
+        image->_bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        image->_data = image->_bytes.data();
+        image->_size = image->_bytes.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Failed to open deck image: " + path);
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(Header))
+        {
+            close(fd);
+            throw std::runtime_error("Not a deck image: " + path);
+        }
+        void* mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map deck image: " + path);
+        }
+        image->_mapping = mapping;
+        image->_data = static_cast<const uint8_t*>(mapping);
+        image->_size = status.st_size;
+#endif
+        image->Validate();
+        return image;
+    }
+
+    std::shared_ptr<const DeckImage> DeckImage::FromBytes(std::vector<uint8_t> bytes)
+    {
+        std::shared_ptr<DeckImage> image(new DeckImage());
+        image->_bytes = std::move(bytes);
+        image->_data = image->_bytes.data();
+        image->_size = image->_bytes.size();
+        image->Validate();
+        return image;
+    }
+
+    DeckImage::~DeckImage()
+    {
+#if !defined(_WIN32)
+        if (_mapping)
+        {
+            munmap(_mapping, _size);
+        }
+#endif
+    }
+
+    void DeckImage::Validate()
+    {
+        if (std::endian::native != std::endian::little)
+        {
+            throw std::runtime_error("Deck images can only be read on little-endian machines.");
+        }
+        Header header;
+        if (_size < sizeof(Header) || std::memcmp(_data, MAGIC, sizeof(MAGIC)) != 0)
+        {
+            throw std::runtime_error("Not a deck image.");
+        }
+        std::memcpy(&header, _data, sizeof(Header));
+        if (header.version != VERSION)
+        {
+            throw std::runtime_error("Deck image is version " + std::to_string(header.version) + "; expected version " + std::to_string(VERSION) + ".");
+        }
+        CheckImage(header.sectionCount == SECTION_COUNT, "it has the wrong number of sections");
+        for (uint32_t i = 0; i < SECTION_COUNT; i++)
+        {
+            const SectionRecord& section = header.sections[i];
+            CheckImage(section.offset % 8 == 0 && section.offset <= _size && section.count <= (_size - section.offset) / ENTRY_SIZES[i], "a section is out of range");
+        }
+    }
+
+    void DeckImage::Compile(const std::vector<nlohmann::json>& packets, std::ostream& output)
+    {
+        ImageWriter writer;
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            std::vector<PacketItem> items;
+            try
+            {
+                items = _collectPacketFromJson(packets[i], nlohmann::json::object());
+            }
+            catch (const std::exception& e)
+            {
+                throw std::runtime_error("Packet " + std::to_string(i) + ": " + e.what());
+            }
+
+            for (const PacketItem& item : items)
+            {
+                if (item.context)
+                {
+                    writer.AddContext(*item.context);
+                    continue;
+                }
+                Storylet& storylet = *item.storylet;
+                if (!storylet._outcomesCompiled)
+                {
+                    storylet.CompileOutcomes();
+                }
+                writer.AddStorylet(storylet.id, storylet._redraw, storylet._condition, storylet._priority,
+                    storylet._priorityExpression, storylet._outcomeUpdates, storylet.content);
+            }
+        }
+        writer.Write(output);
+    }
+
+    void DeckImage::ReadInto(Deck& deck, TraceSink* trace) const
+    {
+        ImageReader reader(GetBytes());
+
+        // Names are interned as they're first needed
+        std::vector<SymbolId> symbols(reader.Count(Strings), SymbolTable::None);
+        auto symbol = [&](uint32_t string) {
+            std::string_view name = reader.String(string);
+            if (symbols[string] == SymbolTable::None)
+            {
+                symbols[string] = SymbolTable::Intern(name);
+            }
+            return symbols[string];
+        };
+
+        // Each distinct expression is rebuilt once, from its bytecode, and shared
+        std::vector<std::shared_ptr<const CompiledExpression>> expressions(reader.Count(Expressions));
+        std::vector<Instruction> code;
+        std::vector<Value> constants;
+        for (size_t i = 0; i < expressions.size(); i++)
+        {
+            ExpressionRecord record = reader.Get<ExpressionRecord>(Expressions, i);
+            code.clear();
+            constants.clear();
+            for (size_t j = 0; j < record.instructionCount; j++)
+            {
+                InstructionRecord ins = reader.Get<InstructionRecord>(Code, size_t(record.firstInstruction) + j);
+                CheckImage(ins.op <= static_cast<uint8_t>(OpCode::Not), "an instruction is unknown");
+                OpCode op = static_cast<OpCode>(ins.op);
+                uint32_t operand = (op == OpCode::LoadVar || op == OpCode::Call) ? symbol(ins.operand) : ins.operand;
+                code.push_back({op, ins.count, operand});
+            }
+            for (size_t j = 0; j < record.constantCount; j++)
+            {
+                constants.push_back(reader.ReadValue(reader.Get<ValueRecord>(Constants, size_t(record.firstConstant) + j)));
+            }
+            try
+            {
+                expressions[i] = std::make_shared<const CompiledExpression>(ExpressionParser::Compiler::Decompile(code, constants, record.specificity));
+            }
+            catch (const std::runtime_error& e)
+            {
+                CheckImage(false, e.what());
+            }
+        }
+        auto expression = [&](uint32_t index) -> std::shared_ptr<const CompiledExpression> {
+            if (index == NONE)
+            {
+                return nullptr;
+            }
+            CheckImage(index < expressions.size(), "an expression is out of range");
+            return expressions[index];
+        };
+
+        // Updates are also kept as the KeyedMap they were compiled from, for outcomes
+        auto readUpdates = [&](uint32_t first, uint32_t count, KeyedMap* properties) {
+            ContextUpdates updates;
+            updates.reserve(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                UpdateRecord record = reader.Get<UpdateRecord>(Updates, size_t(first) + i);
+                ContextUpdate update;
+                update.name = reader.String(record.name);
+                update.slot = symbol(record.name);
+                update.expression = expression(record.expression);
+                update.text = reader.String(record.text);
+                if (!update.expression)
+                {
+                    update.value = reader.ReadValue(record.value);
+                }
+                if (properties)
+                {
+                    (*properties)[update.name] = update.expression ? std::any(update.text) : update.value.ToAny();
+                }
+                updates.push_back(std::move(update));
+            }
+            return updates;
+        };
+
+        size_t contextBlock = 0;
+        auto initContext = [&](size_t beforeStorylet) {
+            for (; contextBlock < reader.Count(ContextBlocks); contextBlock++)
+            {
+                ContextRecord record = reader.Get<ContextRecord>(ContextBlocks, contextBlock);
+                if (record.beforeStorylet > beforeStorylet)
+                {
+                    break;
+                }
+                ContextUtils::InitContext(*deck.context, readUpdates(record.firstUpdate, record.updateCount, nullptr), trace);
+            }
+        };
+
+        std::shared_ptr<const DeckImage> self = shared_from_this();
+        for (size_t i = 0; i < reader.Count(Storylets); i++)
+        {
+            initContext(i);
+
+            StoryletRecord record = reader.Get<StoryletRecord>(Storylets, i);
+            auto storylet = std::make_shared<Storylet>(std::string(reader.String(record.id)));
+            storylet->SetRedraw(record.redraw);
+            storylet->_condition = expression(record.condition);
+            storylet->_specificity = storylet->_condition ? storylet->_condition->GetSpecificity() : 0;
+            storylet->_priority = record.priority;
+            storylet->_priorityExpression = expression(record.priorityExpression);
+            for (size_t j = 0; j < record.outcomeCount; j++)
+            {
+                OutcomeRecord outcome = reader.Get<OutcomeRecord>(Outcomes, size_t(record.firstOutcome) + j);
+                std::string name(reader.String(outcome.name));
+                KeyedMap properties;
+                storylet->_outcomeUpdates[name] = readUpdates(outcome.firstUpdate, outcome.updateCount, &properties);
+                storylet->_outcomes[name] = std::move(properties);
+            }
+            storylet->_outcomesCompiled = true;
+            if (record.contentSize > 0)
+            {
+                storylet->content = MappedJson{self, reader.Bytes(Content, record.contentOffset, record.contentSize)};
+            }
+
+            deck.AddStorylet(storylet);
+            if (TracingEnabled && trace)
+                trace->Record(ExpressionParser::TraceEvent::Note("Added storylet '%'", {storylet->id}));
+        }
+        initContext(NONE);
+    }
+
+    std::shared_ptr<Deck> DeckFromImage(const DeckImage& image, Context* context, TraceSink* trace)
+    {
+        std::shared_ptr<Deck> deck = context ? std::make_shared<Deck>(*context) : std::make_shared<Deck>();
+        image.ReadInto(*deck, trace);
+        return deck;
+    }
+
+    std::shared_ptr<Deck> DeckFromImageFile(const std::string& path, Context* context, TraceSink* trace)
+    {
+        return DeckFromImage(*DeckImage::Open(path), context, trace);
+    }
+}
@@ -1,104 +1,521 @@
 #include "storylet_framework/json_loader.h"
+#include <fstream>
+#include <sstream>
 
 namespace StoryletFramework
 {
+    namespace
+    {
+        // A storylet's own value for a property if it has one, or else the default
+        const nlohmann::json* FindProperty(const nlohmann::json& json, const nlohmann::json& defaults, const char* key)
+        {
+            auto it = json.find(key);
+            if (it != json.end())
+                return &*it;
+            it = defaults.find(key);
+            return (it != defaults.end()) ? &*it : nullptr;
+        }
+
+        std::shared_ptr<Storylet> BuildStorylet(const nlohmann::json& json, const nlohmann::json& defaults, bool packContent)
+        {
+            if (!json.contains("id"))
+            {
+                throw std::invalid_argument("No 'id' property in the storylet JSON.");
+            }
+
+            std::shared_ptr<Storylet> storylet = std::make_shared<Storylet>(json["id"].get<std::string>());
+
+            if (const nlohmann::json* val = FindProperty(json, defaults, "redraw"))
+            {
+                if (*val == "always")
+                    storylet->SetRedraw(REDRAW_ALWAYS);
+                else if (*val == "never")
+                    storylet->SetRedraw(REDRAW_NEVER);
+                else
+                    storylet->SetRedraw(val->get<int>());
+            }
+
+            if (const nlohmann::json* val = FindProperty(json, defaults, "condition"))
+            {
+                storylet->SetCondition(val->get<std::string>());
+            }
+
+            if (const nlohmann::json* val = FindProperty(json, defaults, "priority"))
+            {
+                if (val->is_number_integer())
+                    storylet->SetPriority(val->get<int>());
+                else if (val->is_number_float())
+                    storylet->SetPriority(static_cast<int>(val->get<double>()));
+                else if (val->is_string())
+                    storylet->SetPriority(val->get<std::string>());
+            }
+
+            if (const nlohmann::json* val = FindProperty(json, defaults, "outcomes"))
+            {
+                storylet->SetOutcomes(JsonToKeyedMap(*val));
+                storylet->CompileOutcomes();
+            }
+            if (const nlohmann::json* val = FindProperty(json, defaults, "content"))
+            {
+                if (packContent)
+                    storylet->content = PackedJson{nlohmann::json::to_msgpack(*val)};
+                else
+                    storylet->content = *val;
+            }
+            return storylet;
+        }
+    }
+
     // Parse a Storylet from JSON-like data
     std::shared_ptr<Storylet> StoryletFromJson(const nlohmann::json& json, const nlohmann::json& defaults)
     {
-        if (!json.contains("id"))
+        return BuildStorylet(json, defaults, false);
+    }
+
+    namespace
+    {
+        // Packets are collected into PacketItems first, which doesn't touch the deck, then committed in order
+        void CollectStorylets(const nlohmann::json& json, const nlohmann::json& defaults, std::vector<PacketItem>& items);
+
+        void CollectPacket(const nlohmann::json& json, nlohmann::json defaults, std::vector<PacketItem>& items)
         {
-            throw std::invalid_argument("No 'id' property in the storylet JSON.");
-        }
+            if (json.contains("context"))
+            {
+                items.push_back({std::make_unique<KeyedMap>(json["context"].get<KeyedMap>()), nullptr});
+            }
 
-        nlohmann::json config = nlohmann::json::object();
-        config.update(defaults);
-        config.update(json);
+            if (json.contains("defaults"))
+            {
+                defaults.update(json["defaults"]);
+            }
 
-        std::shared_ptr<Storylet> storylet = std::make_shared<Storylet>(config["id"].get<std::string>());
+            if (json.contains("storylets"))
+            {
+                CollectStorylets(json["storylets"], defaults, items);
+            }
+        }
 
-        if (config.contains("redraw"))
+        void CollectStorylets(const nlohmann::json& json, const nlohmann::json& defaults, std::vector<PacketItem>& items)
         {
-            auto val = config["redraw"];
-            if (val == "always")
-                storylet->redraw = REDRAW_ALWAYS;
-            else if (val == "never")
-                storylet->redraw = REDRAW_NEVER;
-            else
-                storylet->redraw = val.get<int>();
+            for (const auto& item : json)
+            {
+                if (item.contains("storylets") || item.contains("defaults") || item.contains("context"))
+                {
+                    CollectPacket(item, defaults, items);
+                    continue;
+                }
+
+                if (!item.contains("id"))
+                    throw std::invalid_argument("Json item is not a storylet or packet");
+
+                items.push_back({nullptr, StoryletFromJson(item, defaults)});
+            }
         }
 
-        if (config.contains("condition"))
+        void CommitPacket(Deck& deck, const std::vector<PacketItem>& items, TraceSink* trace)
         {
-            storylet->SetCondition(config["condition"].get<std::string>());
+            for (const PacketItem& item : items)
+            {
+                if (item.context)
+                {
+                    ContextUtils::InitContext(*deck.context, *item.context, trace);
+                    continue;
+                }
+
+                deck.AddStorylet(item.storylet);
+
+                if (TracingEnabled && trace)
+                    trace->Record(ExpressionParser::TraceEvent::Note("Added storylet '%'", {item.storylet->id}));
+            }
         }
 
-        if (config.contains("priority"))
+        // Builds one JSON value from SAX events, for the small parts of a stream that are kept
+        class ValueBuilder
         {
-        auto val = config["priority"];
-        if (val.is_number_integer())
-            storylet->SetPriority(val.get<int>());
-        else if (val.is_number_float())
-            storylet->SetPriority(static_cast<int>(val.get<double>()));
-        else if (val.is_string())
-            storylet->SetPriority(val.get<std::string>());
+        public:
+            void Begin(nlohmann::json& target)
+            {
+                _target = &target;
+                _stack.clear();
+            }
+
+            // Each returns true once the whole value has been read
+            bool Add(nlohmann::json value)
+            {
+                if (_stack.empty())
+                {
+                    *_target = std::move(value);
+                    return true;
+                }
+                nlohmann::json& parent = *_stack.back();
+                if (parent.is_array())
+                    parent.push_back(std::move(value));
+                else
+                    parent[_key] = std::move(value);
+                return false;
+            }
+
+            bool Open(nlohmann::json container)
+            {
+                if (_stack.empty())
+                {
+                    *_target = std::move(container);
+                    _stack.push_back(_target);
+                    return false;
+                }
+                nlohmann::json& parent = *_stack.back();
+                if (parent.is_array())
+                {
+                    parent.push_back(std::move(container));
+                    _stack.push_back(&parent.back());
+                }
+                else
+                {
+                    _stack.push_back(&(parent[_key] = std::move(container)));
+                }
+                return false;
+            }
+
+            bool Close()
+            {
+                _stack.pop_back();
+                return _stack.empty();
+            }
+
+            void Key(std::string key) { _key = std::move(key); }
+
+        private:
+            nlohmann::json* _target = nullptr;
+            std::vector<nlohmann::json*> _stack;
+            std::string _key;
+        };
+
+        // Reads a packet as a stream of SAX events, adding context and storylets to the deck as
+        // each one ends. Storylets' own properties are gathered until the storylet ends, and
+        // defaults are copied only when a packet sets some of its own.
+        class PacketReader
+        {
+        public:
+            using json = nlohmann::json;
+
+            PacketReader(Deck& deck, TraceSink* trace) : _deck(deck), _trace(trace)
+            {
+                _defaults.push_back(json::object());
+            }
+
+            bool null() { return Value(nullptr); }
+            bool boolean(bool val) { return Value(val); }
+            bool number_integer(json::number_integer_t val) { return Value(val); }
+            bool number_unsigned(json::number_unsigned_t val) { return Value(val); }
+            bool number_float(json::number_float_t val, const json::string_t&) { return Value(val); }
+            bool string(json::string_t& val) { return Value(std::move(val)); }
+            bool binary(json::binary_t& val) { return Value(json::binary(std::move(val))); }
+
+            bool start_object(std::size_t)
+            {
+                if (_building)
+                    return Built(_value.Open(json::object()));
+
+                if (_levels.empty())
+                {
+                    _levels.push_back({Level::Kind::Packet});
+                    return true;
+                }
+                if (_levels.back().kind == Level::Kind::Storylets)
+                {
+                    _levels.push_back({Level::Kind::Item});
+                    _levels.back().fields = json::object();
+                    return true;
+                }
+                if (_pending == Pending::Storylets)
+                    throw std::invalid_argument("'storylets' should be an array.");
+                return BeginValue(json::object());
+            }
+
+            bool key(json::string_t& key)
+            {
+                if (_building)
+                {
+                    _value.Key(std::move(key));
+                    return true;
+                }
+
+                Level& level = _levels.back();
+                bool packetKey = (key == "context" || key == "defaults" || key == "storylets");
+                if (level.kind == Level::Kind::Item && packetKey)
+                    level.isPacket = true;
+
+                if (level.kind == Level::Kind::Item && !level.isPacket)
+                {
+                    _pending = Pending::Field;
+                    _key = std::move(key);
+                    return true;
+                }
+                if ((key == "context" || key == "defaults") && level.readStorylets)
+                    throw std::invalid_argument("'" + key + "' has to come before 'storylets' in a packet that's streamed.");
+
+                _pending = (key == "context") ? Pending::Context : (key == "defaults") ? Pending::Defaults : (key == "storylets") ? Pending::Storylets : Pending::Skip;
+                return true;
+            }
+
+            bool end_object()
+            {
+                if (_building)
+                    return Built(_value.Close());
+
+                Level level = std::move(_levels.back());
+                _levels.pop_back();
+                if (level.ownDefaults)
+                    _defaults.pop_back();
+                if (level.kind == Level::Kind::Item && !level.isPacket)
+                {
+                    if (!level.fields.contains("id"))
+                        throw std::invalid_argument("Json item is not a storylet or packet");
+                    AddStorylet(BuildStorylet(level.fields, _defaults.back(), true));
+                }
+                return true;
+            }
+
+            bool start_array(std::size_t)
+            {
+                if (_building)
+                    return Built(_value.Open(json::array()));
+
+                if (_levels.empty())
+                    throw std::invalid_argument("A packet should be an object.");
+                if (_pending == Pending::Storylets)
+                {
+                    _pending = Pending::None;
+                    _levels.back().readStorylets = true;
+                    _levels.push_back({Level::Kind::Storylets});
+                    return true;
+                }
+                if (_levels.back().kind == Level::Kind::Storylets)
+                    throw std::invalid_argument("Json item is not a storylet or packet");
+                return BeginValue(json::array());
+            }
+
+            bool end_array()
+            {
+                if (_building)
+                    return Built(_value.Close());
+
+                _levels.pop_back();
+                return true;
+            }
+
+            bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex)
+            {
+                throw std::runtime_error(ex.what());
+            }
+
+        private:
+            struct Level
+            {
+                enum class Kind { Packet, Storylets, Item } kind;
+                bool isPacket = false;          // For items with any of a packet's properties
+                bool readStorylets = false;
+                bool ownDefaults = false;       // Whether it pushed onto _defaults
+                json fields = nullptr;          // An item's properties, until it ends
+            };
+
+            // Where the value for the last key goes
+            enum class Pending { None, Context, Defaults, Storylets, Field, Skip };
+
+            bool Value(json value)
+            {
+                if (_building)
+                    return Built(_value.Add(std::move(value)));
+                if (_levels.empty())
+                    throw std::invalid_argument("A packet should be an object.");
+                if (_levels.back().kind == Level::Kind::Storylets)
+                    throw std::invalid_argument("Json item is not a storylet or packet");
+                if (_pending == Pending::Storylets)
+                    throw std::invalid_argument("'storylets' should be an array.");
+
+                _building = true;
+                _value.Begin(_built);
+                return Built(_value.Add(std::move(value)));
+            }
+
+            bool BeginValue(json container)
+            {
+                _building = true;
+                _value.Begin(_built);
+                return Built(_value.Open(std::move(container)));
+            }
+
+            // Called after each event while building, with whether the value is complete
+            bool Built(bool complete)
+            {
+                if (!complete)
+                    return true;
+
+                _building = false;
+                Pending pending = std::exchange(_pending, Pending::None);
+                Level& level = _levels.back();
+                switch (pending)
+                {
+                    case Pending::Context:
+                        ContextUtils::InitContext(*_deck.context, _built.get<KeyedMap>(), _trace);
+                        break;
+                    case Pending::Defaults:
+                        if (!level.ownDefaults)
+                        {
+                            _defaults.push_back(_defaults.back());
+                            level.ownDefaults = true;
+                        }
+                        _defaults.back().update(_built);
+                        break;
+                    case Pending::Field:
+                        level.fields[_key] = std::move(_built);
+                        break;
+                    default:
+                        break;
+                }
+                _built = nullptr;
+                return true;
+            }
+
+            void AddStorylet(std::shared_ptr<Storylet> storylet)
+            {
+                _deck.AddStorylet(storylet);
+                if (TracingEnabled && _trace)
+                    _trace->Record(ExpressionParser::TraceEvent::Note("Added storylet '%'", {storylet->id}));
+            }
+
+            Deck& _deck;
+            TraceSink* _trace;
+            std::vector<Level> _levels;
+            std::vector<json> _defaults;    // The defaults in effect at each packet that set some
+            Pending _pending = Pending::None;
+            std::string _key;
+            bool _building = false;
+            ValueBuilder _value;
+            json _built;
+        };
+
+        std::string ReadFile(const std::string& path)
+        {
+            std::ifstream file(path, std::ios::in | std::ios::binary);
+            if (!file.is_open())
+            {
+                throw std::runtime_error("Failed to open deck file: " + path);
+            }
+            std::ostringstream text;
+            text << file.rdbuf();
+            return text.str();
         }
 
-        if (config.contains("outcomes"))
+        // Get each source's text, parse it and collect its packet, across the executor if there
+        // is one. Errors name the source, and are the ones loading them in turn would raise first.
+        std::vector<std::vector<PacketItem>> CollectPackets(size_t count, const std::function<std::string(size_t)>& text,
+            const std::function<std::string(size_t)>& name, Executor* executor)
         {
-            storylet->outcomes = JsonToKeyedMap(config["outcomes"]);
+            std::vector<std::vector<PacketItem>> packets(count);
+            auto collect = [&](size_t i) {
+                try
+                {
+                    nlohmann::json json = nlohmann::json::parse(text(i), nullptr, true, true);
+                    CollectPacket(json, nlohmann::json::object(), packets[i]);
+                }
+                catch (const std::exception& e)
+                {
+                    throw std::runtime_error(name(i) + ": " + e.what());
+                }
+            };
+
+            if (executor)
+            {
+                executor->ParallelFor(count, collect);
+            }
+            else
+            {
+                for (size_t i = 0; i < count; i++)
+                    collect(i);
+            }
+            return packets;
         }
-        if (config.contains("content"))
+
+        std::shared_ptr<Deck> MakeDeck(Context* context)
         {
-            storylet->content = config["content"];
+            return context ? std::make_shared<Deck>(*context) : std::make_shared<Deck>();
         }
-        return storylet;
     }
 
-    std::shared_ptr<Deck> DeckFromJson(const nlohmann::json& json, Context* context, DumpEval* dumpEval)
+    std::shared_ptr<Deck> DeckFromJson(const nlohmann::json& json, Context* context, TraceSink* trace)
     {
-        std::shared_ptr<Deck> deck = std::make_shared<Deck>(*context);
-        _readPacketFromJson(*deck, json, nlohmann::json::object(), dumpEval);
+        std::shared_ptr<Deck> deck = MakeDeck(context);
+        _readPacketFromJson(*deck, json, nlohmann::json::object(), trace);
         return deck;
     }
 
-    void _readPacketFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, DumpEval* dumpEval)
+    std::shared_ptr<Deck> DeckFromJsonFiles(const std::vector<std::string>& paths, Context* context, Executor* executor, TraceSink* trace)
     {
-        if (json.contains("context"))
+        std::shared_ptr<Deck> deck = MakeDeck(context);
+        auto packets = CollectPackets(paths.size(), [&](size_t i) { return ReadFile(paths[i]); }, [&](size_t i) { return paths[i]; }, executor);
+        for (const auto& packet : packets)
         {
-            ContextUtils::InitContext(*deck.context, json["context"], dumpEval);
+            CommitPacket(*deck, packet, trace);
         }
+        return deck;
+    }
 
-        if (json.contains("defaults"))
+    std::shared_ptr<Deck> DeckFromJsonTexts(const std::vector<std::string>& texts, Context* context, Executor* executor, TraceSink* trace)
+    {
+        std::shared_ptr<Deck> deck = MakeDeck(context);
+        auto packets = CollectPackets(texts.size(), [&](size_t i) { return texts[i]; }, [](size_t i) { return "Packet " + std::to_string(i); }, executor);
+        for (const auto& packet : packets)
         {
-            defaults.update(json["defaults"]);
+            CommitPacket(*deck, packet, trace);
         }
+        return deck;
+    }
 
-        if (json.contains("storylets"))
+    std::vector<std::shared_ptr<Deck>> DecksFromJsonFiles(const std::vector<std::string>& paths, Context* context, Executor* executor, TraceSink* trace)
+    {
+        auto packets = CollectPackets(paths.size(), [&](size_t i) { return ReadFile(paths[i]); }, [&](size_t i) { return paths[i]; }, executor);
+        std::vector<std::shared_ptr<Deck>> decks;
+        for (const auto& packet : packets)
         {
-            _readStoryletsFromJson(deck, json["storylets"], defaults, dumpEval);
+            decks.push_back(MakeDeck(context));
+            CommitPacket(*decks.back(), packet, trace);
         }
+        return decks;
     }
 
-    void _readStoryletsFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, DumpEval* dumpEval)
+    std::shared_ptr<Deck> DeckFromJsonStream(std::istream& input, Context* context, TraceSink* trace)
     {
-        for (const auto& item : json)
-        {
-            if (item.contains("storylets") || item.contains("defaults") || item.contains("context"))
-            {
-                _readPacketFromJson(deck, item, defaults, dumpEval);
-                continue;
-            }
+        std::shared_ptr<Deck> deck = MakeDeck(context);
+        ReadPacketFromJsonStream(*deck, input, trace);
+        return deck;
+    }
 
-            if (!item.contains("id"))
-                throw std::invalid_argument("Json item is not a storylet or packet");
+    void ReadPacketFromJsonStream(Deck& deck, std::istream& input, TraceSink* trace)
+    {
+        PacketReader reader(deck, trace);
+        nlohmann::json::sax_parse(input, &reader, nlohmann::json::input_format_t::json, true, true);
+    }
 
-            std::shared_ptr<Storylet> storylet = StoryletFromJson(item, defaults);
-            deck.AddStorylet(storylet);
+    void _readPacketFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, TraceSink* trace)
+    {
+        std::vector<PacketItem> items;
+        CollectPacket(json, std::move(defaults), items);
+        CommitPacket(deck, items, trace);
+    }
 
-            if (dumpEval)
-                dumpEval->push_back("Added storylet '" + storylet->id + "'");
-            
-        }
+    void _readStoryletsFromJson(Deck& deck, const nlohmann::json& json, nlohmann::json defaults, TraceSink* trace)
+    {
+        std::vector<PacketItem> items;
+        CollectStorylets(json, defaults, items);
+        CommitPacket(deck, items, trace);
+    }
+
+    std::vector<PacketItem> _collectPacketFromJson(const nlohmann::json& json, nlohmann::json defaults)
+    {
+        std::vector<PacketItem> items;
+        CollectPacket(json, std::move(defaults), items);
+        return items;
     }
 
     nlohmann::json ExtractJsonFromAny(const std::any& value)
@@ -107,6 +524,15 @@ namespace StoryletFramework
         {
             return std::any_cast<nlohmann::json>(value);
         }
+        else if (value.type() == typeid(PackedJson))
+        {
+            return nlohmann::json::from_msgpack(std::any_cast<const PackedJson&>(value).bytes);
+        }
+        else if (value.type() == typeid(MappedJson))
+        {
+            std::span<const uint8_t> bytes = std::any_cast<const MappedJson&>(value).bytes;
+            return nlohmann::json::from_msgpack(bytes.begin(), bytes.end());
+        }
         else
         {
             throw std::runtime_error("Value is not of type nlohmann::json");
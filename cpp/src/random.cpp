@@ -0,0 +1,115 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "storylet_framework/random.h"
+#include <random>
+#include <stdexcept>
+
+namespace StoryletFramework
+{
+    static const char* XOSHIRO_TYPE = "xoshiro256**";
+
+    static uint64_t RotateLeft(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    // Expands a single seed into well-mixed state, as recommended for xoshiro
+    static uint64_t SplitMix64(uint64_t& x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t RandomSource::Below(uint64_t bound)
+    {
+        if (bound == 0)
+        {
+            throw std::invalid_argument("Random bound must be greater than zero.");
+        }
+
+        // Reject the low values that would make the modulo biased
+        uint64_t threshold = (0 - bound) % bound;
+        while (true)
+        {
+            uint64_t value = (*this)();
+            if (value >= threshold)
+            {
+                return value % bound;
+            }
+        }
+    }
+
+    Xoshiro256::Xoshiro256()
+    {
+        std::random_device device;
+        Seed((static_cast<uint64_t>(device()) << 32) | device());
+    }
+
+    Xoshiro256::Xoshiro256(uint64_t seed)
+    {
+        Seed(seed);
+    }
+
+    RandomSource::result_type Xoshiro256::operator()()
+    {
+        uint64_t result = RotateLeft(_state[1] * 5, 7) * 9;
+        uint64_t t = _state[1] << 17;
+
+        _state[2] ^= _state[0];
+        _state[3] ^= _state[1];
+        _state[1] ^= _state[2];
+        _state[0] ^= _state[3];
+        _state[2] ^= t;
+        _state[3] = RotateLeft(_state[3], 45);
+
+        return result;
+    }
+
+    void Xoshiro256::Seed(uint64_t seed)
+    {
+        for (uint64_t& word : _state)
+        {
+            word = SplitMix64(seed);
+        }
+    }
+
+    // State words are saved as hex strings, as many JSON readers can't hold 64 bit integers
+    nlohmann::json Xoshiro256::SaveState() const
+    {
+        nlohmann::json words = nlohmann::json::array();
+        for (uint64_t word : _state)
+        {
+            std::ostringstream output;
+            output << std::hex << word;
+            words.push_back(output.str());
+        }
+        return {
+            {"type", XOSHIRO_TYPE},
+            {"state", words}
+        };
+    }
+
+    void Xoshiro256::LoadState(const nlohmann::json& state)
+    {
+        if (state.at("type") != XOSHIRO_TYPE)
+        {
+            throw std::invalid_argument("Saved random state is not for " + std::string(XOSHIRO_TYPE) + ".");
+        }
+
+        const auto& words = state.at("state");
+        if (!words.is_array() || words.size() != 4)
+        {
+            throw std::invalid_argument("Saved random state should have 4 words.");
+        }
+
+        for (size_t i = 0; i < 4; i++)
+        {
+            _state[i] = std::stoull(words[i].get<std::string>(), nullptr, 16);
+        }
+    }
+}
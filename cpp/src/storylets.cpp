@@ -6,12 +6,99 @@
  #include "storylet_framework/context.h"
  #include "storylet_framework/storylets.h"
   #include "storylet_framework/utils.h"
+ #include "expression_parser/expression_cache.h"
  #include <stdexcept>
  #include <iostream>
  
  namespace StoryletFramework
  {
-    static ExpressionParser::Parser expressionParser;
+     // Evaluate a condition, skipping the evaluation if it folded to a constant
+     static bool EvalCondition(const ExpressionParser::CompiledExpression& condition, const Storylet& storylet, const Context& context, TraceSink* trace)
+     {
+         if (condition.IsConstant())
+         {
+             bool result = ExpressionParser::Utils::MakeBool(condition.GetConstant());
+             if (TracingEnabled && trace)
+             {
+                 trace->Record(ExpressionParser::TraceEvent::Note("Condition for % is always %", {storylet.id, result}));
+             }
+             return result;
+         }
+ 
+         if (TracingEnabled && trace)
+         {
+             trace->Record(ExpressionParser::TraceEvent::Note("Evaluating condition for %", {storylet.id}));
+         }
+ 
+         ExpressionParser::Value result = condition.Evaluate(context, trace);
+         return ExpressionParser::Utils::MakeBool(result);
+     }
+
+     // Evaluate a priority expression
+     static int EvalPriority(const ExpressionParser::CompiledExpression& expression, int specificity, bool useSpecificity, const Storylet& storylet, const Context& context, TraceSink* trace)
+     {
+         if (TracingEnabled && trace)
+         {
+             trace->Record(ExpressionParser::TraceEvent::Note("Evaluating priority for %", {storylet.id}));
+         }
+         ExpressionParser::Value result = expression.Evaluate(context, trace);
+         int workingPriority = ExpressionParser::Utils::MakeNumeric(result);
+
+         if (useSpecificity)
+         {
+             workingPriority = workingPriority * 100 + specificity;
+         }
+
+         return workingPriority;
+     }
+
+     // Attaches a deck's call memo to the context for the length of a draw, unless the
+     // context already has one, and forgets the results afterwards
+     class DrawCallMemo
+     {
+     public:
+         DrawCallMemo(Context& context, ExpressionParser::CallMemo& memo) : _context(context)
+         {
+             if (!context.GetCallMemo())
+             {
+                 _memo = &memo;
+                 context.SetCallMemo(_memo);
+             }
+         }
+
+         ~DrawCallMemo()
+         {
+             if (_memo)
+             {
+                 _context.SetCallMemo(nullptr);
+                 _memo->Clear();
+             }
+         }
+
+     private:
+         Context& _context;
+         ExpressionParser::CallMemo* _memo = nullptr;
+     };
+
+     // Detaches the context's call memo for the length of a parallel check, as it isn't
+     // safe to share between threads
+     class SuspendCallMemo
+     {
+     public:
+         explicit SuspendCallMemo(Context& context) : _context(context), _memo(context.GetCallMemo())
+         {
+             context.SetCallMemo(nullptr);
+         }
+
+         ~SuspendCallMemo()
+         {
+             _context.SetCallMemo(_memo);
+         }
+
+     private:
+         Context& _context;
+         ExpressionParser::CallMemo* _memo;
+     };
 
      // Constructor
      Storylet::Storylet(const std::string& id) : id(id) {}
@@ -19,126 +106,148 @@
      // Reset the redraw counter
      void Storylet::Reset()
      {
-         _nextPlay = 0;
+         if (_deck)
+         {
+             _deck->_nextPlay[_handle] = 0;
+             _deck->ScheduleStorylet(_handle);
+         }
+     }
+ 
+     void Storylet::SetRedraw(int redraw)
+     {
+         _redraw = redraw;
+         if (_deck)
+         {
+             _deck->RescheduleStorylet(_handle);
+         }
      }
  
-     // Set condition as a precompiled expression
+     // Set condition as a precompiled expression, shared with any other storylet using the same text
      void Storylet::SetCondition(const std::string& text)
      {
          _condition = nullptr;
+         _specificity = 0;
          if (!text.empty())
          {
-             // Assuming ExpressionParser::Parse is implemented elsewhere
-             _condition = expressionParser.Parse(text);
+             _condition = ExpressionParser::ExpressionCache::Global().Get(text);
+             _specificity = _condition->GetSpecificity();
+         }
+         if (_deck)
+         {
+             _deck->SyncStorylet(_handle);
          }
      }
  
      // Evaluate condition using the current context
-     bool Storylet::CheckCondition(const Context& context, DumpEval* dumpEval) const
+     bool Storylet::CheckCondition(const Context& context, TraceSink* trace) const
      {
-         if (!_condition)
-             return true;
- 
-         if (dumpEval)
-         {
-             dumpEval->push_back("Evaluating condition for " + id);
-         }
- 
-         std::any result = _condition->Evaluate(context, dumpEval);
-         return ExpressionParser::Utils::MakeBool(result);
+         return !_condition || EvalCondition(*_condition, *this, context, trace);
      }
  
      // Set priority to a fixed number
      void Storylet::SetPriority(int num)
      {
         _priority = num;
+        _priorityExpression = nullptr;
+        if (_deck)
+        {
+            _deck->SyncStorylet(_handle);
+        }
      }
 
-    // Set priority to a precompiled expression
+    // Set priority to a precompiled expression. Expressions that fold to a constant become fixed priorities.
     void Storylet::SetPriority(std::string expression)
     {
-        _priority = expression;
+        auto compiled = ExpressionParser::ExpressionCache::Global().Get(expression);
+        if (compiled->IsConstant())
+        {
+            SetPriority(static_cast<int>(ExpressionParser::Utils::MakeNumeric(compiled->GetConstant())));
+            return;
+        }
+        _priority = 0;
+        _priorityExpression = compiled;
+        if (_deck)
+        {
+            _deck->SyncStorylet(_handle);
+        }
     }
  
      // Evaluate priority using the current context
-     int Storylet::CalcCurrentPriority(const Context& context, bool useSpecificity, std::vector<std::string>* dumpEval) const
+     int Storylet::CalcCurrentPriority(const Context& context, bool useSpecificity, TraceSink* trace) const
      {
-         int workingPriority = 0;
- 
-         if (_priority.type() == typeid(int))
-         {
-             workingPriority = std::any_cast<int>(_priority);
-         }
-         else if (_priority.type() == typeid(std::shared_ptr<ExpressionParser::ExpressionNode>))
-         {
-             if (dumpEval)
-             {
-                 dumpEval->push_back("Evaluating priority for " + id);
-             }
-             std::any result = std::any_cast<std::shared_ptr<ExpressionParser::ExpressionNode>>(_priority)->Evaluate(context, dumpEval);
-             workingPriority = ExpressionParser::Utils::MakeNumeric(result);
-         }
- 
-         if (useSpecificity)
+         if (!_priorityExpression)
          {
-             workingPriority *= 100;
-             if (_condition)
-             {
-                 workingPriority += _condition->GetSpecificity();
-             }
+             return GetStaticPriority(useSpecificity);
          }
- 
-         return workingPriority;
+         return EvalPriority(*_priorityExpression, _specificity, useSpecificity, *this, context, trace);
      }
  
      // Check if the storylet is available to draw
      bool Storylet::CanDraw(int currentDraw) const
      {
-         if (redraw == REDRAW_NEVER && _nextPlay < 0)
-             return false;
-         if (redraw == REDRAW_ALWAYS)
-             return true;
-         return currentDraw >= _nextPlay;
+         return !_deck || currentDraw >= _deck->_nextPlay[_handle];
      }
  
-     // Call when actually drawn - updates the redraw counter
-    void Storylet::OnPlayed(int currentDraw, Context& context, const std::string& outcome, DumpEval* dumpEval)
+     // Call when actually played - applies the outcome to the context
+    void Storylet::ApplyOutcome(Context& context, const std::string& outcome, TraceSink* trace)
      {
-        if (redraw == REDRAW_NEVER)
+        if (!_outcomesCompiled)
         {
-            _nextPlay = -1;
+            CompileOutcomes();
         }
-        else
+
+        auto it = _outcomeUpdates.find(outcome);
+        if (it != _outcomeUpdates.end())
         {
-            _nextPlay = currentDraw + redraw;
+            if (TracingEnabled && trace)
+            {
+                trace->Record(ExpressionParser::TraceEvent::Note("Updating context for % with outcome '%'", {id, outcome}));
+            }
+            ContextUtils::ApplyUpdates(context, it->second, trace);
         }
+    }
+
+    void Storylet::SetOutcomes(KeyedMap outcomes)
+    {
+        _outcomes = std::move(outcomes);
+        _outcomesCompiled = false;
+    }
+
+    void Storylet::SetOutcome(const std::string& name, KeyedMap updates)
+    {
+        _outcomes[name] = std::move(updates);
+        _outcomesCompiled = false;
+    }
 
-        if (!outcomes.empty() && outcomes.find(outcome) != outcomes.end())
+    void Storylet::CompileOutcomes()
+    {
+        _outcomeUpdates.clear();
+        for (const auto& [outcome, updates] : _outcomes)
         {
-            const KeyedMap& updates = std::any_cast<const KeyedMap&>(outcomes.at(outcome));
-            if (dumpEval)
+            if (updates.type() != typeid(KeyedMap))
             {
-                dumpEval->push_back("Updating context for " + id + " with outcome '" + outcome + "'");
+                throw std::invalid_argument("Outcome '" + outcome + "' for storylet '" + id + "' must be a set of context updates.");
             }
-            ContextUtils::UpdateContext(context, updates, dumpEval);
+            _outcomeUpdates[outcome] = ContextUtils::CompileUpdates(std::any_cast<const KeyedMap&>(updates));
         }
+        _outcomesCompiled = true;
     }
 
-    void Storylet::Play(const std::string& outcome, DumpEval* dumpEval)
+    void Storylet::Play(const std::string& outcome, TraceSink* trace)
     {
         if (!_deck)
         {
             throw std::runtime_error("Storylet not part of a deck");
             
         }
-        _deck->Play(*this, outcome, dumpEval);
+        _deck->Play(*this, outcome, trace);
     }
 
-    Deck::Deck() {
+    Deck::Deck() : _random(std::make_unique<Xoshiro256>()) {
         this->context = std::make_shared<Context>();
     }
 
-    Deck::Deck(Context& context) {
+    Deck::Deck(Context& context) : _random(std::make_unique<Xoshiro256>()) {
         this->context = std::shared_ptr<Context>(&context, [](Context*) {
             // Do nothing, we don't own the context
         });
@@ -147,81 +256,306 @@
     void Deck::Reset()
     {
         _currentDraw = 0;
-        for (auto& [id, storylet] : _all)
+        std::fill(_nextPlay.begin(), _nextPlay.end(), 0);
+        RebuildSchedule();
+    }
+
+    // Draw storylets in descending priority order, shuffled within each priority.
+    // One pass collects the candidates; if fewer than all are wanted, only the
+    // boundary priority is sampled and only the returned storylets are shuffled.
+    template<typename Check>
+    void Deck::CollectCandidates(size_t count, TraceSink* trace, const Check& check)
+    {
+        if (!_executor || trace || count < 2 * PARALLEL_CHUNK)
         {
-            storylet->Reset();
+            for (size_t i = 0; i < count; i++)
+            {
+                check(i, _candidates);
+            }
+            return;
+        }
+
+        // Each chunk collects its own candidates, appended in order afterwards so the draw is the
+        // same as checking them in turn. The graph and call memo are shared, so are left out.
+        size_t chunks = (count + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+        if (_chunkCandidates.size() < chunks)
+        {
+            _chunkCandidates.resize(chunks);
+        }
+        bool graphPass = std::exchange(_graphPass, false);
+        {
+            SuspendCallMemo noMemo(*context);
+            _executor->ParallelFor(chunks, [&](size_t chunk) {
+                std::vector<DrawCandidate>& candidates = _chunkCandidates[chunk];
+                candidates.clear();
+                size_t end = std::min(count, (chunk + 1) * PARALLEL_CHUNK);
+                for (size_t i = chunk * PARALLEL_CHUNK; i < end; i++)
+                {
+                    check(i, candidates);
+                }
+            });
+        }
+        _graphPass = graphPass;
+
+        for (size_t chunk = 0; chunk < chunks; chunk++)
+        {
+            _candidates.insert(_candidates.end(), _chunkCandidates[chunk].begin(), _chunkCandidates[chunk].end());
         }
     }
 
-    std::vector<std::shared_ptr<Storylet>> Deck::Draw(int count, std::function<bool(const Storylet&)> filter, DumpEval* dumpEval)
+    std::vector<std::shared_ptr<Storylet>> Deck::Draw(int count, std::function<bool(const Storylet&)> filter, TraceSink* trace)
     {
-        std::unordered_map<int, std::vector<std::shared_ptr<Storylet>>> priorityMap;
-        std::vector<std::shared_ptr<Storylet>> toProcess;
+        if (!TracingEnabled)
+        {
+            trace = nullptr; // So draws behave the same as untraced ones when tracing is compiled out
+        }
+        ReleaseCooled();
+        DrawCallMemo callMemo(*context, _callMemo);
+        BeginChecks(trace);
 
-        for (auto& [id, storylet] : _all)
+        // Indexed storylets are found through the index, except when tracing, so the trace is complete
+        bool useIndex = !trace && !_index.Empty();
+
+        _candidates.clear();
+        if (useTieredDraw && count > 0 && !trace)
         {
-            toProcess.push_back(storylet);
+            AddTieredCandidates(count, filter, useIndex);
+            useIndex = false;
+        }
+        else
+        {
+            CollectCandidates(_ready.size(), trace, [&](size_t i, std::vector<DrawCandidate>& candidates) {
+                uint32_t handle = _ready[i];
+                if (!useIndex || !_index.IsIndexed(handle))
+                    AddCandidate(candidates, handle, filter, false, trace);
+            });
         }
 
-        while (toProcess.size() > 0)
+        if (useIndex)
         {
-            std::shared_ptr<Storylet> storylet = toProcess.front();
-            toProcess.erase(toProcess.begin());
+            _matches.clear();
+            _index.Match(*context, _matches);
+            CollectCandidates(_matches.size(), nullptr, [&](size_t i, std::vector<DrawCandidate>& candidates) {
+                const ConditionIndex::IndexMatch& match = _matches[i];
+                if (_schedule[match.handle] == Schedule::Ready)
+                    AddCandidate(candidates, match.handle, filter, match.holds && _index.IsExact(match.handle), nullptr);
+            });
+        }
 
-            if (!storylet->CanDraw(_currentDraw))
-                continue;
+        size_t available = _candidates.size();
+        size_t wanted = (count < 0) ? available : std::min(static_cast<size_t>(count), available);
+        if (wanted == 0)
+        {
+            return {};
+        }
 
-            if (filter && !filter(*storylet))
-                continue;
+        auto higher = [](const DrawCandidate& a, const DrawCandidate& b) { return a.priority > b.priority; };
+        auto first = _candidates.begin();
 
-            if (!storylet->CheckCondition(*context, dumpEval))
-                continue;
+        if (wanted < available)
+        {
+            // Everything above the priority of the last storylet returned is drawn. From that
+            // boundary priority, pick the remaining storylets at random.
+            std::nth_element(first, first + (wanted - 1), _candidates.end(), higher);
+            int boundary = _candidates[wanted - 1].priority;
+            auto tier = std::partition(first, _candidates.end(), [boundary](const DrawCandidate& c) { return c.priority > boundary; });
+            auto tierEnd = std::partition(tier, _candidates.end(), [boundary](const DrawCandidate& c) { return c.priority == boundary; });
 
-            int priority = storylet->CalcCurrentPriority(*context, useSpecificity, dumpEval);
+            size_t tierStart = tier - first;
+            size_t tierSize = tierEnd - tier;
+            for (size_t i = tierStart; i < wanted; i++)
+            {
+                size_t pick = i + _random->Below(tierStart + tierSize - i);
+                std::swap(_candidates[i], _candidates[pick]);
+            }
+        }
 
-            if (!priorityMap.contains(priority))
+        // Order what's being returned, then shuffle each priority.
+        std::sort(first, first + wanted, higher);
+        size_t tierStart = 0;
+        for (size_t i = 1; i <= wanted; i++)
+        {
+            if (i == wanted || _candidates[i].priority != _candidates[tierStart].priority)
             {
-                priorityMap[priority] = std::vector<std::shared_ptr<Storylet>>();
+                ShuffleCandidates(tierStart, i);
+                tierStart = i;
             }
+        }
 
-            priorityMap[priority].push_back(storylet);
+        std::vector<std::shared_ptr<Storylet>> drawPile;
+        drawPile.reserve(wanted);
+        for (size_t i = 0; i < wanted; i++)
+        {
+            drawPile.push_back(_storylets[_candidates[i].handle]);
         }
-        
-        std::vector<int> sortedPriorities;
-        for (const auto& [priority, _] : priorityMap)
+        return drawPile;
+    }
+
+    Generator<std::shared_ptr<Storylet>> Deck::DrawLazy(std::function<bool(const Storylet&)> filter, TraceSink* trace)
+    {
+        if (!TracingEnabled)
         {
-            sortedPriorities.push_back(priority);
+            trace = nullptr;
         }
-        std::sort(sortedPriorities.begin(), sortedPriorities.end(), std::greater<int>());
-        std::vector<std::shared_ptr<Storylet>> drawPile;
+        ReleaseCooled();
+        RefreshTiers();
+
+        // Static priorities are already sorted into tiers, which are copied in case the deck
+        // changes while iterating. Storylets with priority expressions are checked now, to sort
+        // them by priority, and checked again when their tier is reached.
+        std::vector<DrawCandidate> unchecked = _tiers;
+        std::vector<DrawCandidate> dynamic;
+        {
+            DrawCallMemo callMemo(*context, _callMemo);
+            BeginChecks(trace);
+            _candidates.clear();
+            for (uint32_t handle : _dynamicPriorities)
+            {
+                if (_schedule[handle] == Schedule::Ready)
+                    AddCandidate(_candidates, handle, filter, false, trace);
+            }
+            dynamic = _candidates;
+        }
+
+        std::sort(dynamic.begin(), dynamic.end(), [](const DrawCandidate& a, const DrawCandidate& b) { return a.priority > b.priority || (a.priority == b.priority && a.handle < b.handle); });
 
-        for (int priority : sortedPriorities)
+        size_t nextUnchecked = 0;
+        size_t nextDynamic = 0;
+        std::vector<uint32_t> tier;
+        while (nextUnchecked < unchecked.size() || nextDynamic < dynamic.size())
         {
-            auto& bucket = priorityMap[priority];
-            Utils::ShuffleArray(bucket);
-            for (std::shared_ptr<Storylet> storylet : bucket)
+            int priority = std::numeric_limits<int>::min();
+            if (nextUnchecked < unchecked.size())
+                priority = unchecked[nextUnchecked].priority;
+            if (nextDynamic < dynamic.size())
+                priority = std::max(priority, dynamic[nextDynamic].priority);
+
+            tier.clear();
             {
-                drawPile.push_back(storylet);
-                if (count>-1 && drawPile.size() >= count)
+                // The context may have changed while the caller had the last storylet
+                DrawCallMemo callMemo(*context, _callMemo);
+                BeginChecks(trace);
+                _candidates.clear();
+                for (; nextDynamic < dynamic.size() && dynamic[nextDynamic].priority == priority; nextDynamic++)
+                {
+                    uint32_t handle = dynamic[nextDynamic].handle;
+                    if (_schedule[handle] == Schedule::Ready)
+                        AddCandidate(_candidates, handle, filter, false, trace);
+                }
+                for (; nextUnchecked < unchecked.size() && unchecked[nextUnchecked].priority == priority; nextUnchecked++)
+                {
+                    uint32_t handle = unchecked[nextUnchecked].handle;
+                    if (_schedule[handle] == Schedule::Ready)
+                        AddCandidate(_candidates, handle, filter, false, trace);
+                }
+                for (const DrawCandidate& candidate : _candidates)
                 {
-                    break;
+                    tier.push_back(candidate.handle);
                 }
             }
+
+            for (size_t i = 0; i < tier.size(); i++)
+            {
+                size_t pick = i + _random->Below(tier.size() - i);
+                std::swap(tier[i], tier[pick]);
+                if (_schedule[tier[i]] == Schedule::Ready)
+                    co_yield _storylets[tier[i]];
+            }
+        }
+    }
+
+    // Candidates above a tier are all known once every higher tier and every storylet with a
+    // priority expression has been checked. If there are count of them, lower tiers can't
+    // change the draw, including which storylets tie at the lowest priority drawn.
+    void Deck::AddTieredCandidates(size_t count, const std::function<bool(const Storylet&)>& filter, bool useIndex)
+    {
+        RefreshTiers();
+
+        for (uint32_t handle : _dynamicPriorities)
+        {
+            if (_schedule[handle] == Schedule::Ready)
+                AddCandidate(_candidates, handle, filter, false, nullptr);
+        }
+        size_t dynamicCount = _candidates.size();
+        std::sort(_candidates.begin(), _candidates.end(), [](const DrawCandidate& a, const DrawCandidate& b) { return a.priority > b.priority; });
+
+        size_t dynamicAbove = 0;
+        size_t next = 0;
+        while (next < _tiers.size())
+        {
+            int priority = _tiers[next].priority;
+            while (dynamicAbove < dynamicCount && _candidates[dynamicAbove].priority > priority)
+                dynamicAbove++;
+            if (dynamicAbove + (_candidates.size() - dynamicCount) >= count)
+                return;
+
+            size_t end = next;
+            while (end < _tiers.size() && _tiers[end].priority == priority)
+                end++;
+
+            // The lowest tier is usually the largest, so let the index find what it can there
+            bool indexTier = useIndex && end == _tiers.size();
+            CollectCandidates(end - next, nullptr, [&](size_t i, std::vector<DrawCandidate>& candidates) {
+                uint32_t handle = _tiers[next + i].handle;
+                if (_schedule[handle] == Schedule::Ready && (!indexTier || !_index.IsIndexed(handle)))
+                    AddCandidate(candidates, handle, filter, false, nullptr);
+            });
+            next = end;
+
+            if (indexTier)
+            {
+                _matches.clear();
+                _index.Match(*context, _matches);
+                CollectCandidates(_matches.size(), nullptr, [&](size_t i, std::vector<DrawCandidate>& candidates) {
+                    uint32_t handle = _matches[i].handle;
+                    if (_schedule[handle] == Schedule::Ready && !_priorityExpressions[handle] && StaticPriority(handle) == priority)
+                        AddCandidate(candidates, handle, filter, _matches[i].holds && _index.IsExact(handle), nullptr);
+                });
+            }
         }
-        return drawPile;
     }
 
-    std::vector<std::shared_ptr<Storylet>> Deck::DrawAndPlay(int count, std::function<bool(const Storylet&)> filter, const std::string& outcome, DumpEval* dumpEval) {
-        std::vector<std::shared_ptr<Storylet>> drawPile = Draw(count, filter, dumpEval);
+    void Deck::RefreshTiers()
+    {
+        if (!_tiersDirty && _tiersSpecificity == useSpecificity)
+        {
+            return;
+        }
+
+        _tiers.clear();
+        _dynamicPriorities.clear();
+        for (uint32_t handle = 0; handle < _storylets.size(); handle++)
+        {
+            if (_priorityExpressions[handle])
+                _dynamicPriorities.push_back(handle);
+            else
+                _tiers.push_back({StaticPriority(handle), handle});
+        }
+        std::sort(_tiers.begin(), _tiers.end(), [](const DrawCandidate& a, const DrawCandidate& b) { return a.priority > b.priority || (a.priority == b.priority && a.handle < b.handle); });
+        _tiersDirty = false;
+        _tiersSpecificity = useSpecificity;
+    }
+
+    void Deck::ShuffleCandidates(size_t begin, size_t end)
+    {
+        for (size_t i = end - 1; i > begin; --i)
+        {
+            size_t pick = begin + _random->Below(i - begin + 1);
+            std::swap(_candidates[i], _candidates[pick]);
+        }
+    }
+
+    std::vector<std::shared_ptr<Storylet>> Deck::DrawAndPlay(int count, std::function<bool(const Storylet&)> filter, const std::string& outcome, TraceSink* trace) {
+        std::vector<std::shared_ptr<Storylet>> drawPile = Draw(count, filter, trace);
         for (auto& storylet : drawPile)
         {
-            Play(*storylet);
+            Play(*storylet, outcome, trace);
         }
         return drawPile;
     }
 
-    std::shared_ptr<Storylet> Deck::DrawSingle(std::function<bool(const Storylet&)> filter, DumpEval* dumpEval) {
-        std::vector<std::shared_ptr<Storylet>> drawPile = Draw(1, filter, dumpEval);
+    std::shared_ptr<Storylet> Deck::DrawSingle(std::function<bool(const Storylet&)> filter, TraceSink* trace) {
+        std::vector<std::shared_ptr<Storylet>> drawPile = Draw(1, filter, trace);
         if (drawPile.size() > 0)
         {
             return drawPile[0];
@@ -229,61 +563,324 @@
         return nullptr;
     }
 
-    std::shared_ptr<Storylet> Deck::DrawAndPlaySingle(std::function<bool(const Storylet&)> filter, const std::string& outcome, DumpEval* dumpEval) {
-        std::vector<std::shared_ptr<Storylet>> drawPile = Draw(1, filter, dumpEval);
+    std::shared_ptr<Storylet> Deck::DrawAndPlaySingle(std::function<bool(const Storylet&)> filter, const std::string& outcome, TraceSink* trace) {
+        std::vector<std::shared_ptr<Storylet>> drawPile = Draw(1, filter, trace);
         if (drawPile.size() > 0)
         {
-            Play(*drawPile[0]);
+            Play(*drawPile[0], outcome, trace);
             return drawPile[0];
         }
         return nullptr;
     }
 
     std::shared_ptr<Storylet> Deck::GetStorylet(const std::string& id) const {
-        auto it = _all.find(id);
-        if (it != _all.end())
-            return it->second;
+        auto it = _handles.find(id);
+        if (it != _handles.end())
+            return _storylets[it->second];
         return nullptr;
     }
 
     void Deck::AddStorylet(std::shared_ptr<Storylet> storylet)
     {
-        if (_all.find(storylet->id) != _all.end())
+        if (_handles.find(storylet->id) != _handles.end())
             throw std::invalid_argument("Duplicate storylet id: " + storylet->id);
-        _all[storylet->id] = storylet;
+        if (storylet->_deck)
+            throw std::invalid_argument("Storylet '" + storylet->id + "' is already in a deck.");
+
+        uint32_t handle = static_cast<uint32_t>(_storylets.size());
+        _handles[storylet->id] = handle;
+        _storylets.push_back(storylet);
+        _nextPlay.push_back(0);
+        _conditions.push_back(nullptr);
+        _priorityExpressions.push_back(nullptr);
+        _priorities.push_back(0);
+        _specificities.push_back(0);
+        _schedule.push_back(Schedule::Ready);
+        _conditionCache.push_back(CachedCondition::Unknown);
+        _ready.push_back(handle);
         storylet->_deck = this;
+        storylet->_handle = handle;
+        SyncStorylet(handle);
+    }
+
+    void Deck::ScheduleStorylet(uint32_t handle)
+    {
+        int nextPlay = _nextPlay[handle];
+        Schedule schedule = Schedule::Ready;
+        if (nextPlay == NEXT_PLAY_NEVER)
+            schedule = Schedule::Retired;
+        else if (nextPlay > _currentDraw)
+            schedule = Schedule::Cooling;
+
+        if (_schedule[handle] == Schedule::Ready && schedule != Schedule::Ready)
+        {
+            _ready.erase(std::lower_bound(_ready.begin(), _ready.end(), handle));
+        }
+        else if (_schedule[handle] != Schedule::Ready && schedule == Schedule::Ready)
+        {
+            _ready.insert(std::lower_bound(_ready.begin(), _ready.end(), handle), handle);
+        }
+
+        if (schedule == Schedule::Cooling)
+        {
+            _cooling.push({nextPlay, handle});
+        }
+        _schedule[handle] = schedule;
+    }
+
+    void Deck::RescheduleStorylet(uint32_t handle)
+    {
+        int redraw = _storylets[handle]->_redraw;
+        if (redraw == REDRAW_ALWAYS || (redraw != REDRAW_NEVER && _nextPlay[handle] == NEXT_PLAY_NEVER))
+        {
+            _nextPlay[handle] = 0;
+            ScheduleStorylet(handle);
+        }
+    }
+
+    void Deck::ReleaseCooled()
+    {
+        size_t sortedEnd = _ready.size();
+        while (!_cooling.empty() && _cooling.top().nextPlay <= _currentDraw)
+        {
+            CoolingEntry entry = _cooling.top();
+            _cooling.pop();
+            // Skip entries left behind when a storylet was played or reset while cooling
+            if (_schedule[entry.handle] == Schedule::Cooling && _nextPlay[entry.handle] == entry.nextPlay)
+            {
+                _schedule[entry.handle] = Schedule::Ready;
+                _ready.push_back(entry.handle);
+            }
+        }
+
+        if (_ready.size() != sortedEnd)
+        {
+            std::sort(_ready.begin() + sortedEnd, _ready.end());
+            std::inplace_merge(_ready.begin(), _ready.begin() + sortedEnd, _ready.end());
+        }
+    }
+
+    void Deck::AddCandidate(std::vector<DrawCandidate>& candidates, uint32_t handle, const std::function<bool(const Storylet&)>& filter, bool conditionHolds, TraceSink* trace)
+    {
+        const Storylet& storylet = *_storylets[handle];
+
+        if (filter && !filter(storylet))
+            return;
+
+        if (!conditionHolds && !CheckCachedCondition(handle, trace))
+            return;
+
+        const ExpressionParser::CompiledExpression* priorityExpression = _priorityExpressions[handle];
+        int priority;
+        if (priorityExpression)
+            priority = EvalPriority(*priorityExpression, _specificities[handle], useSpecificity, storylet, *context, trace);
+        else
+            priority = StaticPriority(handle);
+
+        candidates.push_back({priority, handle});
     }
 
+    void Deck::RefreshConditionCache()
+    {
+        const Context& current = *context;
+        if (_dependentsDirty)
+        {
+            _index.Build(_conditions);
+        }
+
+        if (_dependentsDirty || &current != _cachedContext)
+        {
+            _watchedSlots.clear();
+            _dependents.clear();
+            std::unordered_map<ExpressionParser::SymbolId, size_t> watched;
+            for (uint32_t handle = 0; handle < _storylets.size(); handle++)
+            {
+                if (!_conditions[handle])
+                    continue;
+                for (ExpressionParser::SymbolId slot : _conditions[handle]->GetReads())
+                {
+                    auto [it, inserted] = watched.emplace(slot, _watchedSlots.size());
+                    if (inserted)
+                    {
+                        _watchedSlots.push_back(slot);
+                        _dependents.emplace_back();
+                    }
+                    _dependents[it->second].push_back(handle);
+                }
+            }
+            std::fill(_conditionCache.begin(), _conditionCache.end(), CachedCondition::Unknown);
+            _dependentsDirty = false;
+            _cachedContext = &current;
+        }
+        else if (current.GetVersion() != _cachedVersion)
+        {
+            for (size_t i = 0; i < _watchedSlots.size(); i++)
+            {
+                if (current.GetVersion(_watchedSlots[i]) <= _cachedVersion)
+                    continue;
+                for (uint32_t handle : _dependents[i])
+                {
+                    _conditionCache[handle] = CachedCondition::Unknown;
+                }
+            }
+        }
+        _cachedVersion = current.GetVersion();
+    }
+
+    bool Deck::CheckCachedCondition(uint32_t handle, TraceSink* trace)
+    {
+        const ExpressionParser::CompiledExpression* condition = _conditions[handle];
+        if (!condition)
+            return true;
+
+        // Evaluate everything when tracing, so the trace is complete
+        CachedCondition& cached = _conditionCache[handle];
+        if (!trace && (cached == CachedCondition::True || cached == CachedCondition::False))
+            return cached == CachedCondition::True;
+
+        bool result;
+        if (_graphPass && _graphRoots[handle] != NO_ROOT)
+            result = ExpressionParser::Utils::MakeBool(_graph.Evaluate(_graphRoots[handle], *context));
+        else
+            result = EvalCondition(*condition, *_storylets[handle], *context, trace);
+        if (cached == CachedCondition::Volatile)
+            return result;
+
+        cached = result ? CachedCondition::True : CachedCondition::False;
+        for (ExpressionParser::SymbolId slot : condition->GetCalls())
+        {
+            const ExpressionParser::ContextValue* entry = context->Find(slot);
+            if (!entry || !entry->GetFunction() || entry->GetFunction()->purity != ExpressionParser::Purity::Pure)
+            {
+                cached = CachedCondition::Volatile;
+                break;
+            }
+        }
+        return result;
+    }
+
+    void Deck::BeginChecks(TraceSink* trace)
+    {
+        RefreshConditionCache();
+
+        // The graph is skipped when tracing, as it doesn't trace
+        _graphPass = useConditionGraph && !trace;
+        if (_graphPass)
+        {
+            BeginGraphPass();
+        }
+    }
+
+    void Deck::BeginGraphPass()
+    {
+        if (_graphDirty)
+        {
+            _graph.Clear();
+            _graphRoots.assign(_storylets.size(), NO_ROOT);
+            for (uint32_t handle = 0; handle < _storylets.size(); handle++)
+            {
+                const ExpressionParser::CompiledExpression* condition = _conditions[handle];
+                if (condition && !condition->IsConstant())
+                {
+                    _graphRoots[handle] = _graph.Add(*condition);
+                }
+            }
+            _graphDirty = false;
+        }
+        _graph.BeginPass();
+    }
+
+    void Deck::RebuildSchedule()
+    {
+        _ready.clear();
+        _cooling = {};
+        for (uint32_t handle = 0; handle < _storylets.size(); handle++)
+        {
+            _schedule[handle] = Schedule::Retired;
+            ScheduleStorylet(handle);
+        }
+    }
+
+    void Deck::SyncStorylet(uint32_t handle)
+    {
+        const Storylet& storylet = *_storylets[handle];
+        _conditions[handle] = storylet._condition.get();
+        _priorityExpressions[handle] = storylet._priorityExpression.get();
+        _priorities[handle] = storylet._priority;
+        _specificities[handle] = storylet._specificity;
+        _dependentsDirty = true;
+        _graphDirty = true;
+        _tiersDirty = true;
+    }
+
+    void Deck::SetExecutor(std::shared_ptr<Executor> executor)
+    {
+        _executor = std::move(executor);
+    }
+
+    void Deck::SetRandom(std::unique_ptr<RandomSource> random)
+    {
+        if (!random)
+        {
+            throw std::invalid_argument("Deck needs a random source.");
+        }
+        _random = std::move(random);
+    }
+
+    // Storylets that can't be drawn again are saved with a next play of REDRAW_NEVER
     nlohmann::json Deck::SaveStateToJson() const
     {
-        nlohmann::json storylets;
-        for (const auto& [id, storylet] : _all)
+        nlohmann::json storylets = nlohmann::json::object();
+        for (uint32_t handle = 0; handle < _storylets.size(); handle++)
         {
-            storylets[id] = storylet->_nextPlay;
+            int nextPlay = _nextPlay[handle];
+            storylets[_storylets[handle]->id] = (nextPlay == NEXT_PLAY_NEVER) ? REDRAW_NEVER : nextPlay;
         }
         return {
             {"currentPlay", _currentDraw},
-            {"storylets", storylets}
+            {"storylets", storylets},
+            {"random", _random->SaveState()}
         };
     }
 
     void Deck::LoadStateFromJson(const nlohmann::json& json)
     {
         _currentDraw = json.at("currentPlay").get<int>();
+        // Older saves don't have the random state
+        if (json.contains("random"))
+        {
+            _random->LoadState(json.at("random"));
+        }
         const auto& storylets = json.at("storylets");
         for (const auto& [id, nextPlay] : storylets.items())
         {
-            auto it = _all.find(id);
-            if (it != _all.end())
+            auto it = _handles.find(id);
+            if (it != _handles.end())
             {
-                it->second->_nextPlay = nextPlay.get<int>();
+                uint32_t handle = it->second;
+                int value = nextPlay.get<int>();
+                int redraw = _storylets[handle]->_redraw;
+                // Saves hold plays, not cooldowns, so the current redraw setting decides as it did at draw time
+                if (redraw == REDRAW_ALWAYS || (value < 0 && redraw != REDRAW_NEVER))
+                {
+                    value = 0;
+                }
+                _nextPlay[handle] = (value < 0) ? NEXT_PLAY_NEVER : value;
             }
         }
+        RebuildSchedule();
     }
 
-    void Deck::Play(Storylet& storylet, const std::string& outcome, DumpEval* dumpEval)
+    void Deck::Play(Storylet& storylet, const std::string& outcome, TraceSink* trace)
     {
+        if (storylet._deck != this)
+        {
+            throw std::invalid_argument("Storylet '" + storylet.id + "' is not part of this deck.");
+        }
+
         _currentDraw++;
-        storylet.OnPlayed(_currentDraw, *context, outcome, dumpEval);
+        _nextPlay[storylet._handle] = (storylet._redraw == REDRAW_NEVER) ? NEXT_PLAY_NEVER : _currentDraw + storylet._redraw;
+        ScheduleStorylet(storylet._handle);
+        storylet.ApplyOutcome(*context, outcome, trace);
     }
- }
\ No newline at end of file
+ }
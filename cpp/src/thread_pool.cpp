@@ -0,0 +1,177 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+#include "storylet_framework/thread_pool.h"
+#include <algorithm>
+#include <exception>
+#include <limits>
+
+namespace StoryletFramework
+{
+    // The jobs from one call to ParallelFor. It lives on the caller's stack, so a job only
+    // touches it under its mutex once it's finished, and the caller waits on that mutex.
+    struct ThreadPool::Batch
+    {
+        const std::function<void(size_t)>* task;
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr exception;
+        size_t exceptionIndex = std::numeric_limits<size_t>::max();
+    };
+
+    // Callers have no queue of their own and only steal
+    static constexpr size_t NO_QUEUE = std::numeric_limits<size_t>::max();
+
+    ThreadPool::ThreadPool(size_t threads)
+    {
+        if (threads == 0)
+        {
+            threads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+        }
+        for (size_t i = 0; i < threads; i++)
+        {
+            _queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threads; i++)
+        {
+            _threads.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard lock(_wakeMutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (std::thread& thread : _threads)
+        {
+            thread.join();
+        }
+    }
+
+    void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& task)
+    {
+        if (_threads.empty() || count <= 1)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                task(i);
+            }
+            return;
+        }
+
+        Batch batch;
+        batch.task = &task;
+        batch.remaining = count;
+
+        // Counted before they're queued, so a thread can't take one and count below zero
+        {
+            std::lock_guard lock(_wakeMutex);
+            _queued += count;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            Queue& queue = *_queues[i % _queues.size()];
+            std::lock_guard lock(queue.mutex);
+            queue.jobs.push_back({&batch, i});
+        }
+        _wake.notify_all();
+
+        // Help out until there's nothing left to take, then wait for the rest to finish
+        Job job;
+        while (batch.remaining.load(std::memory_order_acquire) > 0 && TakeJob(NO_QUEUE, job))
+        {
+            RunJob(job);
+        }
+        {
+            std::unique_lock lock(batch.mutex);
+            batch.done.wait(lock, [&batch]() { return batch.remaining.load(std::memory_order_acquire) == 0; });
+        }
+
+        if (batch.exception)
+        {
+            std::rethrow_exception(batch.exception);
+        }
+    }
+
+    bool ThreadPool::TakeJob(size_t queue, Job& job)
+    {
+        if (queue != NO_QUEUE)
+        {
+            Queue& own = *_queues[queue];
+            std::lock_guard lock(own.mutex);
+            if (!own.jobs.empty())
+            {
+                job = own.jobs.back();
+                own.jobs.pop_back();
+                _queued--;
+                return true;
+            }
+        }
+
+        size_t start = (queue == NO_QUEUE) ? 0 : queue + 1;
+        for (size_t i = 0; i < _queues.size(); i++)
+        {
+            Queue& other = *_queues[(start + i) % _queues.size()];
+            std::lock_guard lock(other.mutex);
+            if (!other.jobs.empty())
+            {
+                job = other.jobs.front();
+                other.jobs.pop_front();
+                _queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void ThreadPool::RunJob(const Job& job)
+    {
+        Batch& batch = *job.batch;
+        std::exception_ptr exception;
+        try
+        {
+            (*batch.task)(job.index);
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+
+        std::lock_guard lock(batch.mutex);
+        if (exception && job.index < batch.exceptionIndex)
+        {
+            batch.exception = exception;
+            batch.exceptionIndex = job.index;
+        }
+        if (batch.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            batch.done.notify_all();
+        }
+    }
+
+    void ThreadPool::WorkerLoop(size_t queue)
+    {
+        for (;;)
+        {
+            Job job;
+            if (TakeJob(queue, job))
+            {
+                RunJob(job);
+                continue;
+            }
+
+            std::unique_lock lock(_wakeMutex);
+            _wake.wait(lock, [this]() { return _stop || _queued.load() > 0; });
+            if (_stop)
+            {
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,613 @@
+// This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+// Copyright (c) 2025 Ian Thomas
+
+#include "expression_parser/parser.h"
+#include "expression_parser/program.h"
+#include "expression_parser/expression_cache.h"
+#include "expression_parser/expression_graph.h"
+#include "expression_parser/call_memo.h"
+#include "expression_parser/trace.h"
+#include "expression_parser/writer.h"
+#include "catch_amalgamated.hpp"
+#include <algorithm>
+#include <string>
+#include <thread>
+
+using namespace ExpressionParser;
+
+TEST_CASE("Tokenize") {
+
+    std::string text = "street_wealth>=0 and street_tag('shops') or not android == \"and\"";
+    std::vector<Token> tokens = Parser::Tokenize(text);
+
+    REQUIRE(tokens.size() == 13);
+    REQUIRE(tokens[0].Kind == TokenKind::Identifier);
+    REQUIRE(tokens[0].Text == "street_wealth");
+    REQUIRE(tokens[1].Kind == TokenKind::Operator);
+    REQUIRE(tokens[1].Text == ">=");
+    REQUIRE(tokens[1].Offset == 13);
+    REQUIRE(tokens[2].Kind == TokenKind::Number);
+    REQUIRE(tokens[3].Kind == TokenKind::Keyword);
+    REQUIRE(tokens[6].Kind == TokenKind::String);
+    REQUIRE(tokens[6].Text == "'shops'");
+    // Words that merely start with a keyword are still identifiers.
+    REQUIRE(tokens[10].Kind == TokenKind::Identifier);
+    REQUIRE(tokens[10].Text == "android");
+    REQUIRE(tokens[12].Kind == TokenKind::String);
+
+    // Tokens are views into the original text.
+    REQUIRE(tokens[0].Text.data() == text.data());
+
+    REQUIRE_THROWS(Parser::Tokenize("a $ b"));
+    REQUIRE_THROWS(Parser::Tokenize("a & b"));
+    REQUIRE_THROWS(Parser::Tokenize("'unterminated"));
+    REQUIRE_THROWS(Parser::Tokenize("12abc"));
+}
+
+TEST_CASE("Parse") {
+
+    Parser parser;
+    Context context;
+    context["a"] = 3;
+    context["name"] = std::string("and");
+
+    REQUIRE(parser.Parse("a >= 1.5 && (name == 'and' || false)")->Write() == "a >= 1.5 and (name == 'and' or false)");
+    REQUIRE(Utils::MakeBool(parser.Parse("a >= 1.5 && (name == 'and' || false)")->Evaluate(context)));
+    REQUIRE(Utils::MakeNumeric(parser.Parse("-a * 2 + 10 / 4")->Evaluate(context)) == -3.5);
+
+    REQUIRE_THROWS(parser.Parse("a >="));
+    REQUIRE_THROWS(parser.Parse("(a"));
+    REQUIRE_THROWS(parser.Parse("a b"));
+}
+
+TEST_CASE("Bytecode") {
+
+    Parser parser;
+    Context context;
+    int calls = 0;
+    context["a"] = 3;
+    context["b"] = 0.5;
+    context["flag"] = false;
+    context["name"] = std::string("docks");
+    context["count_calls"] = make_function_wrapper([&calls](const std::string& tag) {
+        calls++;
+        return tag == "docks";
+    });
+
+    // The VM must agree with the tree walker on every operator.
+    std::vector<std::string> expressions = {
+        "a > 1 and b < 1",
+        "a >= 3 or flag",
+        "not flag and a != 2",
+        "a <= 2 || a == 3",
+        "-a * 2 + 10 / 4 - b",
+        "name == 'docks' and count_calls(name)",
+        "(a + 1) * (b - 0.5) == 0",
+        "a == '3'",
+        "name != 'market'",
+        "true and (false or not false)",
+    };
+    for (const auto& text : expressions) {
+        auto tree = parser.Parse(text);
+        Program program = Compiler::Compile(*tree);
+        INFO(text << "\n" << program.Dump());
+        REQUIRE(Utils::FormatValue(program.Run(context)) == Utils::FormatValue(tree->Evaluate(context)));
+    }
+
+    // Short-circuits skip the right-hand side entirely.
+    calls = 0;
+    REQUIRE(Utils::MakeBool(Compiler::Compile(*parser.Parse("flag and count_calls('x')")).Run(context)) == false);
+    REQUIRE(Utils::MakeBool(Compiler::Compile(*parser.Parse("a or count_calls('x')")).Run(context)) == true);
+    REQUIRE(Utils::MakeNumeric(Compiler::Compile(*parser.Parse("(a - 3) * count_calls('x')")).Run(context)) == 0);
+    REQUIRE(calls == 0);
+
+    REQUIRE_THROWS(Compiler::Compile(*parser.Parse("missing > 1")).Run(context));
+    REQUIRE_THROWS(Compiler::Compile(*parser.Parse("a / (a - 3)")).Run(context));
+    REQUIRE_THROWS(Compiler::Compile(*parser.Parse("count_calls(1, 2)")).Run(context));
+
+    // CompiledExpression falls back to the tree when tracing.
+    CompiledExpression compiled(parser.Parse("a > 1"));
+    TraceLines dumpEval;
+    REQUIRE(Utils::MakeBool(compiled.Evaluate(context, &dumpEval)));
+    REQUIRE((!TracingEnabled || !dumpEval.empty()));
+}
+
+TEST_CASE("Trace") {
+
+    Parser parser;
+    Context context;
+    context["a"] = 2;
+    context["flag"] = false;
+    context["f"] = make_function_wrapper([](std::string s, int n) { return s.size() == 1 && n == 2; });
+    context["g"] = make_function_wrapper([](int a, int b, int c, int d, int e) { return a + b + c + d + e; });
+    auto tree = parser.Parse("flag and a > 1 or -a < 0 and f('x', 2) == true");
+
+    TraceLines lines;
+    tree->Evaluate(context, &lines);
+    if (!TracingEnabled) {
+        REQUIRE(lines.empty());
+        return;
+    }
+    std::vector<std::string> expected = {
+        "Fetching variable: flag -> false",
+        "Evaluated: false and (ignore) = false",
+        "Fetching variable: a -> 2",
+        "Evaluated: - 2 = -2",
+        "Number: 0",
+        "Evaluated: -2 < 0 = true",
+        "String: 'x'",
+        "Number: 2",
+        "Called function: f('x', 2) = true",
+        "Boolean: true",
+        "Evaluated: true == true = true",
+        "Evaluated: true and true = true",
+        "Evaluated: false or true = true",
+    };
+    REQUIRE(static_cast<std::vector<std::string>&>(lines) == expected);
+
+    // A buffer keeps the most recent events, and only formats them when asked.
+    TraceBuffer buffer(4);
+    tree->Evaluate(context, &buffer);
+    REQUIRE(buffer.Size() == 4);
+    REQUIRE(buffer.Capacity() == 4);
+    REQUIRE(buffer.Dropped() == expected.size() - 4);
+    REQUIRE(buffer.Format() == std::vector<std::string>(expected.end() - 4, expected.end()));
+    const TraceEvent& last = buffer[3];
+    REQUIRE(last.kind == TraceEvent::Kind::Binary);
+    REQUIRE(last.op == OpCode::Or);
+    REQUIRE(last.node == tree.get());
+    REQUIRE(last.result.AsBool());
+    buffer.Clear();
+    REQUIRE(buffer.Size() == 0);
+
+    // Notes fill in their values, and long argument lists are cut short.
+    TraceBuffer notes;
+    notes.Record(TraceEvent::Note("Setting % to %", { "a", 2 }));
+    parser.Parse("g(1, 2, 3, 4, 5)")->Evaluate(context, &notes);
+    std::vector<std::string> formatted = notes.Format();
+    REQUIRE(formatted.front() == "Setting a to 2");
+    REQUIRE(formatted.back() == "Called function: g(1, 2, 3, 4, ...) = 15");
+}
+
+TEST_CASE("Value") {
+
+    Parser parser;
+    Context context;
+    context["i"] = 3;
+    context["d"] = 3.0;
+    context["name"] = std::string("docks");
+    context["half"] = make_function_wrapper([](double a) { return a / 2; });
+
+    // Strings are pooled, so equal strings share storage.
+    REQUIRE(&Value("docks").GetString() == &Value(std::string("docks")).GetString());
+
+    // Pooled strings are freed once no Value holds them.
+    size_t pooled = StringPool::Size();
+    {
+        Value built(std::string("runtime_") + std::to_string(pooled));
+        Value copy = built;
+        REQUIRE(&copy.GetString() == &built.GetString());
+        REQUIRE(StringPool::Size() == pooled + 1);
+    }
+    REQUIRE(StringPool::Size() == pooled);
+
+    // Ints and doubles compare by numeric value, other types only to their own type.
+    REQUIRE(Utils::ValueEquals(Value(3), Value(3.0)));
+    REQUIRE(Utils::ValueEquals(Value(3), Value(3.5)) == false);
+    REQUIRE(Utils::ValueEquals(Value(1), Value(true)) == false);
+    REQUIRE(Utils::ValueEquals(Value("3"), Value(3)) == false);
+    REQUIRE(Utils::MakeBool(parser.Parse("i == d")->Evaluate(context)));
+    REQUIRE(Utils::MakeBool(parser.Parse("half(i) == 1.5")->Evaluate(context)));
+    REQUIRE(Utils::MakeBool(parser.Parse("name == 'DOCKS'")->Evaluate(context)) == false);
+    REQUIRE_THROWS(parser.Parse("half(name)")->Evaluate(context));
+
+    // std::any still works at the API boundary.
+    REQUIRE(std::any_cast<int>(context["i"]) == 3);
+    REQUIRE(std::any_cast<std::string>(context["name"]) == "docks");
+    REQUIRE(std::any_cast<double>(std::any(Value(2.5).ToAny())) == 2.5);
+    REQUIRE(Value::FromAny(std::any(std::string("docks"))).GetString() == "docks");
+    REQUIRE(Value::FromAny(std::any(std::vector<int>())).IsNone());
+}
+
+TEST_CASE("Slots") {
+
+    Parser parser;
+
+    // Names are bound to slots at parse time, before any context defines them.
+    auto tree = parser.Parse("slot_test_a + slot_test_b(2)");
+    Program program = Compiler::Compile(*tree);
+
+    Context first;
+    first["slot_test_a"] = 1;
+    first["slot_test_b"] = make_function_wrapper([](int x) { return x * 10; });
+    Context second;
+    second["slot_test_b"] = make_function_wrapper([](int x) { return x; });
+    second["slot_test_a"] = 5;
+
+    REQUIRE(Utils::MakeNumeric(tree->Evaluate(first)) == 21);
+    REQUIRE(Utils::MakeNumeric(program.Run(first)) == 21);
+    REQUIRE(Utils::MakeNumeric(program.Run(second)) == 7);
+    REQUIRE(SymbolTable::GetName(SymbolTable::Find("slot_test_a")) == "slot_test_a");
+
+    // Unknown names still report the name.
+    Context empty;
+    REQUIRE_THROWS_WITH(program.Run(empty), "Variable 'slot_test_a' not found in context.");
+    REQUIRE_THROWS_WITH(tree->Evaluate(empty), "Variable 'slot_test_a' not found in context.");
+    REQUIRE_FALSE(empty.Contains("slot_test_never_used"));
+    REQUIRE(SymbolTable::Find("slot_test_never_used") == SymbolTable::None);
+    REQUIRE(second.Size() == 2);
+}
+
+TEST_CASE("Versions") {
+
+    Parser parser;
+    CompiledExpression expression(parser.Parse("version_test_a > 1 and version_test_f(version_test_b) and version_test_a < 9"));
+    std::vector<SymbolId> reads = { SymbolTable::Find("version_test_a"), SymbolTable::Find("version_test_b"), SymbolTable::Find("version_test_f") };
+    std::sort(reads.begin(), reads.end());
+    REQUIRE(expression.GetReads() == reads);
+    REQUIRE(expression.GetCalls() == std::vector<SymbolId>{ SymbolTable::Find("version_test_f") });
+    REQUIRE(CompiledExpression(parser.Parse("1 + 2")).GetReads().empty());
+
+    // Each write gets a newer version, and reads don't change it.
+    Context context;
+    context["version_test_a"] = 2;
+    context["version_test_b"] = true;
+    uint64_t version = context.GetVersion();
+    SymbolId a = SymbolTable::Find("version_test_a");
+    REQUIRE(context.GetVersion(a) < version);
+    REQUIRE(context.GetVersion(SymbolTable::Find("version_test_b")) == version);
+    REQUIRE(context.GetVersion(SymbolTable::Intern("version_test_unset")) == 0);
+    REQUIRE(std::any_cast<int>(context["version_test_a"]) == 2);
+    REQUIRE(context.GetVersion() == version);
+    context["version_test_a"] = 3;
+    REQUIRE(context.GetVersion(a) > version);
+    REQUIRE(context.GetVersion() == context.GetVersion(a));
+
+    // Assigning a whole context changes every entry, including ones it doesn't have.
+    Context other;
+    other["version_test_b"] = false;
+    version = context.GetVersion();
+    context = other;
+    REQUIRE(context.GetVersion(a) > version);
+    REQUIRE_FALSE(context.Contains("version_test_a"));
+
+    // Functions are volatile unless declared pure.
+    REQUIRE(make_function_wrapper([]() { return 1; }).purity == Purity::Volatile);
+    REQUIRE(make_function_wrapper([](int x) { return x; }, Purity::Pure).purity == Purity::Pure);
+}
+
+TEST_CASE("CallMemo") {
+
+    Parser parser;
+    Context context;
+    int stableCalls = 0;
+    int volatileCalls = 0;
+    context["stable"] = make_function_wrapper([&stableCalls](std::string tag) { stableCalls++; return tag == "shops"; }, Purity::Stable);
+    context["roll"] = make_function_wrapper([&volatileCalls](int x) { volatileCalls++; return x; }, Purity::Volatile);
+    CompiledExpression expression(parser.Parse("stable('shops') and stable('shops') and not stable('docks') and roll(1) == roll(1)"));
+
+    // Without a memo every call is made.
+    REQUIRE(Utils::MakeBool(expression.Evaluate(context)));
+    REQUIRE(stableCalls == 3);
+    REQUIRE(volatileCalls == 2);
+
+    // With one, each stable call is made once per set of arguments, until the memo is cleared.
+    CallMemo memo;
+    context.SetCallMemo(&memo);
+    stableCalls = 0;
+    volatileCalls = 0;
+    REQUIRE(Utils::MakeBool(expression.Evaluate(context)));
+    REQUIRE(parser.Parse("stable('shops')")->Evaluate(context).AsBool());
+    REQUIRE(stableCalls == 2);
+    REQUIRE(volatileCalls == 2);
+    CallMemo::Stats stats = memo.GetStats();
+    REQUIRE(stats.Hits == 2);
+    REQUIRE(stats.Misses == 2);
+    REQUIRE(stats.Entries == 2);
+
+    memo.Clear();
+    REQUIRE(Utils::MakeBool(expression.Evaluate(context)));
+    REQUIRE(stableCalls == 4);
+    REQUIRE(memo.GetStats().Misses == 4);
+    memo.ResetStats();
+    REQUIRE(memo.GetStats().Hits == 0);
+
+    // Arguments of different types are different calls.
+    context["stable_number"] = make_function_wrapper([&stableCalls](Value x) { stableCalls++; return Utils::FormatValue(x); }, Purity::Stable);
+    stableCalls = 0;
+    REQUIRE(Utils::MakeBool(CompiledExpression(parser.Parse("stable_number(1) != stable_number('1')")).Evaluate(context)));
+    REQUIRE(stableCalls == 2);
+
+    // Attaching a memo isn't a change to the context.
+    uint64_t version = context.GetVersion();
+    context.SetCallMemo(nullptr);
+    REQUIRE(context.GetVersion() == version);
+}
+
+TEST_CASE("Predicates") {
+
+    Parser parser;
+    SymbolId wealth = SymbolTable::Intern("predicate_wealth");
+    SymbolId street = SymbolTable::Intern("predicate_street");
+
+    std::vector<Predicate> predicates;
+    REQUIRE(CompiledExpression(parser.Parse("predicate_wealth <= 0")).GetPredicates(predicates));
+    REQUIRE(predicates.size() == 1);
+    REQUIRE(predicates[0].slot == wealth);
+    REQUIRE(predicates[0].op == OpCode::LessThanEquals);
+    REQUIRE(predicates[0].operand.GetNumber() == 0);
+
+    // Comparisons are turned round so the variable is on the left, and constants are folded first.
+    predicates.clear();
+    REQUIRE(CompiledExpression(parser.Parse("1 + 2 < predicate_wealth and predicate_street == 'docks'")).GetPredicates(predicates));
+    REQUIRE(predicates.size() == 2);
+    REQUIRE(predicates[0].op == OpCode::GreaterThan);
+    REQUIRE(predicates[0].operand.GetNumber() == 3);
+    REQUIRE(predicates[1].slot == street);
+    REQUIRE(predicates[1].op == OpCode::Equals);
+    REQUIRE(predicates[1].operand.GetString() == "docks");
+
+    // Other terms are reported by the return value.
+    predicates.clear();
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("predicate_wealth > 1 and predicate_f()")).GetPredicates(predicates));
+    REQUIRE(predicates.size() == 1);
+
+    // Terms after one that isn't a predicate aren't collected, so indexing on them can't skip
+    // a call or an error.
+    predicates.clear();
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("predicate_wealth > 1 and predicate_f() and predicate_wealth < 5")).GetPredicates(predicates));
+    REQUIRE(predicates.size() == 1);
+    REQUIRE(predicates[0].op == OpCode::GreaterThan);
+    predicates.clear();
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("not predicate_f() and predicate_wealth > 1")).GetPredicates(predicates));
+    REQUIRE(predicates.empty());
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("predicate_wealth / 2 > 1 and predicate_wealth < 5")).GetPredicates(predicates));
+    REQUIRE(predicates.empty());
+    predicates.clear();
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("predicate_wealth > 1 or predicate_wealth < -1")).GetPredicates(predicates));
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("'docks' == predicate_street")).GetPredicates(predicates));
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("predicate_wealth != 1")).GetPredicates(predicates));
+    REQUIRE(predicates.empty());
+}
+
+TEST_CASE("Optimize") {
+
+    Parser parser;
+    Context context;
+    context["a"] = 3;
+    context["flag"] = false;
+    context["f"] = make_function_wrapper([](int x) { return x + 1; });
+
+    auto optimized = [&parser](const std::string &text) {
+        return ExpressionNode::Optimize(parser.Parse(text));
+    };
+
+    // Literal subexpressions fold.
+    REQUIRE(optimized("1 == 1")->Write() == "true");
+    REQUIRE(optimized("(2 + 3) * 4 > a")->Write() == "20 > a");
+    REQUIRE(optimized("not (1 > 2)")->Write() == "true");
+    REQUIRE(optimized("false and f(a) > 1")->Write() == "false");
+    REQUIRE(optimized("'x' == 'y' or true")->Write() == "true");
+
+    // Boolean and arithmetic identities.
+    REQUIRE(optimized("true and a > 1")->Write() == "a > 1");
+    REQUIRE(optimized("a > 1 or false")->Write() == "a > 1");
+    REQUIRE(optimized("not not (flag == false)")->Write() == "flag == false");
+    REQUIRE(optimized("not not flag")->Write() == "not not flag");
+    REQUIRE(optimized("(a + 1) * 1 > 2")->Write() == "a + 1 > 2");
+
+    // Anything whose type depends on the context is left alone.
+    REQUIRE(optimized("true and flag")->Write() == "true and flag");
+    REQUIRE(optimized("a * 1")->Write() == "a * 1");
+
+    // Errors are left for evaluation to report.
+    REQUIRE(optimized("1 / 0")->Write() == "1 / 0");
+
+    // Specificity doesn't change, and neither do results.
+    std::vector<std::string> expressions = {
+        "1 == 1",
+        "true and a > 1",
+        "(2 + 3) * 4 > a or flag",
+        "not not flag == false and f(1) == 2",
+        "a > 1 or false",
+    };
+    for (const auto &text : expressions) {
+        INFO(text);
+        auto tree = parser.Parse(text);
+        int specificity = tree->GetSpecificity();
+        Value expected = tree->Evaluate(context);
+        auto result = ExpressionNode::Optimize(parser.Parse(text));
+        REQUIRE(result->GetSpecificity() == specificity);
+        REQUIRE(Utils::ValueEquals(result->Evaluate(context), expected));
+    }
+
+    // Constant expressions are flagged.
+    CompiledExpression always(parser.Parse("1 + 1 == 2"));
+    REQUIRE(always.IsConstant());
+    REQUIRE(always.GetConstant().AsBool());
+    REQUIRE(always.GetSpecificity() == parser.Parse("1 + 1 == 2")->GetSpecificity());
+    REQUIRE_FALSE(CompiledExpression(parser.Parse("a > 1")).IsConstant());
+}
+
+TEST_CASE("Decompile") {
+
+    Parser parser;
+    Context context;
+    context["a"] = 3;
+    context["flag"] = false;
+    context["name"] = "docks";
+    context["f"] = make_function_wrapper([](int x, int y) { return x + y; });
+
+    // The tree comes back as it was optimized, so it writes, compiles and evaluates the same.
+    std::vector<std::string> expressions = {
+        "a > 1 and not flag or f(a, 2) == 5",
+        "-(a + 1) * 2 >= a - 10 / 4",
+        "name == 'docks' and (flag or a != 3)",
+        "f(f(1, 2), a * 0) < 4",
+        "true and a <= 3",
+        "'x' == 'x'",
+    };
+    for (const auto &text : expressions) {
+        INFO(text);
+        CompiledExpression compiled(parser.Parse(text));
+        const Program &program = compiled.GetProgram();
+        auto tree = Compiler::Decompile(program.GetCode(), program.GetConstants(), compiled.GetSpecificity());
+        REQUIRE(tree->Write() == compiled.GetTree()->Write());
+        REQUIRE(tree->GetSpecificity() == compiled.GetSpecificity());
+
+        CompiledExpression reloaded(tree);
+        REQUIRE(reloaded.GetProgram().Dump() == program.Dump());
+        REQUIRE(Utils::ValueEquals(reloaded.Evaluate(context), compiled.Evaluate(context)));
+    }
+
+    // Code that isn't a whole expression is an error.
+    CompiledExpression compiled(parser.Parse("a + 1 > 2"));
+    const Program &program = compiled.GetProgram();
+    std::vector<Instruction> code = program.GetCode();
+    REQUIRE_THROWS(Compiler::Decompile(std::span(code).first(code.size() - 1), program.GetConstants(), 0));
+    REQUIRE_THROWS(Compiler::Decompile(std::span(code).subspan(1), program.GetConstants(), 0));
+    REQUIRE_THROWS(Compiler::Decompile(code, {}, 0));
+}
+
+TEST_CASE("ExpressionCache") {
+
+    ExpressionCache cache;
+    Context context;
+    context["street_wealth"] = 2;
+
+    REQUIRE(ExpressionCache::Normalize("street_wealth>=0  and\tname=='a  b'") == "street_wealth >= 0 and name == 'a  b'");
+
+    // Whitespace differences share an entry.
+    auto first = cache.Get("street_wealth>=0");
+    auto second = cache.Get("street_wealth >= 0");
+    auto third = cache.Get("street_wealth>=1");
+    REQUIRE(first == second);
+    REQUIRE(first != third);
+    REQUIRE(Utils::MakeBool(first->Evaluate(context)));
+
+    ExpressionCache::Stats stats = cache.GetStats();
+    REQUIRE(stats.Hits == 1);
+    REQUIRE(stats.Misses == 2);
+    REQUIRE(stats.Entries == 2);
+    REQUIRE(stats.MemoryUsage > 0);
+
+    REQUIRE_THROWS(cache.Get("street_wealth >="));
+    REQUIRE(cache.GetStats().Entries == 2);
+
+    // A capacity bound drops the least recently used entries.
+    cache.Get("street_wealth>=0");
+    cache.SetCapacity(1);
+    stats = cache.GetStats();
+    REQUIRE(stats.Entries == 1);
+    REQUIRE(stats.Evictions == 1);
+    REQUIRE(cache.Get("street_wealth >= 0") == first);
+    REQUIRE(cache.Get("street_wealth >= 1") != third);
+    // Evicted expressions stay usable by anything holding them.
+    REQUIRE(Utils::MakeBool(third->Evaluate(context)));
+
+    cache.Clear();
+    REQUIRE(cache.GetStats().Entries == 0);
+    REQUIRE(cache.GetStats().MemoryUsage == 0);
+}
+
+TEST_CASE("ExpressionGraph") {
+
+    Parser parser;
+    Context context;
+    int pureCalls = 0;
+    int volatileCalls = 0;
+    context["a"] = 2;
+    context["b"] = std::string("docks");
+    context["pure"] = make_function_wrapper([&pureCalls](std::string s) { pureCalls++; return s == "docks"; }, Purity::Pure);
+    context["roll"] = make_function_wrapper([&volatileCalls]() { volatileCalls++; return 3; });
+
+    std::vector<std::string> expressions = {
+        "a > 1 and pure(b)",
+        "a > 1 or roll() > 2",
+        "not (a > 1 and pure(b)) or a * 2 == 4",
+        "roll() > 2 and a > 1",
+        "a == 2.0 and a - 1 == 1",
+        "a > 5 and missing > 1",
+    };
+    ExpressionGraph graph;
+    std::vector<CompiledExpression> compiled;
+    std::vector<ExpressionGraph::NodeId> roots;
+    for (const auto &text : expressions) {
+        compiled.emplace_back(parser.Parse(text));
+        roots.push_back(graph.Add(compiled.back()));
+    }
+
+    // Shared subexpressions are one node.
+    REQUIRE(graph.Add(compiled[0]) == roots[0]);
+    ExpressionGraph single;
+    single.Add(compiled[0]);
+    single.Add(compiled[1]);
+    REQUIRE(single.Size() == 10);
+
+    // Results and short-circuiting match each expression run on its own.
+    for (int a : {0, 2, 6}) {
+        context["a"] = a;
+        graph.BeginPass();
+        for (size_t i = 0; i < expressions.size(); i++) {
+            INFO(expressions[i] << " with a = " << a);
+            if (a == 6 && i == 5) {
+                REQUIRE_THROWS_WITH(graph.Evaluate(roots[i], context), "Variable 'missing' not found in context.");
+                continue;
+            }
+            REQUIRE(Utils::ValueEquals(graph.Evaluate(roots[i], context), compiled[i].Evaluate(context)));
+        }
+    }
+
+    // Within a pass, pure results are reused and volatile calls are made every time.
+    context["a"] = 2;
+    pureCalls = 0;
+    volatileCalls = 0;
+    uint64_t saved = graph.GetSavedEvaluations();
+    graph.BeginPass();
+    REQUIRE(Utils::MakeBool(graph.Evaluate(roots[0], context)));
+    REQUIRE(graph.GetSavedEvaluations() == saved);
+    REQUIRE(Utils::MakeBool(graph.Evaluate(roots[0], context)));
+    REQUIRE(graph.GetSavedEvaluations() == saved + 6);
+    REQUIRE(Utils::MakeBool(graph.Evaluate(roots[3], context)));
+    REQUIRE(Utils::MakeBool(graph.Evaluate(roots[3], context)));
+    REQUIRE(pureCalls == 1);
+    REQUIRE(volatileCalls == 2);
+    graph.BeginPass();
+    graph.Evaluate(roots[0], context);
+    REQUIRE(pureCalls == 2);
+
+    graph.Clear();
+    REQUIRE(graph.Size() == 0);
+}
+
+TEST_CASE("Parsing from many threads") {
+    const Parser parser;
+    const std::vector<std::string> expressions = {
+        "street_wealth >= 0 and street_tag('shops')",
+        "not (a + b * 2 > c) or name == 'market'",
+        "f(1, g(x, 'y'), -z) != 3.5"
+    };
+    std::vector<std::string> expected;
+    for (const auto& text : expressions)
+        expected.push_back(parser.Parse(text)->Write());
+
+    // One parser shared between threads, each with its own string format.
+    std::vector<int> mismatches(8, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&, t]() {
+            Writer::setStringFormat(t % 2 ? STRING_FORMAT::DOUBLEQUOTE : STRING_FORMAT::SINGLEQUOTE);
+            for (int i = 0; i < 500; i++) {
+                size_t which = (i + t) % expressions.size();
+                if (parser.Parse(expressions[which])->Write() != expected[which] && t % 2 == 0)
+                    mismatches[t]++;
+                if (Utils::FormatString("x") != (t % 2 ? "\"x\"" : "'x'"))
+                    mismatches[t]++;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    REQUIRE(std::count(mismatches.begin(), mismatches.end(), 0) == 8);
+    REQUIRE(Writer::getStringFormat() == STRING_FORMAT::SINGLEQUOTE);
+}
@@ -3,10 +3,17 @@
 
 #include "storylet_framework/json_loader.h"
 #include "storylet_framework/context.h"
+#include "storylet_framework/deck_image.h"
+#include "expression_parser/expression_cache.h"
 #include "catch_amalgamated.hpp"
 #include "test_utils.h"
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
 
 using namespace StoryletFramework;
 using namespace StoryletFrameworkTest;
@@ -66,7 +73,7 @@ TEST_CASE("StreetSystem") {
         nlohmann::json content = ExtractJsonFromAny(street.content);
         context["street_id"] = street.id;
         context["street_wealth"] = content["wealth"].get<int>();
-        context["street_tag"] = ExpressionParser::make_function_wrapper([&](const std::string& tag) {
+        context["street_tag"] = ExpressionParser::make_function_wrapper([content](const std::string& tag) {
             if (content.contains("tags")) {
                 const auto& tags = content["tags"];
                 if (tags.is_array()) {
@@ -85,7 +92,7 @@ TEST_CASE("StreetSystem") {
         auto encounter = encounters->DrawAndPlaySingle();
         nlohmann::json content = ExtractJsonFromAny(encounter->content);
 
-        context["encounter_tag"] = ExpressionParser::make_function_wrapper([&](const std::string& tag) {    
+        context["encounter_tag"] = ExpressionParser::make_function_wrapper([content, encounter](const std::string& tag) {
 
             if (!encounter || !content.contains("tags")) {
                 return false;
@@ -141,4 +148,1062 @@ TEST_CASE("StreetSystem") {
     //std::cout << ContextUtils::DumpContext(context) << std::endl;
 
     REQUIRE(std::any_cast<double>(context["noble_storyline"]) > 0);
-}
\ No newline at end of file
+}
+TEST_CASE("Outcomes") {
+    StoryletFramework::Context context;
+    nlohmann::json json = nlohmann::json::parse(R"({
+        "context": { "visits": 0, "mood": "'calm'" },
+        "storylets": [
+            {
+                "id": "tavern",
+                "redraw": "always",
+                "outcomes": {
+                    "default": { "visits": "visits + 1" },
+                    "fight": { "visits": "visits + 1", "mood": "'angry'" }
+                }
+            }
+        ]
+    })");
+    std::shared_ptr<Deck> deck = DeckFromJson(json, &context);
+
+    deck->DrawAndPlaySingle();
+    deck->DrawAndPlaySingle(nullptr, "fight");
+    REQUIRE(std::any_cast<double>(context["visits"]) == 2);
+    REQUIRE(std::any_cast<std::string>(context["mood"]) == "angry");
+
+    // Expressions evaluate to std::any, or to a Value.
+    REQUIRE(std::any_cast<double>(ContextUtils::EvalExpression(std::string("visits * 2"), context)) == 4);
+    REQUIRE(std::any_cast<int>(ContextUtils::EvalExpression(3, context)) == 3);
+    REQUIRE(ContextUtils::EvalValue(std::string("mood"), context).GetString() == "angry");
+
+    // Storylets built by hand compile their outcomes on the first play.
+    auto inn = std::make_shared<Storylet>("inn");
+    inn->SetOutcome("default", JsonToKeyedMap(nlohmann::json::parse(R"({ "visits": "visits * 10" })")));
+    deck->AddStorylet(inn);
+    inn->Play();
+    REQUIRE(std::any_cast<double>(context["visits"]) == 20);
+
+    // Outcomes changed after a play are compiled again on the next one.
+    inn->SetOutcome("default", JsonToKeyedMap(nlohmann::json::parse(R"({ "visits": "visits + 1" })")));
+    inn->Play();
+    REQUIRE(std::any_cast<double>(context["visits"]) == 21);
+    inn->SetOutcomes(KeyedMap{});
+    inn->Play();
+    REQUIRE(std::any_cast<double>(context["visits"]) == 21);
+
+    // Updating a property that isn't in the context fails.
+    auto bad = std::make_shared<Storylet>("bad");
+    bad->SetOutcome("default", JsonToKeyedMap(nlohmann::json::parse(R"({ "missing": 1 })")));
+    deck->AddStorylet(bad);
+    REQUIRE_THROWS_AS(bad->Play(), std::out_of_range);
+}
+
+TEST_CASE("Priorities") {
+    StoryletFramework::Context context;
+    context["level"] = 1;
+
+    auto fixed = std::make_shared<Storylet>("fixed");
+    fixed->SetPriority(5);
+    auto folded = std::make_shared<Storylet>("folded");
+    folded->SetPriority(std::string("2 + 2"));
+    auto dynamic = std::make_shared<Storylet>("dynamic");
+    dynamic->SetPriority(std::string("level * 2"));
+    dynamic->SetCondition("level > 0 and level < 10");
+
+    REQUIRE(fixed->HasStaticPriority());
+    REQUIRE(folded->HasStaticPriority());
+    REQUIRE_FALSE(dynamic->HasStaticPriority());
+    REQUIRE(folded->GetStaticPriority(false) == 4);
+    REQUIRE(fixed->GetStaticPriority(true) == 500);
+    REQUIRE(dynamic->CalcCurrentPriority(context, false) == 2);
+    REQUIRE(dynamic->CalcCurrentPriority(context, true) == 201);
+
+    Deck deck(context);
+    deck.AddStorylet(fixed);
+    deck.AddStorylet(folded);
+    deck.AddStorylet(dynamic);
+
+    auto drawn = deck.Draw();
+    REQUIRE(drawn.size() == 3);
+    REQUIRE(drawn[0]->id == "fixed");
+    REQUIRE(drawn[1]->id == "folded");
+    REQUIRE(drawn[2]->id == "dynamic");
+
+    // Expression priorities are evaluated against the current context.
+    context["level"] = 3;
+    REQUIRE(deck.DrawSingle()->id == "dynamic");
+}
+
+TEST_CASE("Draw") {
+    StoryletFramework::Context context;
+    Deck deck(context);
+    for (int i = 0; i < 10; i++) {
+        auto storylet = std::make_shared<Storylet>("s" + std::to_string(i));
+        storylet->SetPriority(i < 2 ? 10 : (i < 6 ? 5 : 0));
+        deck.AddStorylet(storylet);
+    }
+
+    // Exactly the number asked for, highest priorities first.
+    for (int count : {0, 1, 2, 3, 4, 6, 10, 20}) {
+        auto drawn = deck.Draw(count);
+        REQUIRE(drawn.size() == static_cast<size_t>(std::min(count, 10)));
+        for (size_t i = 1; i < drawn.size(); i++)
+            REQUIRE(drawn[i - 1]->CalcCurrentPriority(context, false) >= drawn[i]->CalcCurrentPriority(context, false));
+    }
+    REQUIRE(deck.Draw().size() == 10);
+
+    // Storylets sharing the boundary priority are all picked some of the time.
+    std::map<std::string, int> seen;
+    for (int i = 0; i < 400; i++) {
+        auto drawn = deck.Draw(3);
+        REQUIRE(drawn[0]->CalcCurrentPriority(context, false) == 10);
+        REQUIRE(drawn[1]->CalcCurrentPriority(context, false) == 10);
+        seen[drawn[2]->id]++;
+    }
+    REQUIRE(seen.size() == 4);
+    for (const auto& [id, times] : seen)
+        REQUIRE(times > 50);
+}
+
+TEST_CASE("Random") {
+    StoryletFramework::Context context;
+    auto makeDeck = [&context](uint64_t seed) {
+        auto deck = std::make_shared<Deck>(context);
+        for (int i = 0; i < 20; i++)
+            deck->AddStorylet(std::make_shared<Storylet>("s" + std::to_string(i)));
+        deck->GetRandom().Seed(seed);
+        return deck;
+    };
+    auto drawIds = [](Deck& deck) {
+        std::string ids;
+        for (const auto& storylet : deck.Draw(5))
+            ids += storylet->id + " ";
+        return ids;
+    };
+
+    // The same seed gives the same draws.
+    auto first = makeDeck(1234);
+    auto second = makeDeck(1234);
+    for (int i = 0; i < 10; i++)
+        REQUIRE(drawIds(*first) == drawIds(*second));
+
+    // Saved state includes the generator, so a restored deck replays exactly.
+    nlohmann::json saved = first->SaveStateToJson();
+    std::vector<std::string> expected;
+    for (int i = 0; i < 10; i++)
+        expected.push_back(drawIds(*first));
+    auto restored = makeDeck(99);
+    restored->LoadStateFromJson(saved);
+    for (int i = 0; i < 10; i++)
+        REQUIRE(drawIds(*restored) == expected[i]);
+
+    // Reference output for xoshiro256** with state {1, 2, 3, 4}.
+    Xoshiro256 xoshiro;
+    xoshiro.LoadState({{"type", "xoshiro256**"}, {"state", {"1", "2", "3", "4"}}});
+    REQUIRE(xoshiro() == 11520);
+    REQUIRE(xoshiro() == 0);
+    REQUIRE(xoshiro() == 1509978240);
+    for (int i = 0; i < 1000; i++)
+        REQUIRE(xoshiro.Below(7) < 7);
+
+    // A user-supplied engine, with its state saved in the same way.
+    first->SetRandom(std::make_unique<EngineRandomSource<std::mt19937_64>>(42));
+    saved = first->SaveStateToJson();
+    std::string next = drawIds(*first);
+    second->SetRandom(std::make_unique<EngineRandomSource<std::mt19937_64>>());
+    second->LoadStateFromJson(saved);
+    REQUIRE(drawIds(*second) == next);
+    REQUIRE_THROWS(restored->LoadStateFromJson(saved));
+}
+
+TEST_CASE("Deck storage") {
+    StoryletFramework::Context context;
+    context["open"] = false;
+    Deck deck(context);
+    auto door = std::make_shared<Storylet>("door");
+    auto once = std::make_shared<Storylet>("once");
+    once->SetRedraw(REDRAW_NEVER);
+    auto later = std::make_shared<Storylet>("later");
+    later->SetRedraw(2);
+    deck.AddStorylet(door);
+    deck.AddStorylet(once);
+    deck.AddStorylet(later);
+    REQUIRE(deck.GetStorylet("once") == once);
+    REQUIRE(deck.GetStorylet("missing") == nullptr);
+
+    // Changing a storylet after it's added is seen by the deck.
+    door->SetCondition("open");
+    door->SetPriority(10);
+    REQUIRE(deck.Draw().size() == 2);
+    context["open"] = true;
+    REQUIRE(deck.DrawSingle() == door);
+
+    once->Play();
+    later->Play();
+    REQUIRE_FALSE(once->CanDraw(100));
+    REQUIRE_FALSE(later->CanDraw(2));
+    REQUIRE(later->CanDraw(4));
+    REQUIRE(deck.Draw().size() == 1);
+
+    // Retired storylets are saved as REDRAW_NEVER, as before.
+    nlohmann::json saved = deck.SaveStateToJson();
+    REQUIRE(saved["storylets"]["once"] == REDRAW_NEVER);
+    deck.Reset();
+    REQUIRE(deck.Draw().size() == 3);
+    deck.LoadStateFromJson(saved);
+    REQUIRE_FALSE(once->CanDraw(100));
+
+    // A storylet belongs to one deck.
+    Deck other(context);
+    REQUIRE_THROWS_AS(other.AddStorylet(door), std::invalid_argument);
+    REQUIRE_THROWS_AS(other.Play(*door), std::invalid_argument);
+}
+
+TEST_CASE("Cooldowns") {
+    StoryletFramework::Context context;
+    Deck deck(context);
+    deck.GetRandom().Seed(7);
+    std::vector<std::shared_ptr<Storylet>> storylets;
+    for (int i = 0; i < 6; i++) {
+        auto storylet = std::make_shared<Storylet>("s" + std::to_string(i));
+        storylet->SetRedraw((i < 2) ? REDRAW_NEVER : i - 1);
+        deck.AddStorylet(storylet);
+        storylets.push_back(storylet);
+    }
+
+    // Cooling and retired storylets drop out of draws, and come back when their cooldown ends.
+    storylets[0]->Play();
+    storylets[2]->Play();
+    storylets[4]->Play();
+    REQUIRE(deck.Draw().size() == 4);
+    storylets[5]->Play();
+    REQUIRE(deck.Draw().size() == 3);
+    storylets[1]->Play();
+    REQUIRE(deck.Draw().size() == 2);
+    storylets[3]->Play();
+    REQUIRE(deck.Draw().size() == 2);
+
+    // Playing a cooling storylet again extends its cooldown.
+    storylets[4]->Play();
+    REQUIRE_FALSE(storylets[4]->CanDraw(8));
+    storylets[3]->Play();
+    storylets[3]->Play();
+    for (auto& storylet : deck.Draw())
+        REQUIRE(storylet->CanDraw(9));
+
+    // Draws after loading match draws from the deck the state was saved from.
+    nlohmann::json saved = deck.SaveStateToJson();
+    auto drawAndPlay = [&deck]() {
+        auto storylet = deck.DrawAndPlaySingle();
+        return storylet ? storylet->id : "";
+    };
+    std::vector<std::string> expected;
+    for (int i = 0; i < 20; i++)
+        expected.push_back(drawAndPlay());
+    deck.Reset();
+    REQUIRE(deck.Draw().size() == 6);
+    deck.LoadStateFromJson(saved);
+    for (int i = 0; i < 20; i++)
+        REQUIRE(drawAndPlay() == expected[i]);
+
+    // Resetting one storylet brings it back straight away.
+    deck.Reset();
+    storylets[0]->Play();
+    storylets[0]->Reset();
+    REQUIRE(deck.Draw().size() == 6);
+
+    // Changing the redraw setting after a play applies at once, except to a cooldown already running.
+    storylets[0]->Play();
+    storylets[2]->Play();
+    REQUIRE(deck.Draw().size() == 4);
+    storylets[0]->SetRedraw(3);
+    storylets[2]->SetRedraw(REDRAW_ALWAYS);
+    REQUIRE(deck.Draw().size() == 6);
+    storylets[4]->Play();
+    storylets[4]->SetRedraw(1);
+    REQUIRE_FALSE(storylets[4]->CanDraw(deck.SaveStateToJson()["currentPlay"].get<int>() + 1));
+
+    // Loading a save applies the current redraw settings the same way.
+    deck.Reset();
+    storylets[0]->SetRedraw(3);
+    storylets[2]->SetRedraw(REDRAW_ALWAYS);
+    deck.LoadStateFromJson({{"currentPlay", 5}, {"storylets", {{"s0", REDRAW_NEVER}, {"s1", REDRAW_NEVER}, {"s2", 9}, {"s3", 9}}}});
+    REQUIRE(storylets[0]->CanDraw(5));
+    REQUIRE_FALSE(storylets[1]->CanDraw(100));
+    REQUIRE(storylets[2]->CanDraw(5));
+    REQUIRE_FALSE(storylets[3]->CanDraw(8));
+    REQUIRE(deck.Draw().size() == 4);
+}
+
+TEST_CASE("Condition cache") {
+    StoryletFramework::Context context;
+    int pureCalls = 0;
+    int volatileCalls = 0;
+    context["cache_level"] = 1;
+    context["cache_mood"] = std::string("calm");
+    context["cache_pure"] = ExpressionParser::make_function_wrapper([&pureCalls](int x) { pureCalls++; return x > 2; }, ExpressionParser::Purity::Pure);
+    context["cache_volatile"] = ExpressionParser::make_function_wrapper([&volatileCalls]() { volatileCalls++; return true; });
+    Deck deck(context);
+    auto levelled = std::make_shared<Storylet>("levelled");
+    levelled->SetCondition("cache_pure(cache_level)");
+    auto moody = std::make_shared<Storylet>("moody");
+    moody->SetCondition("cache_mood == 'calm' and cache_volatile()");
+    deck.AddStorylet(levelled);
+    deck.AddStorylet(moody);
+
+    // Conditions are only evaluated again when something they read changes,
+    // unless they call a function that isn't pure.
+    REQUIRE(deck.Draw().size() == 1);
+    REQUIRE(deck.Draw().size() == 1);
+    REQUIRE(pureCalls == 1);
+    REQUIRE(volatileCalls == 2);
+    context["cache_level"] = 3;
+    REQUIRE(deck.Draw().size() == 2);
+    REQUIRE(pureCalls == 2);
+    context["cache_mood"] = std::string("angry");
+    REQUIRE(deck.DrawSingle() == levelled);
+    REQUIRE(pureCalls == 2);
+
+    // Outcomes change the context too.
+    levelled->SetOutcome("default", JsonToKeyedMap(nlohmann::json::parse(R"({ "cache_level": "cache_level - 2" })")));
+    levelled->CompileOutcomes();
+    deck.Play(*levelled);
+    REQUIRE(deck.Draw().empty());
+
+    // As do changing a condition or replacing a function.
+    moody->SetCondition("cache_volatile()");
+    REQUIRE(deck.DrawSingle() == moody);
+    context["cache_pure"] = ExpressionParser::make_function_wrapper([](int) { return true; }, ExpressionParser::Purity::Pure);
+    REQUIRE(deck.Draw().size() == 2);
+
+    // A trace evaluates every condition.
+    DumpEval dump;
+    deck.Draw(-1, nullptr, &dump);
+    REQUIRE((!TracingEnabled || std::find(dump.begin(), dump.end(), "Evaluating condition for levelled") != dump.end()));
+}
+
+TEST_CASE("Range index") {
+    StoryletFramework::Context context;
+    context["range_wealth"] = 0;
+    context["range_mood"] = 1;
+    context["range_scale"] = 1;
+    Deck deck(context);
+    const char* conditions[] = {
+        "range_wealth >= 0", "range_wealth <= 0", "range_wealth > 2", "range_wealth < -1.5",
+        "2 <= range_wealth", "range_wealth >= 1 and range_mood > 0", "range_wealth < 3 and range_wealth > -3",
+        "range_wealth > 0 or range_mood > 0", "range_wealth == 2", "range_wealth * 2 > 3", "",
+        "range_scale / 2 > 0 and range_wealth >= 5"
+    };
+    for (int i = 0; i < 48; i++) {
+        auto storylet = std::make_shared<Storylet>("range_" + std::to_string(i));
+        storylet->SetCondition(conditions[i % 12]);
+        storylet->SetRedraw((i == 4) ? 1 : REDRAW_ALWAYS);
+        deck.AddStorylet(storylet);
+    }
+    deck.GetStorylet("range_4")->Play();
+
+    // The indexed draw returns exactly the storylets the evaluator would, or fails when it would.
+    auto check = [&]() {
+        std::set<std::string> expected;
+        bool fails = false;
+        for (int i = 0; i < 48; i++) {
+            auto storylet = deck.GetStorylet("range_" + std::to_string(i));
+            try {
+                if (storylet->CanDraw(1) && storylet->CheckCondition(context))
+                    expected.insert(storylet->id);
+            } catch (const std::exception&) {
+                fails = true;
+            }
+        }
+        if (fails) {
+            REQUIRE_THROWS(deck.Draw());
+            return;
+        }
+        std::set<std::string> drawn;
+        for (auto& storylet : deck.Draw())
+            drawn.insert(storylet->id);
+        REQUIRE(drawn == expected);
+    };
+    for (double wealth : { -4.0, -1.5, -1.0, 0.0, 0.5, 1.0, 2.0, 2.5, 3.0, 10.0 }) {
+        context["range_wealth"] = wealth;
+        check();
+        context["range_mood"] = 0;
+        check();
+        context["range_mood"] = 1;
+    }
+    context["range_wealth"] = 2;
+    check();
+    context["range_wealth"] = true;
+    check();
+    context["range_wealth"] = std::string("2");
+    check();
+    context["range_wealth"] = 1;
+    context["range_scale"] = std::string("abc");
+    REQUIRE_THROWS(deck.GetStorylet("range_11")->CheckCondition(context));
+    check();
+    context["range_scale"] = 1;
+
+    // A trace still evaluates indexed conditions.
+    DumpEval dump;
+    deck.Draw(-1, nullptr, &dump);
+    REQUIRE((!TracingEnabled || std::find(dump.begin(), dump.end(), "Evaluating condition for range_0") != dump.end()));
+
+    // Functions that aren't pure are still called when a comparison after them fails.
+    int rollCalls = 0;
+    context["range_wealth"] = 0;
+    context["range_roll"] = ExpressionParser::make_function_wrapper([&rollCalls]() { rollCalls++; return 2; });
+    Deck rolled(context);
+    auto storylet = std::make_shared<Storylet>("range_rolled");
+    storylet->SetCondition("range_roll() > 1 and range_wealth >= 5");
+    rolled.AddStorylet(storylet);
+    REQUIRE(rolled.Draw().empty());
+    REQUIRE(rollCalls == 1);
+}
+
+TEST_CASE("Equality index") {
+    StoryletFramework::Context context;
+    context["equality_npc"] = std::string("banker");
+    context["equality_place"] = std::string("docks");
+    context["equality_mood"] = 1;
+    Deck deck(context);
+    const char* conditions[] = {
+        "equality_npc == 'banker'", "equality_npc == 'thug' and equality_mood > 0", "equality_npc == 2",
+        "equality_npc == true", "equality_place == 'docks' and equality_npc == 'banker'", "equality_npc != 'banker'",
+        "'banker' == equality_npc", "equality_npc == 'true'", "equality_mood == 1", "equality_mood >= 1 and equality_npc == 'thug'"
+    };
+    for (int i = 0; i < 40; i++) {
+        auto storylet = std::make_shared<Storylet>("equality_" + std::to_string(i));
+        storylet->SetCondition(conditions[i % 10]);
+        deck.AddStorylet(storylet);
+    }
+
+    // The indexed draw returns exactly the storylets the evaluator would.
+    auto check = [&]() {
+        std::set<std::string> drawn;
+        for (auto& storylet : deck.Draw())
+            drawn.insert(storylet->id);
+        std::set<std::string> expected;
+        for (int i = 0; i < 40; i++) {
+            auto storylet = deck.GetStorylet("equality_" + std::to_string(i));
+            if (storylet->CheckCondition(context))
+                expected.insert(storylet->id);
+        }
+        REQUIRE(drawn == expected);
+        return drawn.size();
+    };
+    REQUIRE(check() == 16);
+    context["equality_place"] = std::string("market");
+    REQUIRE(check() == 12);
+    context["equality_npc"] = std::string("thug");
+    REQUIRE(check() == 16);
+    context["equality_mood"] = 0;
+    REQUIRE(check() == 4);
+    context["equality_npc"] = std::string("nobody");
+    check();
+    context["equality_npc"] = true;
+    check();
+    context["equality_npc"] = std::string("true");
+    check();
+    context["equality_npc"] = std::string("2");
+    check();
+
+    // Errors the evaluator would report aren't hidden by the index.
+    context["equality_npc"] = 2;
+    REQUIRE_THROWS_WITH(deck.Draw(), "Type mismatch: Expecting number but got 'banker'");
+
+    // Functions that aren't pure are still called when an equality after them fails.
+    int rollCalls = 0;
+    context["equality_npc"] = std::string("thug");
+    context["equality_roll"] = ExpressionParser::make_function_wrapper([&rollCalls]() { rollCalls++; return 2; });
+    Deck rolled(context);
+    auto storylet = std::make_shared<Storylet>("equality_rolled");
+    storylet->SetCondition("equality_roll() > 1 and equality_npc == 'banker'");
+    rolled.AddStorylet(storylet);
+    REQUIRE(rolled.Draw().empty());
+    REQUIRE(rollCalls == 1);
+
+    // So are type errors in comparisons before an equality that fails.
+    context["equality_level"] = std::string("abc");
+    storylet = std::make_shared<Storylet>("equality_levelled");
+    storylet->SetCondition("equality_level > 2 and equality_npc == 'banker'");
+    Deck levelled(context);
+    levelled.AddStorylet(storylet);
+    REQUIRE_THROWS_WITH(storylet->CheckCondition(context), "Type mismatch: Expecting number but got 'abc'");
+    REQUIRE_THROWS_WITH(levelled.Draw(), "Type mismatch: Expecting number but got 'abc'");
+}
+
+TEST_CASE("Condition graph") {
+    StoryletFramework::Context context;
+    int volatileCalls = 0;
+    context["graph_wealth"] = 1;
+    context["graph_street"] = std::string("docks");
+    context["graph_tag"] = ExpressionParser::make_function_wrapper([](std::string tag) { return tag == "shops"; }, ExpressionParser::Purity::Pure);
+    context["graph_roll"] = ExpressionParser::make_function_wrapper([&volatileCalls]() { volatileCalls++; return 2; });
+    const char* conditions[] = {
+        "graph_wealth >= 0 and graph_tag('shops')", "graph_wealth >= 0 and graph_tag('shops') and graph_street == 'docks'",
+        "graph_wealth >= 0 or graph_roll() > 1", "not graph_tag('shops') or graph_wealth * 2 > 3",
+        "graph_roll() > 1 and graph_wealth >= 0", ""
+    };
+    Deck separate(context);
+    Deck shared(context);
+    shared.useConditionGraph = true;
+    for (int i = 0; i < 30; i++) {
+        for (Deck* deck : {&separate, &shared}) {
+            auto storylet = std::make_shared<Storylet>("graph_" + std::to_string(i));
+            storylet->SetCondition(conditions[i % 6]);
+            deck->AddStorylet(storylet);
+        }
+    }
+
+    // Both decks draw the same storylets, and make the same calls to functions that aren't pure.
+    auto check = [&]() {
+        std::set<std::string> drawn[2];
+        int calls[2];
+        for (int i = 0; i < 2; i++) {
+            volatileCalls = 0;
+            for (auto& storylet : (i ? shared : separate).Draw())
+                drawn[i].insert(storylet->id);
+            calls[i] = volatileCalls;
+        }
+        REQUIRE(drawn[0] == drawn[1]);
+        REQUIRE(calls[0] == calls[1]);
+        return drawn[1].size();
+    };
+    REQUIRE(check() == 25);
+    REQUIRE(shared.GetSavedEvaluations() > 0);
+    context["graph_wealth"] = -1;
+    REQUIRE(check() == 10);
+    context["graph_street"] = std::string("market");
+    REQUIRE(check() == 10);
+    context["graph_wealth"] = 2;
+    REQUIRE(check() == 25);
+
+    // Changing a condition rebuilds the graph.
+    shared.GetStorylet("graph_5")->SetCondition("graph_wealth > 5");
+    separate.GetStorylet("graph_5")->SetCondition("graph_wealth > 5");
+    REQUIRE(check() == 24);
+}
+
+TEST_CASE("Call memo") {
+    StoryletFramework::Context context;
+    int stableCalls = 0;
+    context["memo_place"] = std::string("market");
+    context["memo_tag"] = ExpressionParser::make_function_wrapper([&stableCalls](std::string tag) { stableCalls++; return tag == "shops"; }, ExpressionParser::Purity::Stable);
+    Deck deck(context);
+    for (int i = 0; i < 20; i++) {
+        auto storylet = std::make_shared<Storylet>("memo_" + std::to_string(i));
+        storylet->SetCondition((i % 2) ? "memo_tag(memo_place) or memo_tag('shops')" : "memo_tag('docks')");
+        deck.AddStorylet(storylet);
+    }
+
+    // Stable functions are called once per draw for each set of arguments.
+    REQUIRE(deck.Draw().size() == 10);
+    REQUIRE(stableCalls == 3);
+    REQUIRE(deck.Draw().size() == 10);
+    REQUIRE(stableCalls == 6);
+    REQUIRE(deck.GetCallMemoStats().Hits == 54);
+    REQUIRE(deck.GetCallMemoStats().Misses == 6);
+    REQUIRE(deck.GetCallMemoStats().Entries == 0);
+    REQUIRE(context.GetCallMemo() == nullptr);
+
+    // A memo the caller attaches keeps results across draws.
+    ExpressionParser::CallMemo memo;
+    context.SetCallMemo(&memo);
+    context["memo_place"] = std::string("shops");
+    REQUIRE(deck.Draw().size() == 10);
+    REQUIRE(deck.Draw().size() == 10);
+    REQUIRE(stableCalls == 8);
+    REQUIRE(memo.GetStats().Entries == 2);
+    REQUIRE(context.GetCallMemo() == &memo);
+    context.SetCallMemo(nullptr);
+}
+
+TEST_CASE("Lazy draw") {
+    StoryletFramework::Context context;
+    int lowChecks = 0;
+    context["lazy_low"] = ExpressionParser::make_function_wrapper([&lowChecks]() { lowChecks++; return true; });
+    context["lazy_level"] = 2;
+    Deck deck(context);
+    for (int i = 0; i < 12; i++) {
+        auto storylet = std::make_shared<Storylet>("lazy_" + std::to_string(i));
+        if (i < 3) {
+            storylet->SetPriority(3);
+            storylet->SetRedraw(REDRAW_NEVER);
+        } else if (i < 5) {
+            storylet->SetPriority("lazy_level");
+        } else {
+            storylet->SetPriority(1);
+            storylet->SetCondition("lazy_low()");
+        }
+        deck.AddStorylet(storylet);
+    }
+
+    // Stopping after the first storylet leaves lower priorities unchecked.
+    for (const auto& storylet : deck.DrawLazy()) {
+        REQUIRE(storylet->CalcCurrentPriority(context, false) == 3);
+        break;
+    }
+    REQUIRE(lowChecks == 0);
+
+    // Iterating to the end draws what Draw does, in descending priority.
+    std::vector<std::string> lazy;
+    int last = 3;
+    for (const auto& storylet : deck.DrawLazy()) {
+        int priority = storylet->CalcCurrentPriority(context, false);
+        REQUIRE(priority <= last);
+        last = priority;
+        lazy.push_back(storylet->id);
+    }
+    REQUIRE(lowChecks == 7);
+    std::vector<std::string> drawn;
+    for (const auto& storylet : deck.Draw())
+        drawn.push_back(storylet->id);
+    std::sort(lazy.begin(), lazy.end());
+    std::sort(drawn.begin(), drawn.end());
+    REQUIRE(lazy == drawn);
+
+    // Filters apply, and storylets played while iterating aren't drawn.
+    int count = 0;
+    for (const auto& storylet : deck.DrawLazy([](const Storylet& storylet) { return storylet.id != "lazy_0"; })) {
+        REQUIRE(storylet->id != "lazy_0");
+        if (count++ == 0) {
+            deck.GetStorylet(storylet->id == "lazy_1" ? "lazy_2" : "lazy_1")->Play();
+        }
+    }
+    REQUIRE(count == 10);
+
+    // Playing a storylet between yields can rule out one with a priority expression that's still to come.
+    StoryletFramework::Context gateContext;
+    gateContext["lazy_open"] = true;
+    gateContext["lazy_rank"] = 2;
+    Deck gated(gateContext);
+    auto closer = std::make_shared<Storylet>("lazy_closer");
+    closer->SetPriority(5);
+    closer->SetOutcome("default", KeyedMap{ { "lazy_open", false } });
+    gated.AddStorylet(closer);
+    auto gate = std::make_shared<Storylet>("lazy_gated");
+    gate->SetPriority("lazy_rank");
+    gate->SetCondition("lazy_open");
+    gated.AddStorylet(gate);
+    std::vector<std::string> yielded;
+    for (const auto& storylet : gated.DrawLazy()) {
+        yielded.push_back(storylet->id);
+        storylet->Play();
+    }
+    REQUIRE(yielded == std::vector<std::string>{ "lazy_closer" });
+}
+
+TEST_CASE("Tiered draw") {
+    StoryletFramework::Context context;
+    int barkChecks = 0;
+    context["tier_bark"] = ExpressionParser::make_function_wrapper([&barkChecks]() { barkChecks++; return true; });
+    context["tier_beat"] = 2;
+    context["tier_urgent"] = 0;
+    Deck deck(context);
+    for (int i = 0; i < 20; i++) {
+        auto storylet = std::make_shared<Storylet>("tier_" + std::to_string(i));
+        if (i < 4) {
+            storylet->SetPriority(5);
+            storylet->SetCondition(i % 2 ? "tier_beat > 1" : "tier_beat > 2");
+        } else if (i == 4) {
+            storylet->SetPriority("tier_urgent");
+        } else {
+            storylet->SetCondition("tier_bark()");
+        }
+        deck.AddStorylet(storylet);
+    }
+
+    // Two beats pass, so drawing two never reaches the barks.
+    auto drawn = deck.Draw(2);
+    REQUIRE(drawn.size() == 2);
+    REQUIRE(drawn[0]->CalcCurrentPriority(context, false) == 5);
+    REQUIRE(drawn[1]->CalcCurrentPriority(context, false) == 5);
+    REQUIRE(barkChecks == 0);
+    REQUIRE(deck.DrawSingle()->CalcCurrentPriority(context, false) == 5);
+    REQUIRE(barkChecks == 0);
+
+    // A storylet with a priority expression is drawn from whichever tier it's in.
+    context["tier_urgent"] = 10;
+    REQUIRE(deck.DrawSingle()->id == "tier_4");
+    REQUIRE(barkChecks == 0);
+
+    // Drawing past the beats ties in the barks, drawn the same as checking everything.
+    context["tier_urgent"] = 0;
+    for (int i = 0; i < 20; i++) {
+        deck.useTieredDraw = true;
+        auto tiered = deck.Draw(4);
+        deck.useTieredDraw = false;
+        auto full = deck.Draw(4);
+        REQUIRE(tiered.size() == 4);
+        REQUIRE(full.size() == 4);
+        for (int j = 0; j < 2; j++) {
+            REQUIRE(tiered[j]->CalcCurrentPriority(context, false) == 5);
+            REQUIRE(full[j]->CalcCurrentPriority(context, false) == 5);
+        }
+        REQUIRE(tiered[2]->CalcCurrentPriority(context, false) == 0);
+        REQUIRE(tiered[3]->CalcCurrentPriority(context, false) == 0);
+    }
+    REQUIRE(barkChecks > 0);
+
+    // Priorities changed after adding are sorted into the right tier.
+    deck.GetStorylet("tier_10")->SetPriority(6);
+    deck.useTieredDraw = true;
+    REQUIRE(deck.DrawSingle()->id == "tier_10");
+}
+
+TEST_CASE("Thread pool") {
+    StoryletFramework::ThreadPool pool(3);
+    REQUIRE(pool.GetThreadCount() == 3);
+
+    std::vector<int> done(1000, 0);
+    pool.ParallelFor(done.size(), [&done](size_t i) { done[i]++; });
+    REQUIRE(std::count(done.begin(), done.end(), 1) == 1000);
+
+    // Nested calls help rather than wait, and the lowest failing index is the one rethrown.
+    std::atomic<int> inner{0};
+    pool.ParallelFor(8, [&pool, &inner](size_t) { pool.ParallelFor(8, [&inner](size_t) { inner++; }); });
+    REQUIRE(inner == 64);
+    REQUIRE_THROWS_WITH(pool.ParallelFor(100, [](size_t i) { if (i % 10 == 3) throw std::runtime_error("failed " + std::to_string(i)); }), "failed 3");
+}
+
+TEST_CASE("Parallel draw") {
+    StoryletFramework::Context context;
+    context["par_wealth"] = 0;
+    context["par_place"] = std::string("docks");
+    context["par_check"] = ExpressionParser::make_function_wrapper([](int n) { return n % 3 != 0; }, ExpressionParser::Purity::Stable);
+    const char* places[] = { "docks", "market", "castle" };
+    auto makeDeck = [&context, &places]() {
+        auto deck = std::make_unique<Deck>(context);
+        for (int i = 0; i < 20000; i++) {
+            auto storylet = std::make_shared<Storylet>("par_" + std::to_string(i));
+            switch (i % 4) {
+                case 0: storylet->SetCondition("par_wealth >= " + std::to_string(i % 5 - 2)); break;
+                case 1: storylet->SetCondition(std::string("par_place == '") + places[i % 3] + "'"); break;
+                case 2: storylet->SetCondition("par_check(" + std::to_string(i) + ") and par_wealth + 1 > 0"); break;
+                default: storylet->SetPriority("par_wealth + " + std::to_string(i % 3)); break;
+            }
+            if (i % 7 == 0)
+                storylet->SetPriority(i % 5);
+            storylet->SetRedraw(2);
+            deck->AddStorylet(storylet);
+        }
+        deck->GetRandom().Seed(11);
+        return deck;
+    };
+    auto serial = makeDeck();
+    auto parallel = makeDeck();
+    parallel->SetExecutor(std::make_shared<StoryletFramework::ThreadPool>(4));
+
+    // The same seed draws the same storylets in the same order, with or without the pool.
+    auto ids = [](const std::vector<std::shared_ptr<Storylet>>& drawn) {
+        std::vector<std::string> result;
+        for (const auto& storylet : drawn)
+            result.push_back(storylet->id);
+        return result;
+    };
+    auto odd = [](const Storylet& storylet) { return storylet.id.back() % 2 == 1; };
+    for (int i = 0; i < 6; i++) {
+        context["par_wealth"] = i % 4 - 1;
+        context["par_place"] = std::string(places[i % 3]);
+        REQUIRE(ids(serial->Draw()) == ids(parallel->Draw()));
+        REQUIRE(ids(serial->DrawAndPlay(20)) == ids(parallel->DrawAndPlay(20)));
+        REQUIRE(ids(serial->Draw(50, odd)) == ids(parallel->Draw(50, odd)));
+        serial->useTieredDraw = parallel->useTieredDraw = (i % 2 == 0);
+    }
+
+    // Errors are the ones the serial draw would raise.
+    serial->GetStorylet("par_9000")->SetCondition("par_missing()");
+    parallel->GetStorylet("par_9000")->SetCondition("par_missing()");
+    std::string serialError, parallelError;
+    try { serial->Draw(); } catch (const std::exception& e) { serialError = e.what(); }
+    try { parallel->Draw(); } catch (const std::exception& e) { parallelError = e.what(); }
+    REQUIRE(!serialError.empty());
+    REQUIRE(serialError == parallelError);
+    REQUIRE(context.GetCallMemo() == nullptr);
+}
+
+TEST_CASE("Loading from many threads") {
+    const std::vector<std::string> files = { "Streets.jsonc", "Encounters.jsonc", "Barks.jsonc" };
+    std::vector<nlohmann::json> decks;
+    for (const auto& file : files)
+        decks.push_back(loadJsonFile(file));
+
+    // Each thread loads every sample deck into its own context, again and again.
+    std::vector<std::string> errors(8);
+    std::vector<size_t> loaded(8, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+        threads.emplace_back([&, t]() {
+            try {
+                for (int round = 0; round < 20; round++) {
+                    StoryletFramework::Context context;
+                    for (const auto& json : decks) {
+                        auto deck = DeckFromJson(json, &context);
+                        loaded[t] += deck ? 1 : 0;
+                    }
+                }
+            } catch (const std::exception& e) {
+                errors[t] = e.what();
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (int t = 0; t < 8; t++) {
+        REQUIRE(errors[t] == "");
+        REQUIRE(loaded[t] == 20 * files.size());
+    }
+}
+
+TEST_CASE("Loading packets in parallel") {
+    // Later packets' context refers to earlier packets', so context must be set up in order.
+    std::vector<std::string> texts;
+    for (int p = 0; p < 12; p++) {
+        std::string context = p == 0 ? "\"pk_0\": 1" : "\"pk_" + std::to_string(p) + "\": \"pk_" + std::to_string(p - 1) + " + 1\"";
+        std::string text = "{ \"context\": { " + context + " },\n  // Packet " + std::to_string(p) + "\n  \"defaults\": { \"priority\": " + std::to_string(p % 3) + " },\n  \"storylets\": [\n";
+        for (int i = 0; i < 40; i++)
+            text += "    { \"id\": \"pk_" + std::to_string(p) + "_" + std::to_string(i) + "\", \"condition\": \"pk_" + std::to_string(p) + " > " + std::to_string(i % 15) + "\" },\n";
+        text += "    { \"defaults\": { \"redraw\": \"never\" }, \"storylets\": [ { \"id\": \"pk_" + std::to_string(p) + "_nested\" } ] }\n  ]\n}";
+        texts.push_back(text);
+    }
+
+    StoryletFramework::Context serialContext;
+    auto serial = std::make_shared<Deck>(serialContext);
+    for (const auto& text : texts)
+        _readPacketFromJson(*serial, nlohmann::json::parse(text, nullptr, true, true), nlohmann::json::object());
+
+    StoryletFramework::Context parallelContext;
+    StoryletFramework::ThreadPool pool(4);
+    auto parallel = DeckFromJsonTexts(texts, &parallelContext, &pool);
+    REQUIRE(parallelContext["pk_11"].GetValue().AsNumber() == 12);
+
+    // Storylets are added in the same order, so a seeded draw is the same.
+    serial->GetRandom().Seed(5);
+    parallel->GetRandom().Seed(5);
+    std::vector<std::string> serialIds, parallelIds;
+    for (const auto& storylet : serial->Draw())
+        serialIds.push_back(storylet->id);
+    for (const auto& storylet : parallel->Draw())
+        parallelIds.push_back(storylet->id);
+    REQUIRE(serialIds.size() > 100);
+    REQUIRE(serialIds == parallelIds);
+    REQUIRE(parallel->GetStorylet("pk_4_nested")->GetRedraw() == REDRAW_NEVER);
+
+    // The error is the first packet's to fail, naming it.
+    texts[3] = "{ \"storylets\": [ { \"id\": \"bad\", \"condition\": \"1 +\" } ] }";
+    texts[7] = "{ \"storylets\": [ { \"no_id\": true } ] }";
+    StoryletFramework::Context failedContext;
+    REQUIRE_THROWS_WITH(DeckFromJsonTexts(texts, &failedContext, &pool), Catch::Matchers::StartsWith("Packet 3: "));
+}
+
+TEST_CASE("Streaming packets") {
+    const std::string text = R"({
+        "context": { "sp_wealth": 2, "sp_double": "sp_wealth * 2" },
+        // Defaults apply to everything after them, and nested packets add their own.
+        "defaults": { "priority": 1, "redraw": "never" },
+        "storylets": [
+            { "content": { "text": "First", "tags": ["a", "b"] }, "id": "sp_first", "condition": "sp_double > 3" },
+            { "id": "sp_second", "priority": "sp_wealth + 1", "outcomes": { "default": { "sp_wealth": "sp_wealth + 1" } } },
+            /* A nested packet */
+            { "ignored": true, "context": { "sp_nested": true }, "defaults": { "redraw": 3 }, "storylets": [
+                { "id": "sp_nested_1", "condition": "sp_nested" },
+                { "defaults": { "priority": 5 }, "storylets": [ { "id": "sp_deep" } ] }
+            ] },
+            { "id": "sp_after" }
+        ]
+    })";
+
+    // The same deck as loading the whole document, with content packed.
+    StoryletFramework::Context domContext;
+    auto dom = DeckFromJson(nlohmann::json::parse(text, nullptr, true, true), &domContext);
+    StoryletFramework::Context streamContext;
+    std::istringstream input(text);
+    auto streamed = DeckFromJsonStream(input, &streamContext);
+
+    REQUIRE(streamContext["sp_double"].GetValue().AsNumber() == 4);
+    REQUIRE(streamContext["sp_nested"].GetValue().AsBool());
+    for (const char* id : { "sp_first", "sp_second", "sp_nested_1", "sp_deep", "sp_after" }) {
+        auto a = dom->GetStorylet(id);
+        auto b = streamed->GetStorylet(id);
+        REQUIRE(b != nullptr);
+        REQUIRE(a->GetRedraw() == b->GetRedraw());
+        REQUIRE(a->CalcCurrentPriority(domContext) == b->CalcCurrentPriority(streamContext));
+        REQUIRE(a->CheckCondition(domContext) == b->CheckCondition(streamContext));
+        REQUIRE(a->GetOutcomes().size() == b->GetOutcomes().size());
+        REQUIRE(a->content.has_value() == b->content.has_value());
+    }
+    REQUIRE(streamed->GetStorylet("sp_deep")->GetRedraw() == 3);
+    REQUIRE(streamed->GetStorylet("sp_deep")->CalcCurrentPriority(streamContext, false) == 5);
+    REQUIRE(streamed->GetStorylet("sp_after")->GetRedraw() == REDRAW_NEVER);
+    REQUIRE(ExtractJsonFromAny(streamed->GetStorylet("sp_first")->content) == ExtractJsonFromAny(dom->GetStorylet("sp_first")->content));
+
+    // Storylets are added in the same order, so a seeded draw is the same.
+    dom->GetRandom().Seed(3);
+    streamed->GetRandom().Seed(3);
+    std::vector<std::string> domIds, streamIds;
+    for (const auto& storylet : dom->Draw())
+        domIds.push_back(storylet->id);
+    for (const auto& storylet : streamed->Draw())
+        streamIds.push_back(storylet->id);
+    REQUIRE(domIds == streamIds);
+
+    // What can't be streamed, or isn't a packet, is an error.
+    auto stream = [](const std::string& text) {
+        std::istringstream input(text);
+        StoryletFramework::Context context;
+        DeckFromJsonStream(input, &context);
+    };
+    REQUIRE_THROWS_WITH(stream(R"({ "storylets": [], "defaults": {} })"), "'defaults' has to come before 'storylets' in a packet that's streamed.");
+    REQUIRE_THROWS_WITH(stream(R"({ "storylets": [ { "condition": "true" } ] })"), "Json item is not a storylet or packet");
+    REQUIRE_THROWS_WITH(stream(R"([ 1 ])"), "A packet should be an object.");
+    REQUIRE_THROWS(stream(R"({ "storylets": [ { "id": "x" )"));
+}
+
+// Storylets loaded two ways should behave the same in their own contexts
+static void RequireSameStorylet(const Storylet& a, const Context& aContext, const Storylet& b, const Context& bContext) {
+    INFO(a.id);
+    REQUIRE(a.id == b.id);
+    REQUIRE(a.GetRedraw() == b.GetRedraw());
+    REQUIRE(a.CheckCondition(aContext) == b.CheckCondition(bContext));
+    REQUIRE(a.CalcCurrentPriority(aContext, true) == b.CalcCurrentPriority(bContext, true));
+    REQUIRE(a.HasStaticPriority() == b.HasStaticPriority());
+    REQUIRE(a.GetOutcomes().size() == b.GetOutcomes().size());
+    REQUIRE(a.content.has_value() == b.content.has_value());
+    if (a.content.has_value())
+        REQUIRE(ExtractJsonFromAny(a.content) == ExtractJsonFromAny(b.content));
+}
+
+static std::shared_ptr<const DeckImage> CompileImage(const std::vector<nlohmann::json>& packets) {
+    std::ostringstream output;
+    DeckImage::Compile(packets, output);
+    std::string bytes = output.str();
+    return DeckImage::FromBytes(std::vector<uint8_t>(bytes.begin(), bytes.end()));
+}
+
+TEST_CASE("Deck images") {
+    const std::string text = R"({
+        "context": { "di_wealth": 2, "di_double": "di_wealth * 2", "di_name": "'docks'" },
+        "defaults": { "priority": 1, "redraw": "never" },
+        "storylets": [
+            { "id": "di_first", "condition": "di_double > 3 and di_name == 'docks'", "content": { "text": "First", "tags": ["a", "b"], "weight": 1.5 } },
+            { "id": "di_second", "priority": "di_wealth + 1", "redraw": 2,
+              "outcomes": { "default": { "di_wealth": "di_wealth + 1", "di_name": "'yards'" }, "fail": { "di_wealth": 0 } } },
+            { "context": { "di_nested": true }, "defaults": { "priority": 5 }, "storylets": [
+                { "id": "di_nested_1", "condition": "di_nested and di_double > 3" },
+                { "id": "di_nested_2", "condition": "true and di_wealth >= 0", "redraw": "always" }
+            ] },
+            { "id": "di_after", "condition": "" }
+        ]
+    })";
+    const std::vector<std::string> ids = { "di_first", "di_second", "di_nested_1", "di_nested_2", "di_after" };
+    nlohmann::json json = nlohmann::json::parse(text, nullptr, true, true);
+
+    StoryletFramework::Context jsonContext;
+    auto fromJson = DeckFromJson(json, &jsonContext);
+    StoryletFramework::Context imageContext;
+    auto image = CompileImage({ json });
+    auto fromImage = DeckFromImage(*image, &imageContext);
+
+    // Context is evaluated as it's read, and storylets are the same.
+    REQUIRE(imageContext["di_double"].GetValue().AsNumber() == 4);
+    REQUIRE(imageContext["di_name"].GetValue().AsString() == "docks");
+    REQUIRE(imageContext["di_nested"].GetValue().AsBool());
+    for (const auto& id : ids) {
+        REQUIRE(fromImage->GetStorylet(id) != nullptr);
+        RequireSameStorylet(*fromJson->GetStorylet(id), jsonContext, *fromImage->GetStorylet(id), imageContext);
+    }
+    REQUIRE(std::any_cast<std::string>(std::any_cast<const KeyedMap&>(fromImage->GetStorylet("di_second")->GetOutcomes().at("default")).at("di_wealth")) == "di_wealth + 1");
+    REQUIRE(fromImage->GetStorylet("di_first")->content.type() == typeid(MappedJson));
+
+    // Seeded draws and outcomes are the same.
+    fromJson->GetRandom().Seed(9);
+    fromImage->GetRandom().Seed(9);
+    for (int round = 0; round < 3; round++) {
+        std::vector<std::string> jsonIds, imageIds;
+        for (const auto& storylet : fromJson->DrawAndPlay(2))
+            jsonIds.push_back(storylet->id);
+        for (const auto& storylet : fromImage->DrawAndPlay(2))
+            imageIds.push_back(storylet->id);
+        REQUIRE(jsonIds == imageIds);
+    }
+    fromJson->GetStorylet("di_second")->Reset();
+    fromImage->GetStorylet("di_second")->Reset();
+    fromJson->GetStorylet("di_second")->Play();
+    fromImage->GetStorylet("di_second")->Play();
+    REQUIRE(imageContext["di_wealth"].GetValue().AsNumber() == jsonContext["di_wealth"].GetValue().AsNumber());
+    REQUIRE(imageContext["di_name"].GetValue().AsString() == "yards");
+
+    // Files are mapped, and content stays readable after the image itself is let go.
+    auto path = (std::filesystem::temp_directory_path() / "storylet_framework_test.sfd").string();
+    {
+        std::ofstream file(path, std::ios::out | std::ios::binary);
+        DeckImage::Compile({ json }, file);
+    }
+    StoryletFramework::Context fileContext;
+    auto fromFile = DeckFromImageFile(path, &fileContext);
+    std::filesystem::remove(path);
+    REQUIRE(ExtractJsonFromAny(fromFile->GetStorylet("di_first")->content)["weight"] == 1.5);
+    REQUIRE_THROWS_WITH(DeckFromImageFile(path), Catch::Matchers::StartsWith("Failed to open deck image"));
+
+    // Each expression keeps its own bytecode even when the global cache drops it before the image is written.
+    auto& cache = ExpressionParser::ExpressionCache::Global();
+    size_t capacity = cache.GetCapacity();
+    cache.SetCapacity(1);
+    std::vector<nlohmann::json> packets = { nlohmann::json::parse(R"({ "context": { "di_cap": 5 } })") };
+    for (int i = 0; i < 50; i++)
+        packets.push_back({ { "storylets", { { { "id", "di_cap_" + std::to_string(i) }, { "condition", "di_cap > " + std::to_string(i) } } } } });
+    auto bounded = CompileImage(packets);
+    cache.SetCapacity(capacity);
+    StoryletFramework::Context boundedContext;
+    REQUIRE(DeckFromImage(*bounded, &boundedContext)->Draw().size() == 5);
+
+    // Images that aren't this version, or are damaged, are errors.
+    std::vector<uint8_t> bytes(image->GetBytes().begin(), image->GetBytes().end());
+    auto load = [](std::vector<uint8_t> bytes) {
+        StoryletFramework::Context context;
+        DeckFromImage(*DeckImage::FromBytes(std::move(bytes)), &context);
+    };
+    REQUIRE_NOTHROW(load(bytes));
+    REQUIRE_THROWS_WITH(load(std::vector<uint8_t>(bytes.begin(), bytes.begin() + 40)), "Not a deck image.");
+    auto newer = bytes;
+    newer[4] = 2;
+    REQUIRE_THROWS_WITH(load(newer), "Deck image is version 2; expected version 1.");
+    auto truncated = std::vector<uint8_t>(bytes.begin(), bytes.end() - 64);
+    REQUIRE_THROWS_WITH(load(truncated), "Deck image is corrupt: a section is out of range");
+    REQUIRE_THROWS_WITH(CompileImage({ nlohmann::json::parse(R"({ "storylets": [ { "id": "x", "condition": "1 +" } ] })") }), Catch::Matchers::StartsWith("Packet 0: "));
+}
+
+TEST_CASE("Deck images of the sample decks") {
+    const std::vector<std::string> files = { "Streets.jsonc", "Encounters.jsonc", "Barks.jsonc" };
+
+    // Each sample in its own deck, sharing a context, loaded from JSON and from an image.
+    StoryletFramework::Context jsonContext;
+    StoryletFramework::Context imageContext;
+    for (auto* context : { &jsonContext, &imageContext }) {
+        (*context)["street_id"] = "docks";
+        (*context)["street_wealth"] = 1;
+        (*context)["street_tag"] = ExpressionParser::make_function_wrapper([](const std::string& tag) { return tag == "water"; });
+        (*context)["encounter_tag"] = ExpressionParser::make_function_wrapper([](const std::string&) { return false; });
+    }
+    for (const auto& file : files) {
+        INFO(file);
+        nlohmann::json json = loadJsonFile(file);
+        auto fromJson = DeckFromJson(json, &jsonContext);
+        auto fromImage = DeckFromImage(*CompileImage({ json }), &imageContext);
+
+        for (const auto& item : json["storylets"]) {
+            if (item.contains("id"))
+                RequireSameStorylet(*fromJson->GetStorylet(item["id"]), jsonContext, *fromImage->GetStorylet(item["id"]), imageContext);
+        }
+
+        fromJson->GetRandom().Seed(11);
+        fromImage->GetRandom().Seed(11);
+        std::vector<std::string> jsonIds, imageIds;
+        for (const auto& storylet : fromJson->Draw())
+            jsonIds.push_back(storylet->id);
+        for (const auto& storylet : fromImage->Draw())
+            imageIds.push_back(storylet->id);
+        REQUIRE(jsonIds == imageIds);
+    }
+    REQUIRE(ContextUtils::DumpContext(jsonContext) == ContextUtils::DumpContext(imageContext));
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of an MIT-licensed project: see LICENSE file or README.md for details.
+ * Copyright (c) 2025 Ian Thomas
+ */
+
+// Compiles JSONC packets into a deck image, to load with DeckFromImageFile. Packets are loaded in
+// the order given, and errors name them by their position in that order, from 0.
+//
+// sfc <image> <packet>...
+
+#include "storylet_framework/deck_image.h"
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace StoryletFramework;
+
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: sfc <image> <packet>..." << std::endl;
+        return 2;
+    }
+
+    try
+    {
+        std::vector<nlohmann::json> packets;
+        for (int i = 2; i < argc; i++)
+        {
+            std::ifstream file(argv[i], std::ios::in | std::ios::binary);
+            if (!file.is_open())
+            {
+                throw std::runtime_error(std::string("Failed to open packet: ") + argv[i]);
+            }
+            try
+            {
+                packets.push_back(nlohmann::json::parse(file, nullptr, true, true));
+            }
+            catch (const std::exception& e)
+            {
+                throw std::runtime_error(std::string(argv[i]) + ": " + e.what());
+            }
+        }
+
+        // Compiled in memory first, so a failure doesn't leave a partial image behind
+        std::ostringstream image;
+        DeckImage::Compile(packets, image);
+        std::ofstream output(argv[1], std::ios::out | std::ios::binary | std::ios::trunc);
+        output << image.str();
+        if (!output)
+        {
+            throw std::runtime_error(std::string("Failed to write deck image: ") + argv[1]);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "sfc: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}